@@ -77,7 +77,8 @@ static noreturn void mouse_handler(void) {
         // we will get some spurious packets at the beginning and they will screw
         // up the alignment of the handler cycle so just ignore everything in
         // the first 250 milliseconds after boot
-        if (time_monotonic.tv_sec == 0 && time_monotonic.tv_nsec < 250000000) {
+        struct timespec uptime = time_get_monotonic();
+        if (uptime.tv_sec == 0 && uptime.tv_nsec < 250000000) {
             inb(0x60);
             continue;
         }
@@ -5,6 +5,9 @@
 #include <dev/video/fbdev.k.h>
 #include <dev/ps2.k.h>
 #include <dev/pci.k.h>
+#include <lib/lockstat.k.h>
+#include <mm/pmm.k.h>
+#include <mm/slab.k.h>
 
 void dev_init(void) {
     ps2_init();
@@ -13,4 +16,9 @@ void dev_init(void) {
     streams_init();
     pci_init();
     fbdev_init();
+    slabinfo_init();
+    meminfo_init();
+#if LOCKSTAT
+    lockstat_init();
+#endif
 }
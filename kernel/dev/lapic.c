@@ -33,6 +33,10 @@ void lapic_timer_stop(void) {
     lapic_write(LAPIC_REG_LVT_TIMER, 1 << 16);
 }
 
+bool lapic_timer_armed(void) {
+    return lapic_read(LAPIC_REG_TIMER_CURCNT) != 0;
+}
+
 // Enable for all cores
 void lapic_init(void) {
     ASSERT((rdmsr(0x1b) & 0xfffff000) == 0xfee00000);
@@ -77,14 +81,17 @@ void lapic_timer_calibrate(void) {
     uint64_t samples = 0xfffff;
 
     uint16_t initial_tick = pit_get_current_count();
+    uint64_t initial_tsc = rdtsc();
 
     lapic_write(LAPIC_REG_TIMER_INITCNT, (uint32_t)samples);
     while (lapic_read(LAPIC_REG_TIMER_CURCNT) != 0);
 
     uint16_t final_tick = pit_get_current_count();
+    uint64_t final_tsc = rdtsc();
 
     uint64_t total_ticks = initial_tick - final_tick;
     this_cpu()->lapic_freq = (samples / total_ticks) * PIT_DIVIDEND;
+    this_cpu()->tsc_freq = ((final_tsc - initial_tsc) * PIT_DIVIDEND) / total_ticks;
 
     lapic_timer_stop();
 }
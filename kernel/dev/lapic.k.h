@@ -2,11 +2,13 @@
 #define _DEV__LAPIC_K_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 void lapic_init(void);
 void lapic_eoi(void);
 void lapic_timer_oneshot(uint64_t us, uint8_t vector);
 void lapic_timer_stop(void);
+bool lapic_timer_armed(void);
 void lapic_send_ipi(uint32_t lapic_id, uint32_t vec);
 void lapic_timer_calibrate(void);
 
@@ -276,7 +276,7 @@ static noreturn void e8254x_routine(struct e8254x_device *device) {
                 device->rxdescs[device->rxtail].status = 0; // reset status
 
                 if (device->rxdescs[device->rxtail].len <= device->mtu + NET_LINKLAYERFRAMESIZE(device)) { // MTU excludes link layer frame
-                    struct net_packet *packet = alloc(sizeof(struct net_packet));
+                    struct net_packet *packet = kmem_cache_alloc(&net_packet_cache);
                     packet->len = device->rxdescs[device->rxtail].len;
                     packet->data = alloc(packet->len);
                     memcpy(packet->data, (void *)device->rxdescs[device->rxtail].addr, packet->len);
@@ -394,7 +394,9 @@ static void e8254x_initcontroller(struct pci_device *device) {
     // dev->ip = NET_IPSTRUCT(NET_IP(192, 168, 122, 2));
 
     devtmpfs_add_device((struct resource *)dev, dev->ifname);
-    sched_new_kernel_thread(e8254x_routine, dev, true);
+    struct thread *routine = sched_new_kernel_thread(e8254x_routine, dev, false);
+    sched_set_policy(routine, SCHED_FIFO, SCHED_RT_PRIO_IO);
+    sched_enqueue_thread(routine, false);
 }
 
 
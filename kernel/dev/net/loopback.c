@@ -6,7 +6,7 @@
 void net_inlineifhandler(struct net_adapter *adapter, struct net_packet *packet);
 
 static void loopback_transmitpacket(struct net_adapter *device, const void *data, size_t length) {
-    struct net_packet *packet = alloc(sizeof(struct net_packet));
+    struct net_packet *packet = kmem_cache_alloc(&net_packet_cache);
     packet->len = length;
     packet->data = alloc(length);
     memcpy(packet->data, data, length);
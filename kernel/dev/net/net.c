@@ -18,6 +18,8 @@
 #include <sched/sched.k.h>
 #include <time/time.k.h>
 
+struct kmem_cache net_packet_cache = KMEM_CACHE_INIT("net_packet", sizeof(struct net_packet), _Alignof(struct net_packet), NULL);
+
 static int net_ethcount = 0;
 static VECTOR_TYPE(struct net_adapter *) net_adapters = VECTOR_INIT;
 static uint8_t *net_portbitmap; // use a bitmap to keep track of port allocations
@@ -224,7 +226,7 @@ ssize_t net_sendinet(struct net_adapter *adapter, struct net_inetaddr src, struc
         free(buffer);
     } else { // if it's an interface we have access to, just feed the packet right into it as if it were a loopback device (we also do not have to care about MTU)
         struct net_adapter *a = net_findadapterbyip(dest);
-        struct net_packet *packet = alloc(sizeof(struct net_packet));
+        struct net_packet *packet = kmem_cache_alloc(&net_packet_cache);
         packet->len = NET_LINKLAYERFRAMESIZE(adapter) + sizeof(struct net_inetheader) + length;
         packet->data = alloc(packet->len);
         memcpy(packet->data, buffer, packet->len);
@@ -857,11 +859,15 @@ void net_register(struct net_adapter *adapter) {
     adapter->cachelock = (spinlock_t)SPINLOCK_INIT;
     adapter->addrcachelock = (spinlock_t)SPINLOCK_INIT;
 
-    sched_new_kernel_thread(net_ifhandler, adapter, true);
+    struct thread *ifhandler = sched_new_kernel_thread(net_ifhandler, adapter, false);
+    sched_set_policy(ifhandler, SCHED_FIFO, SCHED_RT_PRIO_IO);
+    sched_enqueue_thread(ifhandler, false);
 }
 
 void net_init(void) {
     net_portbitmap = alloc(NET_PORTRANGEEND - NET_PORTRANGESTART);
     loopback_init();
-    sched_new_kernel_thread(net_fraghandler, NULL, true);
+    struct thread *fraghandler = sched_new_kernel_thread(net_fraghandler, NULL, false);
+    sched_set_policy(fraghandler, SCHED_FIFO, SCHED_RT_PRIO_IO);
+    sched_enqueue_thread(fraghandler, false);
 }
@@ -4,6 +4,7 @@
 #include <lib/lock.k.h>
 #include <lib/resource.k.h>
 #include <lib/vector.k.h>
+#include <mm/slab.k.h>
 #include <net/if.h>
 #include <stdint.h>
 #include <sys/socket.h>
@@ -82,6 +83,8 @@ struct net_packet { // high-level kernel interface for packets
     uint8_t *data;
 };
 
+extern struct kmem_cache net_packet_cache;
+
 struct net_inethwpair {
     struct net_inetaddr inet;
     struct net_macaddr hw;
@@ -3,6 +3,7 @@
 #include <dev/storage/partition.k.h>
 #include <fs/devtmpfs.k.h>
 #include <lib/alloc.k.h>
+#include <lib/mutex.k.h>
 #include <lib/print.k.h>
 #include <lib/resource.k.h>
 #include <mm/vmm.k.h>
@@ -278,6 +279,7 @@ struct nvme_device {
 // individual namespace
 struct nvme_nsdevice {
     struct resource;
+    struct mutex mutex;
     struct nvme_queue queue;
     struct nvme_device *controller;
     size_t nsid;
@@ -543,8 +545,8 @@ notfound:
 // read `count` bytes at `loc` into `buf`
 static ssize_t nvme_read(struct resource *_this, struct f_description *description, void *buf, off_t loc, size_t count) {
     (void)description;
-    spinlock_acquire(&_this->lock);
     struct nvme_nsdevice *this = (struct nvme_nsdevice *)_this;
+    mutex_acquire(&this->mutex);
 
     for (size_t progress = 0; progress < count;) {
         uint64_t sector = (loc + progress) / this->cacheblocksize;
@@ -552,7 +554,7 @@ static ssize_t nvme_read(struct resource *_this, struct f_description *descripti
         if (slot == -1) {
             slot = nvme_cacheblock(this, sector); // request a cache so next time we can just hit that for this block
             if (slot == -1) {
-                spinlock_release(&this->lock);
+                mutex_release(&this->mutex);
                 return -1;
             }
         }
@@ -566,14 +568,14 @@ static ssize_t nvme_read(struct resource *_this, struct f_description *descripti
         progress += chunk;
     }
 
-    spinlock_release(&this->lock);
+    mutex_release(&this->mutex);
     return count;
 }
 
 static ssize_t nvme_write(struct resource *_this, struct f_description *description, const void *buf, off_t loc, size_t count) {
     (void)description;
-    spinlock_acquire(&_this->lock);
     struct nvme_nsdevice *this = (struct nvme_nsdevice *)_this;
+    mutex_acquire(&this->mutex);
 
     for (size_t progress = 0; progress < count;) {
         uint64_t sector = (loc + progress) / this->cacheblocksize;
@@ -581,7 +583,7 @@ static ssize_t nvme_write(struct resource *_this, struct f_description *descript
         if (slot == -1) {
             slot = nvme_cacheblock(this, sector);
             if (slot == -1) {
-                spinlock_release(&this->lock);
+                mutex_release(&this->mutex);
                 return -1;
             }
         }
@@ -597,13 +599,13 @@ static ssize_t nvme_write(struct resource *_this, struct f_description *descript
         this->cache[slot].status = NVME_READYCACHE; // in usage (allow for cache hits)
         int ret = nvme_rwlba(this, this->cache[slot].cache, (this->cacheblocksize / this->lbasize) * this->cache[slot].block, this->cacheblocksize / this->lbasize, 1);
         if (ret == -1) {
-            spinlock_release(&this->lock);
+            mutex_release(&this->mutex);
             return -1;
         }
         progress += chunk;
     }
 
-    spinlock_release(&this->lock);
+    mutex_release(&this->mutex);
     return count;
 }
 
@@ -11,6 +11,7 @@
 #include <lib/resource.k.h>
 #include <mm/mmap.k.h>
 #include <mm/pmm.k.h>
+#include <mm/vmalloc.k.h>
 #include <mm/vmm.k.h>
 #include <sys/stat.h>
 #include <time/time.k.h>
@@ -65,7 +66,7 @@ static ssize_t devtmpfs_resource_write(struct resource *_this, struct f_descript
             new_capacity *= 2;
         }
 
-        void *new_data = realloc(this->data, new_capacity);
+        void *new_data = vrealloc(this->data, new_capacity);
         if (new_data == NULL) {
             errno = ENOMEM;
             goto fail;
@@ -96,7 +97,7 @@ static void *devtmpfs_resource_mmap(struct resource *_this, size_t file_page, in
 
     void *ret = NULL;
     if ((flags & MAP_SHARED) != 0) {
-        ret = (this->data + file_page * PAGE_SIZE) - VMM_HIGHER_HALF;
+        ret = (void *)vmm_virt2phys(vmm_kernel_pagemap, (uintptr_t)this->data + file_page * PAGE_SIZE);
     } else {
         ret = pmm_alloc_nozero(1);
         if (ret == NULL) {
@@ -137,15 +138,12 @@ static bool devtmpfs_truncate(struct resource *this_, struct f_description *desc
             new_capacity *= 2;
         }
 
-        void *new_data = alloc(new_capacity);
+        void *new_data = vrealloc(this->data, new_capacity);
         if (new_data == NULL) {
             errno = ENOMEM;
             goto fail;
         }
 
-        memcpy(new_data, this->data, this->capacity);
-        free(this->data);
-
         this->data = new_data;
         this->capacity = new_capacity;
     }
@@ -167,7 +165,7 @@ static inline struct devtmpfs_resource *create_devtmpfs_resource(struct devtmpfs
 
     if (S_ISREG(mode)) {
         resource->capacity = 4096;
-        resource->data = alloc(resource->capacity);
+        resource->data = vmalloc(resource->capacity);
         resource->can_mmap = true;
     }
 
@@ -185,9 +183,9 @@ static inline struct devtmpfs_resource *create_devtmpfs_resource(struct devtmpfs
     resource->stat.st_mode = mode;
     resource->stat.st_nlink = 1;
 
-    resource->stat.st_atim = time_realtime;
-    resource->stat.st_ctim = time_realtime;
-    resource->stat.st_mtim = time_realtime;
+    resource->stat.st_atim = time_get_realtime();
+    resource->stat.st_ctim = resource->stat.st_atim;
+    resource->stat.st_mtim = resource->stat.st_atim;
 
     return resource;
 }
@@ -324,8 +322,8 @@ bool devtmpfs_add_device(struct resource *device, const char *name) {
     device->stat.st_ino = fs->inode_counter++;
     device->stat.st_nlink = 1;
 
-    spinlock_acquire(&vfs_lock);
-    HASHMAP_SINSERT(&devtmpfs_root->children, name, new_node);
-    spinlock_release(&vfs_lock);
+    rwlock_acquire_write(&vfs_lock);
+    vfs_add_child(devtmpfs_root, name, new_node);
+    rwlock_release_write(&vfs_lock);
     return new_node;
 }
@@ -3,6 +3,7 @@
 #include <fs/vfs/vfs.k.h>
 #include <lib/bitmap.k.h>
 #include <lib/errno.k.h>
+#include <lib/mutex.k.h>
 #include <lib/print.k.h>
 #include <lib/random.k.h>
 #include <lib/resource.k.h>
@@ -106,6 +107,7 @@ struct ext2fs {
 struct ext2fs_resource {
     struct resource;
 
+    struct mutex mutex; // held across disk I/O, unlike the resource lock
     struct ext2fs *fs;
 };
 
@@ -586,7 +588,7 @@ static bool ext2fs_removedirentry(struct ext2fs *fs, struct ext2fs_inode *parent
             ext2fs_inodewriteentry(&inode, fs, entry->inodeidx);
 
             if (inode.hardlinkcnt <= 0 && deleteinode) {
-                inode.deletedtime = time_realtime.tv_sec; // officially mark as deleted
+                inode.deletedtime = time_get_realtime().tv_sec; // officially mark as deleted
 
                 for (size_t j = 0; j < 12; j++) { // direct
                     if (inode.blocks[j] == 0) {
@@ -669,7 +671,7 @@ static ssize_t ext2fs_inodewriteentry(struct ext2fs_inode *inode, struct ext2fs
 
 static bool ext2fs_reschmod(struct resource *_this, mode_t mode) {
     struct ext2fs_resource *this = (struct ext2fs_resource *)_this;
-    spinlock_acquire(&this->lock);
+    mutex_acquire(&this->mutex);
 
     struct ext2fs_inode curinode = { 0 };
     ext2fs_inodereadentry(&curinode, this->fs, this->stat.st_ino);
@@ -682,14 +684,14 @@ static bool ext2fs_reschmod(struct resource *_this, mode_t mode) {
     this->stat.st_mode &= ~0777;
     this->stat.st_mode |= mode & 0777;
 
-    spinlock_release(&this->lock);
+    mutex_release(&this->mutex);
     return true;
 }
 
 static ssize_t ext2fs_resread(struct resource *_this, struct f_description *description, void *buf, off_t loc, size_t count) {
     (void)description;
     struct ext2fs_resource *this = (struct ext2fs_resource *)_this;
-    spinlock_acquire(&this->lock);
+    mutex_acquire(&this->mutex);
 
     struct ext2fs_inode curinode = { 0 };
 
@@ -699,12 +701,12 @@ static ssize_t ext2fs_resread(struct resource *_this, struct f_description *desc
         count = count - ((loc + count) - this->stat.st_size); // reading will only ever read total size!
     }
 
-    this->stat.st_atim = time_realtime;
+    this->stat.st_atim = time_get_realtime();
     curinode.accesstime = this->stat.st_atim.tv_sec;
     ext2fs_inodewriteentry(&curinode, this->fs, this->stat.st_ino);
 
     ssize_t ret = ext2fs_inoderead(&curinode, this->fs, buf, loc, count);
-    spinlock_release(&this->lock);
+    mutex_release(&this->mutex);
     return ret;
 }
 
@@ -712,7 +714,7 @@ static ssize_t ext2fs_reswrite(struct resource *_this, struct f_description *des
     (void)description;
     struct ext2fs_resource *this = (struct ext2fs_resource *)_this;
 
-    spinlock_acquire(&this->lock);
+    mutex_acquire(&this->mutex);
 
     struct ext2fs_inode curinode = { 0 };
 
@@ -723,17 +725,17 @@ static ssize_t ext2fs_reswrite(struct resource *_this, struct f_description *des
         this->stat.st_blocks = DIV_ROUNDUP(this->stat.st_size, this->stat.st_blksize);
     }
 
-    this->stat.st_atim = time_realtime;
-    this->stat.st_mtim = time_realtime;
+    this->stat.st_atim = time_get_realtime();
+    this->stat.st_mtim = this->stat.st_atim;
     curinode.accesstime = this->stat.st_atim.tv_sec;
     curinode.modifiedtime = this->stat.st_mtim.tv_sec;
     ext2fs_inodewriteentry(&curinode, this->fs, this->stat.st_ino);
 
-    this->fs->sb.lastwritten = time_realtime.tv_sec;
+    this->fs->sb.lastwritten = time_get_realtime().tv_sec;
     ext2fs_writesuperblock(this->fs);
 
     ssize_t ret = ext2fs_inodewrite(&curinode, this->fs, buf, this->stat.st_ino, loc, count); // pass to low level write
-    spinlock_release(&this->lock);
+    mutex_release(&this->mutex);
     return ret;
 }
 
@@ -745,8 +747,8 @@ static bool ext2fs_restruncate(struct resource *_this, struct f_description *des
     struct ext2fs_inode curinode = { 0 };
     ext2fs_inodereadentry(&curinode, this->fs, this->stat.st_ino);
 
-    this->stat.st_atim = time_realtime;
-    this->stat.st_mtim = time_realtime;
+    this->stat.st_atim = time_get_realtime();
+    this->stat.st_mtim = this->stat.st_atim;
     curinode.accesstime = this->stat.st_atim.tv_sec;
     curinode.modifiedtime = this->stat.st_mtim.tv_sec;
 
@@ -805,7 +807,7 @@ static bool ext2fs_resunref(struct resource *_this, struct f_description *descri
     // XXX: Unref is broken due to underlying vfs issues
     this->refcount--;
     if (this->refcount == 0) {
-        spinlock_acquire(&this->lock);
+        mutex_acquire(&this->mutex);
 
         struct ext2fs_inode inode = { 0 };
         ext2fs_inodereadentry(&inode, this->fs, this->stat.st_ino);
@@ -823,7 +825,7 @@ static bool ext2fs_resunref(struct resource *_this, struct f_description *descri
             ret = ext2fs_removedirentry(this->fs, &parent, description->node->parent->resource->stat.st_ino, this->stat.st_ino, true);
         }
 
-        spinlock_release(&this->lock);
+        mutex_release(&this->mutex);
     }
     return ret;
 }
@@ -878,9 +880,9 @@ static struct vfs_node *ext2fs_create(struct vfs_filesystem *_this, struct vfs_n
     resource->stat.st_mode = mode;
     resource->stat.st_nlink = 1;
 
-    resource->stat.st_atim = time_realtime;
-    resource->stat.st_ctim = time_realtime;
-    resource->stat.st_mtim = time_realtime;
+    resource->stat.st_atim = time_get_realtime();
+    resource->stat.st_ctim = resource->stat.st_atim;
+    resource->stat.st_mtim = resource->stat.st_atim;
 
     resource->stat.st_ino = ext2fs_allocinode(this);
 
@@ -896,9 +898,9 @@ static struct vfs_node *ext2fs_create(struct vfs_filesystem *_this, struct vfs_n
         .perms = (mode & 0xfff) | inodetype,
         .uid = 0,
         .sizelo = 0,
-        .accesstime = time_realtime.tv_sec,
-        .creationtime = time_realtime.tv_sec,
-        .modifiedtime = time_realtime.tv_sec,
+        .accesstime = resource->stat.st_atim.tv_sec,
+        .creationtime = resource->stat.st_ctim.tv_sec,
+        .modifiedtime = resource->stat.st_mtim.tv_sec,
         .deletedtime = 0,
         .gid = 0,
         .hardlinkcnt = 1,
@@ -952,7 +954,7 @@ static struct vfs_node *ext2fs_create(struct vfs_filesystem *_this, struct vfs_n
         ext2fs_inodewriteentry(&inode, this, resource->stat.st_ino);
     }
 
-    this->sb.lastwritten = time_realtime.tv_sec;
+    this->sb.lastwritten = time_get_realtime().tv_sec;
     ext2fs_writesuperblock(this);
 
     ext2fs_createdirentry(this, &parentinode, parent->resource->stat.st_ino, resource->stat.st_ino, dirtype, name);
@@ -1158,7 +1160,7 @@ static struct vfs_node *ext2fs_mount(struct vfs_node *parent, const char *name,
     new_fs->fragsize = 1024 << new_fs->sb.fragsize;
     new_fs->bgdcnt = new_fs->sb.blockcnt / new_fs->sb.blockspergroup;
 
-    new_fs->sb.lastmnt = time_realtime.tv_sec;
+    new_fs->sb.lastmnt = time_get_realtime().tv_sec;
     ext2fs_writesuperblock(new_fs);
 
     if (ext2fs_inodereadentry(&new_fs->root, new_fs, 2)) {
@@ -1186,9 +1188,9 @@ static struct vfs_node *ext2fs_mount(struct vfs_node *parent, const char *name,
     resource->stat.st_nlink = new_fs->root.hardlinkcnt;
     resource->stat.st_ino = 2; // root inode
 
-    resource->stat.st_atim = time_realtime;
-    resource->stat.st_ctim = time_realtime;
-    resource->stat.st_mtim = time_realtime;
+    resource->stat.st_atim = time_get_realtime();
+    resource->stat.st_ctim = resource->stat.st_atim;
+    resource->stat.st_mtim = resource->stat.st_atim;
 
     resource->fs = new_fs;
 
@@ -3,6 +3,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <lib/debug.k.h>
+#include <lib/mutex.k.h>
 #include <time/time.k.h>
 #include <sys/stat.h>
 #include <printf/printf.h>
@@ -88,6 +89,7 @@ struct fat32fs {
 
 struct fat32fs_resource {
     struct resource;
+    struct mutex mutex;
     struct fat32fs *fs;
     struct resource *dir;
     off_t diroffset;
@@ -366,7 +368,7 @@ static bool fat32fs_rwbytes(struct fat32fs *fs, cluster_t cluster, void *buffer,
 static ssize_t fat32fs_reswrite(struct resource *_this, struct f_description *desc, const void *buffer, off_t offset, size_t count) {
     (void)desc;
     struct fat32fs_resource *this = (struct fat32fs_resource *)_this;
-    spinlock_acquire(&this->lock);
+    mutex_acquire(&this->mutex);
 
     off_t endoffset = offset + count;
 
@@ -409,7 +411,7 @@ static ssize_t fat32fs_reswrite(struct resource *_this, struct f_description *de
     }
 
 cleanup:
-    spinlock_release(&this->lock);
+    mutex_release(&this->mutex);
     return count;
 }
 
@@ -445,7 +447,7 @@ static bool fat32fs_resmsync(struct resource *this, size_t file_page, void *phys
 static bool fat32fs_resunref(struct resource *_this, struct f_description *description) {
     (void)description;
     struct fat32fs_resource *this = (struct fat32fs_resource *)_this;
-    spinlock_acquire(&this->lock);
+    mutex_acquire(&this->mutex);
 
     this->refcount--;
     if (this->refcount == 0) {
@@ -485,14 +487,14 @@ static bool fat32fs_resunref(struct resource *_this, struct f_description *descr
         fat32fs_updatefsinfo(this->fs);
     }
 
-    spinlock_release(&this->lock);
+    mutex_release(&this->mutex);
     return true;
 }
 
 static bool fat32fs_restruncate(struct resource *_this, struct f_description *desc, size_t length) {
     (void)desc;
     struct fat32fs_resource *this = (struct fat32fs_resource *)_this;
-    spinlock_acquire(&this->lock);
+    mutex_acquire(&this->mutex);
 
     size_t newblocksize = DIV_ROUNDUP(length, this->stat.st_blksize);
     cluster_t newcluster;
@@ -525,14 +527,14 @@ static bool fat32fs_restruncate(struct resource *_this, struct f_description *de
     status = true;
 
 cleanup:
-    spinlock_release(&this->lock);
+    mutex_release(&this->mutex);
     return status;
 }
 
 static ssize_t fat32fs_resread(struct resource *_this, struct f_description *desc, void *buffer, off_t offset, size_t count) {
     (void)desc;
     struct fat32fs_resource *this = (struct fat32fs_resource *)_this;
-    spinlock_acquire(&this->lock);
+    mutex_acquire(&this->mutex);
     off_t endoffset = offset + count;
 
     if (endoffset > this->stat.st_size) {
@@ -549,7 +551,7 @@ static ssize_t fat32fs_resread(struct resource *_this, struct f_description *des
     }
 
 cleanup:
-    spinlock_release(&this->lock);
+    mutex_release(&this->mutex);
     return count;
 }
 
@@ -715,9 +717,9 @@ static struct vfs_node *fat32fs_create(struct vfs_filesystem *_this, struct vfs_
     res->stat.st_ino = this->currentinode++;
     res->refcount = 1;
     
-    res->stat.st_atim = time_realtime;
-    res->stat.st_ctim = time_realtime;
-    res->stat.st_mtim = time_realtime;
+    res->stat.st_atim = time_get_realtime();
+    res->stat.st_ctim = res->stat.st_atim;
+    res->stat.st_mtim = res->stat.st_atim;
 
     res->dir = parent->resource;
     res->fs = this;
@@ -1004,9 +1006,9 @@ static struct vfs_node *fat32fs_mount(struct vfs_node *parent, const char *name,
     res->stat.st_nlink = 1;
     res->stat.st_ino = 2;
 
-    res->stat.st_atim = time_realtime;
-    res->stat.st_ctim = time_realtime;
-    res->stat.st_mtim = time_realtime;
+    res->stat.st_atim = time_get_realtime();
+    res->stat.st_ctim = res->stat.st_atim;
+    res->stat.st_mtim = res->stat.st_atim;
 
     res->fs = fs;
     res->cluster = fs->br.rootdircluster;
@@ -11,6 +11,7 @@
 #include <lib/resource.k.h>
 #include <mm/mmap.k.h>
 #include <mm/pmm.k.h>
+#include <mm/vmalloc.k.h>
 #include <mm/vmm.k.h>
 #include <sys/stat.h>
 #include <time/time.k.h>
@@ -62,7 +63,7 @@ static ssize_t tmpfs_resource_write(struct resource *_this, struct f_description
             new_capacity *= 2;
         }
 
-        void *new_data = realloc(this->data, new_capacity);
+        void *new_data = vrealloc(this->data, new_capacity);
         if (new_data == NULL) {
             errno = ENOMEM;
             goto fail;
@@ -93,7 +94,7 @@ static void *tmpfs_resource_mmap(struct resource *_this, size_t file_page, int f
 
     void *ret = NULL;
     if ((flags & MAP_SHARED) != 0) {
-        ret = (this->data + file_page * PAGE_SIZE) - VMM_HIGHER_HALF;
+        ret = (void *)vmm_virt2phys(vmm_kernel_pagemap, (uintptr_t)this->data + file_page * PAGE_SIZE);
     } else {
         ret = pmm_alloc_nozero(1);
         if (ret == NULL) {
@@ -134,15 +135,12 @@ static bool tmpfs_truncate(struct resource *this_, struct f_description *descrip
             new_capacity *= 2;
         }
 
-        void *new_data = alloc(new_capacity);
+        void *new_data = vrealloc(this->data, new_capacity);
         if (new_data == NULL) {
             errno = ENOMEM;
             goto fail;
         }
 
-        memcpy(new_data, this->data, this->capacity);
-        free(this->data);
-
         this->data = new_data;
         this->capacity = new_capacity;
     }
@@ -164,7 +162,7 @@ static inline struct tmpfs_resource *create_tmpfs_resource(struct tmpfs *this, i
 
     if (S_ISREG(mode)) {
         resource->capacity = 4096;
-        resource->data = alloc(resource->capacity);
+        resource->data = vmalloc(resource->capacity);
         resource->can_mmap = true;
     }
 
@@ -182,9 +180,9 @@ static inline struct tmpfs_resource *create_tmpfs_resource(struct tmpfs *this, i
     resource->stat.st_mode = mode;
     resource->stat.st_nlink = 1;
 
-    resource->stat.st_atim = time_realtime;
-    resource->stat.st_ctim = time_realtime;
-    resource->stat.st_mtim = time_realtime;
+    resource->stat.st_atim = time_get_realtime();
+    resource->stat.st_ctim = resource->stat.st_atim;
+    resource->stat.st_mtim = resource->stat.st_atim;
 
     return resource;
 }
@@ -3,8 +3,10 @@
 #include <lib/alloc.k.h>
 #include <lib/hashmap.k.h>
 #include <lib/lock.k.h>
+#include <lib/mutex.k.h>
 #include <lib/errno.k.h>
 #include <lib/print.k.h>
+#include <lib/rcu.k.h>
 #include <lib/resource.k.h>
 #include <lib/debug.k.h>
 #include <sched/proc.k.h>
@@ -13,11 +15,18 @@
 #include <dirent.h>
 #include <limits.h>
 
-spinlock_t vfs_lock = SPINLOCK_INIT;
+struct rwlock vfs_lock = RWLOCK_INIT;
+
+// The children hashmaps take one writer at a time. Lookups populate
+// directories without vfs_lock, so every writer serialises on this instead,
+// taken after vfs_lock by those that hold it.
+static struct mutex children_lock = MUTEX_INIT;
+
+static struct kmem_cache vfs_node_cache = KMEM_CACHE_INIT("vfs_node", sizeof(struct vfs_node), _Alignof(struct vfs_node), NULL);
 
 struct vfs_node *vfs_create_node(struct vfs_filesystem *fs, struct vfs_node *parent,
                                  const char *name, bool dir) {
-    struct vfs_node *node = ALLOC(struct vfs_node);
+    struct vfs_node *node = kmem_cache_alloc(&vfs_node_cache);
 
     node->name = alloc(strlen(name) + 1);
     strcpy(node->name, name);
@@ -32,6 +41,7 @@ struct vfs_node *vfs_create_node(struct vfs_filesystem *fs, struct vfs_node *par
     return node;
 }
 
+// For nodes not reachable yet, or from populate callbacks
 void vfs_create_dotentries(struct vfs_node *node, struct vfs_node *parent) {
     struct vfs_node *dot = vfs_create_node(node->filesystem, node, ".", false);
     struct vfs_node *dotdot = vfs_create_node(node->filesystem, node, "..", false);
@@ -43,14 +53,20 @@ void vfs_create_dotentries(struct vfs_node *node, struct vfs_node *parent) {
     HASHMAP_SINSERT(&node->children, "..", dotdot);
 }
 
+void vfs_add_child(struct vfs_node *parent, const char *name, struct vfs_node *child) {
+    mutex_acquire(&children_lock);
+    HASHMAP_SINSERT(&parent->children, name, child);
+    mutex_release(&children_lock);
+}
+
 static HASHMAP_TYPE(fs_mount_t) filesystems;
 
 void vfs_add_filesystem(fs_mount_t fs_mount, const char *identifier) {
-    spinlock_acquire(&vfs_lock);
+    rwlock_acquire_write(&vfs_lock);
 
     HASHMAP_SINSERT(&filesystems, identifier, fs_mount);
 
-    spinlock_release(&vfs_lock);
+    rwlock_release_write(&vfs_lock);
 }
 
 struct vfs_node *vfs_root = NULL;
@@ -69,13 +85,18 @@ struct path2node_res {
 
 static bool populate(struct vfs_node *node) {
     if (node->filesystem && node->filesystem->populate && node->populated == false && node->resource && S_ISDIR(node->resource->stat.st_mode)) {
-        node->filesystem->populate(node->filesystem, node);
+        mutex_acquire(&children_lock);
+        if (node->populated == false) {
+            node->filesystem->populate(node->filesystem, node);
+        }
+        mutex_release(&children_lock);
         return node->populated;
     }
     return true;
 }
 
 static struct vfs_node *reduce_node(struct vfs_node *node, bool follow_symlinks);
+static struct path2node_res follow_symlink(struct vfs_node *node);
 
 static struct path2node_res path2node(struct vfs_node *parent, const char *path) {
     if (path == NULL || strlen(path) == 0) {
@@ -124,9 +145,11 @@ static struct path2node_res path2node(struct vfs_node *parent, const char *path)
 
         struct vfs_node *new_node;
 
-        // XXX put a lock around this guy
-        // XXX page fault here (seemingly random)
-        if (!HASHMAP_SGET(&current_node->children, new_node, elem_str)) {
+        rcu_read_lock();
+        bool found = HASHMAP_SGET(&current_node->children, new_node, elem_str);
+        rcu_read_unlock();
+
+        if (!found) {
             errno = ENOENT;
             if (last) {
                 return (struct path2node_res){current_node, NULL, elem_str};
@@ -150,7 +173,7 @@ static struct path2node_res path2node(struct vfs_node *parent, const char *path)
         current_node = new_node;
 
         if (S_ISLNK(current_node->resource->stat.st_mode)) {
-            struct path2node_res r = path2node(current_node->parent, current_node->symlink_target);
+            struct path2node_res r = follow_symlink(current_node);
             if (r.target == NULL) {
                 return (struct path2node_res){NULL, NULL, NULL};
             }
@@ -201,7 +224,7 @@ static struct vfs_node *reduce_node(struct vfs_node *node, bool follow_symlinks)
         return reduce_node(node->mountpoint, follow_symlinks);
     }
     if (node->symlink_target != NULL && follow_symlinks == true) {
-        struct path2node_res r = path2node(node->parent, node->symlink_target);
+        struct path2node_res r = follow_symlink(node);
         if (r.target == NULL) {
             return NULL;
         }
@@ -210,9 +233,27 @@ static struct vfs_node *reduce_node(struct vfs_node *node, bool follow_symlinks)
     return node;
 }
 
-struct vfs_node *vfs_get_node(struct vfs_node *parent, const char *path, bool follow_links) {
-    spinlock_acquire(&vfs_lock);
+// The target can be unlinked under lookups, which do not take vfs_lock, and
+// the walk can sleep in populate(), so walk a copy.
+static struct path2node_res follow_symlink(struct vfs_node *node) {
+    rcu_read_lock();
+    char *target = RCU_DEREFERENCE(node->symlink_target);
+    target = target != NULL ? strdup(target) : NULL;
+    rcu_read_unlock();
 
+    if (target == NULL) {
+        errno = ENOENT;
+        return (struct path2node_res){NULL, NULL, NULL};
+    }
+
+    struct path2node_res r = path2node(node->parent, target);
+    free(target);
+    return r;
+}
+
+// Lookups only read the children hashmaps, which writers update behind RCU,
+// so they do not take vfs_lock.
+struct vfs_node *vfs_get_node(struct vfs_node *parent, const char *path, bool follow_links) {
     struct vfs_node *ret = NULL;
 
     struct path2node_res r = path2node(parent, path);
@@ -231,13 +272,12 @@ cleanup:
     if (r.basename != NULL) {
         free(r.basename);
     }
-    spinlock_release(&vfs_lock);
     return ret;
 }
 
 bool vfs_mount(struct vfs_node *parent, const char *source, const char *target,
                const char *fs_name) {
-    spinlock_acquire(&vfs_lock);
+    rwlock_acquire_write(&vfs_lock);
 
     bool ret = false;
     struct path2node_res r = {0};
@@ -282,9 +322,9 @@ bool vfs_mount(struct vfs_node *parent, const char *source, const char *target,
     if (mount_node == NULL) {
         goto cleanup; // failed to mount
     }
-    r.target->mountpoint = mount_node;
 
     vfs_create_dotentries(mount_node, r.target_parent);
+    r.target->mountpoint = mount_node;
 
     if (source != NULL && strlen(source) != 0) {
         kernel_print("vfs: Mounted `%s` on `%s` with filesystem `%s`\n", source, target, fs_name);
@@ -298,13 +338,13 @@ cleanup:
     if (r.basename != NULL) {
         free(r.basename);
     }
-    spinlock_release(&vfs_lock);
+    rwlock_release_write(&vfs_lock);
     return ret;
 }
 
 struct vfs_node *vfs_symlink(struct vfs_node *parent, const char *dest,
                              const char *target) {
-    spinlock_acquire(&vfs_lock);
+    rwlock_acquire_write(&vfs_lock);
 
     struct vfs_node *ret = NULL;
 
@@ -322,7 +362,7 @@ struct vfs_node *vfs_symlink(struct vfs_node *parent, const char *dest,
     struct vfs_filesystem *target_fs = r.target_parent->filesystem;
     struct vfs_node *target_node = target_fs->symlink(target_fs, r.target_parent, r.basename, dest);
 
-    HASHMAP_SINSERT(&r.target_parent->children, r.basename, target_node);
+    vfs_add_child(r.target_parent, r.basename, target_node);
 
     ret = target_node;
 
@@ -330,14 +370,14 @@ cleanup:
     if (r.basename != NULL) {
         free(r.basename);
     }
-    spinlock_release(&vfs_lock);
+    rwlock_release_write(&vfs_lock);
     return ret;
 }
 
 bool vfs_unlink(struct vfs_node *parent, const char *path) {
     bool ret = false;
 
-    spinlock_acquire(&vfs_lock);
+    rwlock_acquire_write(&vfs_lock);
 
     struct path2node_res r = path2node(parent, path);
 
@@ -354,7 +394,10 @@ bool vfs_unlink(struct vfs_node *parent, const char *path) {
         goto cleanup;
     }
 
-    if (!HASHMAP_SREMOVE(&r.target_parent->children, r.basename)) {
+    mutex_acquire(&children_lock);
+    bool removed = HASHMAP_SREMOVE(&r.target_parent->children, r.basename);
+    mutex_release(&children_lock);
+    if (!removed) {
         goto cleanup;
     }
 
@@ -362,13 +405,16 @@ bool vfs_unlink(struct vfs_node *parent, const char *path) {
         goto cleanup;
     }
 
-    free(r.target->name);
-    if (r.target->symlink_target != NULL) {
-        free(r.target->symlink_target);
-    }
+    // Lookups running without vfs_lock may still be looking at these
+    char *symlink_target = r.target->symlink_target;
+    RCU_ASSIGN_POINTER(r.target->symlink_target, NULL);
+    rcu_free(symlink_target);
+    rcu_free(r.target->name);
 
     if (S_ISDIR(r.target->resource->stat.st_mode)) {
+        mutex_acquire(&children_lock);
         HASHMAP_DELETE(&r.target->children);
+        mutex_release(&children_lock);
     }
 
     ret = true;
@@ -377,12 +423,12 @@ cleanup:
     if (r.basename != NULL) {
         free(r.basename);
     }
-    spinlock_release(&vfs_lock);
+    rwlock_release_write(&vfs_lock);
     return ret;
 }
 
 struct vfs_node *vfs_create(struct vfs_node *parent, const char *name, int mode) {
-    spinlock_acquire(&vfs_lock);
+    rwlock_acquire_write(&vfs_lock);
 
     struct vfs_node *ret = NULL;
 
@@ -400,19 +446,19 @@ struct vfs_node *vfs_create(struct vfs_node *parent, const char *name, int mode)
     struct vfs_filesystem *target_fs = r.target_parent->filesystem;
     struct vfs_node *target_node = target_fs->create(target_fs, r.target_parent, r.basename, mode);
 
-    HASHMAP_SINSERT(&r.target_parent->children, r.basename, target_node);
-
     if (S_ISDIR(target_node->resource->stat.st_mode)) {
         vfs_create_dotentries(target_node, r.target_parent);
     }
 
+    vfs_add_child(r.target_parent, r.basename, target_node);
+
     ret = target_node;
 
 cleanup:
     if (r.basename != NULL) {
         free(r.basename);
     }
-    spinlock_release(&vfs_lock);
+    rwlock_release_write(&vfs_lock);
     return ret;
 }
 
@@ -673,7 +719,7 @@ int syscall_readdir(void *_, int dir_fdnum, void *buffer, size_t *size) {
     struct thread *thread = sched_current_thread();
     struct process *proc = thread->process;
 
-    spinlock_acquire(&vfs_lock);
+    rwlock_acquire_read(&vfs_lock);
 
     struct f_descriptor *dir_fd = fd_from_fdnum(proc, dir_fdnum);
     if (dir_fd == NULL) {
@@ -757,7 +803,7 @@ int syscall_readdir(void *_, int dir_fdnum, void *buffer, size_t *size) {
     ret = 0;
 
 cleanup:
-    spinlock_release(&vfs_lock);
+    rwlock_release_read(&vfs_lock);
 
     DEBUG_SYSCALL_LEAVE("%d", ret);
     return ret;
@@ -850,7 +896,7 @@ int syscall_linkat(void *_, int olddir_fdnum, const char *old_path, int newdir_f
         goto cleanup;
     }
 
-    HASHMAP_SINSERT(&new_res.target_parent->children, new_res.basename, node);
+    vfs_add_child(new_res.target_parent, new_res.basename, node);
     ret = 0;
 
 cleanup:
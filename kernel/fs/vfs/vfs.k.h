@@ -4,9 +4,9 @@
 #include <stdbool.h>
 #include <lib/resource.k.h>
 #include <lib/hashmap.k.h>
-#include <lib/lock.k.h>
+#include <lib/mutex.k.h>
 
-extern spinlock_t vfs_lock;
+extern struct rwlock vfs_lock;
 
 struct vfs_filesystem;
 
@@ -37,6 +37,7 @@ void vfs_init(void);
 struct vfs_node *vfs_create_node(struct vfs_filesystem *fs, struct vfs_node *parent,
                                  const char *name, bool dir);
 void vfs_create_dotentries(struct vfs_node *node, struct vfs_node *parent);
+void vfs_add_child(struct vfs_node *parent, const char *name, struct vfs_node *child);
 void vfs_add_filesystem(fs_mount_t fs_mount, const char *identifier);
 struct vfs_node *vfs_get_node(struct vfs_node *parent, const char *path, bool follow_links);
 bool vfs_mount(struct vfs_node *parent, const char *source, const char *target,
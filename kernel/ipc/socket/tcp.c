@@ -5,6 +5,7 @@
 #include <lib/errno.k.h>
 #include <lib/print.k.h>
 #include <lib/random.k.h>
+#include <lib/rcu.k.h>
 #include <linux/tcp.h>
 #include <linux/sockios.h>
 #include <netinet/in.h>
@@ -169,8 +170,9 @@ struct tcp_socket {
     // no need for a send buffer as we just spit them out as soon as we're told to send them (no ACK delay algorithm)
 };
 
+// Writers hold tcp_socketslock, lookups only need an RCU read section
 static spinlock_t tcp_socketslock = SPINLOCK_INIT;
-static VECTOR_TYPE(struct tcp_socket *) tcp_sockets;
+static struct rcu_array *tcp_sockets = NULL;
 
 // TCP Options (SYN or SYN/ACK)
 #define TCP_OPTEOL 0
@@ -187,18 +189,17 @@ static VECTOR_TYPE(struct tcp_socket *) tcp_sockets;
 // #define TCP_DOCSUM
 
 static bool tcp_grabsocket(struct tcp_connection conn, struct tcp_socket **socket) {
-    (void)socket;
-
-    spinlock_acquire(&tcp_socketslock);
-    VECTOR_FOR_EACH(&tcp_sockets, it,
-        struct tcp_socket *itsocket = *it;
+    rcu_read_lock();
+    struct rcu_array *sockets = RCU_DEREFERENCE(tcp_sockets);
+    for (size_t i = 0; sockets != NULL && i < sockets->length; i++) {
+        struct tcp_socket *itsocket = sockets->items[i];
         if (itsocket->conn.localport == conn.localport && itsocket->conn.local.value == conn.local.value && itsocket->conn.remoteport == conn.remoteport && itsocket->conn.remote.value == conn.remote.value) {
             *socket = itsocket;
-            spinlock_release(&tcp_socketslock);
+            rcu_read_unlock();
             return true;
         }
-    );
-    spinlock_release(&tcp_socketslock);
+    }
+    rcu_read_unlock();
     return false;
 }
 
@@ -261,9 +262,12 @@ static bool tcp_acquireport(struct tcp_socket *sock, uint16_t port) {
     sock->conn = conn;
 
     spinlock_acquire(&tcp_socketslock);
-    VECTOR_PUSH_BACK(&tcp_sockets, sock);
+    bool ok = rcu_array_insert(&tcp_sockets, sock);
     spinlock_release(&tcp_socketslock);
-    return true;
+    if (!ok) {
+        errno = ENOMEM;
+    }
+    return ok;
 }
 
 static be_uint16_t tcp_checksum(struct net_inetaddr src, struct net_inetaddr dest, void *data, uint16_t length) {
@@ -308,14 +312,25 @@ update:
     return ret;
 }
 
+// Entries up to a full Ethernet sized segment come from their own cache
+#define TCP_RETRANSMITCACHEDATA 1460
+
+static struct kmem_cache tcp_retransmitcache = KMEM_CACHE_INIT("tcp_retransmitentry",
+    sizeof(struct tcp_retransmitentry) + TCP_RETRANSMITCACHEDATA, _Alignof(struct tcp_retransmitentry), NULL);
+
 static void tcp_queueforretransmit(struct tcp_socket *this, uint32_t seq, struct tcp_flags flags, uint8_t *data, size_t len) {
-    struct tcp_retransmitentry *entry = alloc(sizeof(struct tcp_retransmitentry) + len);
+    struct tcp_retransmitentry *entry;
+    if (len <= TCP_RETRANSMITCACHEDATA) {
+        entry = kmem_cache_alloc(&tcp_retransmitcache);
+    } else {
+        entry = alloc(sizeof(struct tcp_retransmitentry) + len);
+    }
     entry->rto = 200000; // 200ms
     entry->seq = seq;
     entry->flags = flags;
     entry->len = len;
     memcpy(entry->data, data, entry->len);
-    entry->first = time_monotonic;
+    entry->first = time_get_monotonic();
     entry->last = entry->first;
     VECTOR_PUSH_BACK(&this->retransmitqueue, entry);
 }
@@ -336,7 +351,7 @@ static void tcp_queuecleanup(struct tcp_socket *this) {
 }
 
 static void tcp_settimewait(struct tcp_socket *this) {
-    this->timewaittimer = timespec_add(time_monotonic, (struct timespec) { .tv_sec = 12 });
+    this->timewaittimer = timespec_add(time_get_monotonic(), (struct timespec) { .tv_sec = 12 });
 }
 
 // XXX: Segments should be dumped into a vector and sent at our disgression (in order, delayed one after another to prevent out-of-sequence issues on remotes with no implementation for such)
@@ -366,7 +381,7 @@ static ssize_t tcp_sendsegment(struct net_adapter *adapter, uint32_t seq, uint32
     if (sock != NULL) {
         if (sock->flags & TCP_FLAGTS) {
             opts[0] = __builtin_bswap32(0x0101080a); // NOP, NOP, Timestamp Option, 10
-            opts[1] = __builtin_bswap32(time_monotonic.tv_sec);
+            opts[1] = __builtin_bswap32(time_get_monotonic().tv_sec);
             opts[2] = __builtin_bswap32(sock->recenttimestamp);
             opts += 3;
         }
@@ -445,9 +460,7 @@ static bool tcp_close(struct tcp_socket *this) {
         tcp_queuecleanup(this);
 
         spinlock_acquire(&tcp_socketslock);
-        if (VECTOR_FIND(&tcp_sockets, this) != VECTOR_INVALID_INDEX) {
-            VECTOR_REMOVE_BY_VALUE(&tcp_sockets, this);
-        }
+        rcu_array_remove(&tcp_sockets, this);
         spinlock_release(&tcp_socketslock);
 
         free(this->rcvbuf.buf);
@@ -456,7 +469,8 @@ static bool tcp_close(struct tcp_socket *this) {
             net_releaseport(__builtin_bswap16(this->port)); // only free port if we're the owner of the bound socket port
         }
 
-        resource_free((struct resource *)this);
+        // Lookups on other CPUs may still be looking at it
+        rcu_free(this);
     }
 
     return true;
@@ -488,7 +502,7 @@ static void tcp_queueemit(struct tcp_socket *this, struct tcp_retransmitentry *e
         rxtadapter = this->adapter;
     }
 
-    struct timespec now = time_monotonic;
+    struct timespec now = time_get_monotonic();
 
     struct timespec diff = timespec_sub(now, entry->first);
     if (diff.tv_sec >= 5) {
@@ -523,17 +537,19 @@ static void tcp_timer(void *unused) {
 
     for (;;) {
         time_nsleep(100 * 1000000);
-        struct timespec now = time_monotonic;
+        struct timespec now = time_get_monotonic();
+rescan:
         spinlock_acquire(&tcp_socketslock);
-        VECTOR_FOR_EACH(&tcp_sockets, it,
-            struct tcp_socket *sock = *it;
+        struct rcu_array *sockets = tcp_sockets;
+        for (size_t i = 0; sockets != NULL && i < sockets->length; i++) {
+            struct tcp_socket *sock = sockets->items[i];
             if (tcp_getstate(sock) == TCP_STATETIMEWAIT) {
                 if ((now.tv_sec == sock->timewaittimer.tv_sec ? now.tv_nsec > sock->timewaittimer.tv_nsec : now.tv_sec > sock->timewaittimer.tv_sec)) {
                     spinlock_release(&tcp_socketslock);
                     tcp_setstate(sock, TCP_STATECLOSED);
                     tcp_close(sock);
-                    spinlock_acquire(&tcp_socketslock);
-                    continue;
+                    // Closing replaced the array we were walking
+                    goto rescan;
                 }
             }
 
@@ -545,7 +561,7 @@ static void tcp_timer(void *unused) {
             }
 
             tcp_retransmitall(sock);
-        );
+        }
         spinlock_release(&tcp_socketslock);
     }
 }
@@ -685,7 +701,7 @@ static void tcp_netpacket(struct tcp_socket *this, struct net_inetaddr src, stru
             socket->sndis = random_generate();
 
             spinlock_acquire(&tcp_socketslock);
-            VECTOR_PUSH_BACK(&tcp_sockets, socket);
+            rcu_array_insert(&tcp_sockets, socket);
             spinlock_release(&tcp_socketslock);
 
             tcp_parseoptions(socket, packet);
@@ -1065,12 +1081,16 @@ static bool tcp_connect(struct socket *_this, struct f_description *description,
     struct tcp_flags flags = { 0 };
     flags.syn = 1;
     net_bindsocket(this->adapter, (struct socket *)this);
+    this->conn = (struct tcp_connection) { .local = this->adapter->ip, .localport = this->port, .remote = NET_IPSTRUCT(addr->sin_addr.s_addr), .remoteport = addr->sin_port };
     spinlock_acquire(&tcp_socketslock);
-    VECTOR_PUSH_BACK(&tcp_sockets, this);
+    bool ok = rcu_array_insert(&tcp_sockets, this);
     spinlock_release(&tcp_socketslock);
-    this->conn = (struct tcp_connection) { .local = this->adapter->ip, .localport = this->port, .remote = NET_IPSTRUCT(addr->sin_addr.s_addr), .remoteport = addr->sin_port };
+    if (!ok) {
+        errno = ENOMEM;
+        return false;
+    }
     tcp_setstate(this, TCP_STATESYNSENT);
-    this->connecttimeout = timespec_add(time_monotonic, (struct timespec) { .tv_sec = 5 });
+    this->connecttimeout = timespec_add(time_get_monotonic(), (struct timespec) { .tv_sec = 5 });
     if (tcp_send(this, flags, NULL, 0) == -1) {
         tcp_setstate(this, TCP_STATECLOSED);
         tcp_close(this);
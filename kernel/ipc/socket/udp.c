@@ -2,6 +2,7 @@
 #include <dev/net/net.k.h>
 #include <lib/errno.k.h>
 #include <lib/print.k.h>
+#include <lib/rcu.k.h>
 #include <linux/sockios.h>
 #include <ipc/socket.k.h>
 #include <netinet/in.h>
@@ -35,22 +36,21 @@ struct udp_socket {
 // should we validate checksums on UDP?
 // #define UDP_DOCSUM
 
-static spinlock_t udp_socketslock = SPINLOCK_INIT;
-static VECTOR_TYPE(struct udp_socket *) udp_sockets; // keep a reference of all UDP sockets
+static spinlock_t udp_socketslock = SPINLOCK_INIT; // held by writers only
+static struct rcu_array *udp_sockets = NULL; // keep a reference of all UDP sockets
 
 static bool udp_grabsocket(be_uint16_t port, struct udp_socket **socket) {
-    (void)socket; // we are going to use it though
-
-    spinlock_acquire(&udp_socketslock);
-    VECTOR_FOR_EACH(&udp_sockets, it,
-        struct udp_socket *itsocket = *it;
+    rcu_read_lock();
+    struct rcu_array *sockets = RCU_DEREFERENCE(udp_sockets);
+    for (size_t i = 0; sockets != NULL && i < sockets->length; i++) {
+        struct udp_socket *itsocket = sockets->items[i];
         if (itsocket->port == port) {
             *socket = itsocket;
-            spinlock_release(&udp_socketslock);
+            rcu_read_unlock();
             return true;
         }
-    );
-    spinlock_release(&udp_socketslock);
+    }
+    rcu_read_unlock();
     return false;
 }
 
@@ -61,9 +61,12 @@ static bool udp_acquireport(struct udp_socket *sock, uint16_t port) {
     }
 
     spinlock_acquire(&udp_socketslock);
-    VECTOR_PUSH_BACK(&udp_sockets, sock);
+    bool ok = rcu_array_insert(&udp_sockets, sock);
     spinlock_release(&udp_socketslock);
-    return true;
+    if (!ok) {
+        errno = ENOMEM;
+    }
+    return ok;
 }
 
 static ssize_t udp_read(struct resource *_this, struct f_description *description, void *buf, off_t offset, size_t count) {
@@ -442,7 +445,7 @@ static void udp_netpacket(struct udp_socket *_this, struct net_inetaddr src, be_
     _this->status |= POLLIN;
     event_trigger(&_this->event, false);
 
-    _this->recenttimestamp = time_monotonic.tv_sec;
+    _this->recenttimestamp = time_get_monotonic().tv_sec;
 }
 
 void udp_onudp(struct net_adapter *adapter, struct net_inetheader *inetheader, size_t length) {
@@ -496,9 +499,7 @@ static bool udp_unref(struct resource *_this, struct f_description *description)
         }
 
         spinlock_acquire(&udp_socketslock);
-        if (VECTOR_FIND(&udp_sockets, this) != VECTOR_INVALID_INDEX) {
-            VECTOR_REMOVE_BY_VALUE(&udp_sockets, this);
-        }
+        rcu_array_remove(&udp_sockets, this);
         spinlock_release(&udp_socketslock);
 
         net_releaseport(__builtin_bswap16(this->port));
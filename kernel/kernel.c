@@ -7,6 +7,7 @@
 #include <lib/elf.k.h>
 #include <lib/print.k.h>
 #include <lib/random.k.h>
+#include <lib/rcu.k.h>
 #include <mm/pmm.k.h>
 #include <mm/slab.k.h>
 #include <mm/vmm.k.h>
@@ -47,6 +48,8 @@ void _start(void) {
 }
 
 void kmain_thread(void) {
+    rcu_init();
+    pmm_zero_pool_init();
     random_init();
     vfs_init();
     fat32fs_init();
@@ -21,6 +21,8 @@ struct event {
     struct event_listener listeners[EVENT_MAX_LISTENERS];
 };
 
+#define EVENT_INIT {SPINLOCK_INIT, 0, 0, {{NULL, 0}}}
+
 ssize_t event_await(struct event **events, size_t num_events, bool block);
 size_t event_trigger(struct event *event, bool drop);
 
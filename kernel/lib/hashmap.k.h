@@ -6,6 +6,11 @@
 #include <stdbool.h>
 #include <lib/alloc.k.h>
 #include <lib/libc.k.h>
+#include <lib/rcu.k.h>
+
+// Lookups may run concurrently with a single writer inside an RCU read
+// section: item arrays are only written past what readers can see, and are
+// otherwise replaced and freed after a grace period.
 
 // sdbm from: http://www.cse.yorku.ca/~oz/hash.html
 static inline uint32_t hash(const void *data, size_t length) {
@@ -26,18 +31,19 @@ static inline uint32_t hash(const void *data, size_t length) {
 
 #define HASHMAP_DELETE(HASHMAP) do { \
     __auto_type HASHMAP_DELETE_hashmap = HASHMAP; \
+    __auto_type HASHMAP_DELETE_buckets = HASHMAP_DELETE_hashmap->buckets; \
     \
-    if (HASHMAP_DELETE_hashmap->buckets == NULL) { \
+    if (HASHMAP_DELETE_buckets == NULL) { \
         break; \
     } \
     \
+    RCU_ASSIGN_POINTER(HASHMAP_DELETE_hashmap->buckets, NULL); \
+    \
     for (size_t HASHMAP_DELETE_i = 0; HASHMAP_DELETE_i < HASHMAP_DELETE_hashmap->cap; HASHMAP_DELETE_i++) { \
-        __auto_type HASHMAP_DELETE_bucket = &HASHMAP_DELETE_hashmap->buckets[HASHMAP_DELETE_i]; \
-        \
-        free(HASHMAP_DELETE_bucket->items); \
+        rcu_free(HASHMAP_DELETE_buckets[HASHMAP_DELETE_i].items); \
     } \
     \
-    free(HASHMAP_DELETE_hashmap->buckets); \
+    rcu_free(HASHMAP_DELETE_buckets); \
 } while (0)
 
 #define HASHMAP_TYPE(TYPE) \
@@ -46,6 +52,7 @@ static inline uint32_t hash(const void *data, size_t length) {
         struct { \
             size_t cap; \
             size_t filled; \
+            size_t used; \
             struct { \
                 uint8_t key_data[HASHMAP_KEY_DATA_MAX]; \
                 size_t key_length; \
@@ -64,23 +71,28 @@ static inline uint32_t hash(const void *data, size_t length) {
     \
     __auto_type HASHMAP_GET_hashmap = HASHMAP; \
     \
-    if (HASHMAP_GET_hashmap->buckets == NULL) { \
+    __auto_type HASHMAP_GET_buckets = RCU_DEREFERENCE(HASHMAP_GET_hashmap->buckets); \
+    if (HASHMAP_GET_buckets == NULL) { \
         goto out; \
     } \
     \
     size_t HASHMAP_GET_hash = hash(HASHMAP_GET_key_data, HASHMAP_GET_key_length); \
     size_t HASHMAP_GET_index = HASHMAP_GET_hash % HASHMAP_GET_hashmap->cap; \
     \
-    __auto_type HASHMAP_GET_bucket = &HASHMAP_GET_hashmap->buckets[HASHMAP_GET_index]; \
+    __auto_type HASHMAP_GET_bucket = &HASHMAP_GET_buckets[HASHMAP_GET_index]; \
     \
-    for (size_t HASHMAP_GET_i = 0; HASHMAP_GET_i < HASHMAP_GET_bucket->filled; HASHMAP_GET_i++) { \
-        if (HASHMAP_GET_key_length != HASHMAP_GET_bucket->items[HASHMAP_GET_i].key_length) { \
+    /* filled first, any items array published after it is at least as long */ \
+    size_t HASHMAP_GET_filled = RCU_DEREFERENCE(HASHMAP_GET_bucket->filled); \
+    __auto_type HASHMAP_GET_items = RCU_DEREFERENCE(HASHMAP_GET_bucket->items); \
+    \
+    for (size_t HASHMAP_GET_i = 0; HASHMAP_GET_i < HASHMAP_GET_filled; HASHMAP_GET_i++) { \
+        if (HASHMAP_GET_key_length != HASHMAP_GET_items[HASHMAP_GET_i].key_length) { \
             continue; \
         } \
         if (memcmp(HASHMAP_GET_key_data, \
-                    HASHMAP_GET_bucket->items[HASHMAP_GET_i].key_data, \
+                    HASHMAP_GET_items[HASHMAP_GET_i].key_data, \
                     HASHMAP_GET_key_length) == 0) { \
-            RET = HASHMAP_GET_bucket->items[HASHMAP_GET_i].item; \
+            RET = HASHMAP_GET_items[HASHMAP_GET_i].item; \
             HASHMAP_GET_ok = true; \
             break; \
         } \
@@ -121,12 +133,27 @@ out: \
         if (memcmp(HASHMAP_REMOVE_key_data, \
                    HASHMAP_REMOVE_bucket->items[HASHMAP_REMOVE_i].key_data, \
                    HASHMAP_REMOVE_key_length) == 0) { \
+            /* Move the last item into the hole in a copy, so that readers */ \
+            /* see every other item whichever array and count they load */ \
+            typeof(HASHMAP_REMOVE_bucket->items) HASHMAP_REMOVE_old = HASHMAP_REMOVE_bucket->items; \
+            typeof(HASHMAP_REMOVE_bucket->items) HASHMAP_REMOVE_new = \
+                alloc(HASHMAP_REMOVE_bucket->cap * sizeof(*HASHMAP_REMOVE_bucket->items)); \
+            if (HASHMAP_REMOVE_new == NULL) { \
+                HASHMAP_REMOVE_new = HASHMAP_REMOVE_old; \
+            } else { \
+                memcpy(HASHMAP_REMOVE_new, HASHMAP_REMOVE_old, \
+                       HASHMAP_REMOVE_bucket->filled * sizeof(*HASHMAP_REMOVE_bucket->items)); \
+            } \
             if (HASHMAP_REMOVE_i != HASHMAP_REMOVE_bucket->filled - 1) { \
-                memcpy(&HASHMAP_REMOVE_bucket->items[HASHMAP_REMOVE_i], \
-                       &HASHMAP_REMOVE_bucket->items[HASHMAP_REMOVE_bucket->filled - 1], \
+                memcpy(&HASHMAP_REMOVE_new[HASHMAP_REMOVE_i], \
+                       &HASHMAP_REMOVE_new[HASHMAP_REMOVE_bucket->filled - 1], \
                        sizeof(*HASHMAP_REMOVE_bucket->items)); \
             } \
-            HASHMAP_REMOVE_bucket->filled--; \
+            if (HASHMAP_REMOVE_new != HASHMAP_REMOVE_old) { \
+                RCU_ASSIGN_POINTER(HASHMAP_REMOVE_bucket->items, HASHMAP_REMOVE_new); \
+                rcu_free(HASHMAP_REMOVE_old); \
+            } \
+            RCU_ASSIGN_POINTER(HASHMAP_REMOVE_bucket->filled, HASHMAP_REMOVE_bucket->filled - 1); \
             HASHMAP_REMOVE_ok = true; \
             break; \
         } \
@@ -147,8 +174,8 @@ out: \
     \
     __auto_type HASHMAP_INSERT_hashmap = HASHMAP; \
     if (HASHMAP_INSERT_hashmap->buckets == NULL) { \
-        HASHMAP_INSERT_hashmap->buckets = \
-            alloc(HASHMAP_INSERT_hashmap->cap * sizeof(*HASHMAP_INSERT_hashmap->buckets)); \
+        RCU_ASSIGN_POINTER(HASHMAP_INSERT_hashmap->buckets, \
+            alloc(HASHMAP_INSERT_hashmap->cap * sizeof(*HASHMAP_INSERT_hashmap->buckets))); \
     } \
     \
     size_t HASHMAP_INSERT_hash = hash(HASHMAP_INSERT_key_data, HASHMAP_INSERT_key_length); \
@@ -158,15 +185,24 @@ out: \
     \
     if (HASHMAP_INSERT_bucket->cap == 0) { \
         HASHMAP_INSERT_bucket->cap = 16; \
-        HASHMAP_INSERT_bucket->items = \
-            alloc(HASHMAP_INSERT_bucket->cap * sizeof(*HASHMAP_INSERT_bucket->items)); \
+        RCU_ASSIGN_POINTER(HASHMAP_INSERT_bucket->items, \
+            alloc(HASHMAP_INSERT_bucket->cap * sizeof(*HASHMAP_INSERT_bucket->items))); \
     } \
     \
-    if (HASHMAP_INSERT_bucket->filled == HASHMAP_INSERT_bucket->cap) { \
-        HASHMAP_INSERT_bucket->cap *= 2; \
-        HASHMAP_INSERT_bucket->items = \
-            realloc(HASHMAP_INSERT_bucket->items, \
-                    HASHMAP_INSERT_bucket->cap * sizeof(*HASHMAP_INSERT_bucket->items)); \
+    /* The next slot may still be read through a stale count after a remove */ \
+    if (HASHMAP_INSERT_bucket->filled == HASHMAP_INSERT_bucket->cap \
+     || HASHMAP_INSERT_bucket->filled < HASHMAP_INSERT_bucket->used) { \
+        if (HASHMAP_INSERT_bucket->filled == HASHMAP_INSERT_bucket->cap) { \
+            HASHMAP_INSERT_bucket->cap *= 2; \
+        } \
+        typeof(HASHMAP_INSERT_bucket->items) HASHMAP_INSERT_old = HASHMAP_INSERT_bucket->items; \
+        typeof(HASHMAP_INSERT_bucket->items) HASHMAP_INSERT_new = \
+            alloc(HASHMAP_INSERT_bucket->cap * sizeof(*HASHMAP_INSERT_bucket->items)); \
+        memcpy(HASHMAP_INSERT_new, HASHMAP_INSERT_old, \
+               HASHMAP_INSERT_bucket->filled * sizeof(*HASHMAP_INSERT_bucket->items)); \
+        RCU_ASSIGN_POINTER(HASHMAP_INSERT_bucket->items, HASHMAP_INSERT_new); \
+        HASHMAP_INSERT_bucket->used = HASHMAP_INSERT_bucket->filled; \
+        rcu_free(HASHMAP_INSERT_old); \
     } \
     \
     __auto_type HASHMAP_INSERT_item = &HASHMAP_INSERT_bucket->items[HASHMAP_INSERT_bucket->filled]; \
@@ -175,7 +211,8 @@ out: \
     HASHMAP_INSERT_item->key_length = HASHMAP_INSERT_key_length; \
     HASHMAP_INSERT_item->item = ITEM; \
     \
-    HASHMAP_INSERT_bucket->filled++; \
+    RCU_ASSIGN_POINTER(HASHMAP_INSERT_bucket->filled, HASHMAP_INSERT_bucket->filled + 1); \
+    HASHMAP_INSERT_bucket->used = HASHMAP_INSERT_bucket->filled; \
 } while (0)
 
 #define HASHMAP_SINSERT(HASHMAP, STRING, ITEM) do { \
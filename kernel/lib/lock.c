@@ -1,35 +1,108 @@
 #include <lib/lock.k.h>
 #include <lib/panic.k.h>
+#include <mm/vmm.k.h>
+#include <sys/cpu.k.h>
 
-__attribute__((noinline)) void spinlock_acquire(spinlock_t *lock) {
-    volatile size_t deadlock_counter = 0;
-    for (;;) {
-        if (spinlock_test_and_acq(lock)) {
-            break;
-        }
-        if (++deadlock_counter >= 100000000) {
-            goto deadlock;
-        }
+// How long to back off for each waiter ahead of us, and at most
+#define SPINLOCK_BACKOFF 16
+#define SPINLOCK_BACKOFF_MAX 1024
+
+// Spin for a while before looking at the lock again, so waiters further back
+// in line leave the cache line alone for the ones about to get it. Returns
+// how many pauses that took.
+static inline uint32_t spinlock_backoff(uint32_t ahead) {
+    uint32_t spins = ahead * SPINLOCK_BACKOFF;
+    if (spins > SPINLOCK_BACKOFF_MAX) {
+        spins = SPINLOCK_BACKOFF_MAX;
+    }
+
+    for (uint32_t i = 0; i < spins; i++) {
 #if defined (__x86_64__)
         asm volatile ("pause");
 #endif
     }
-    lock->last_acquirer = __builtin_return_address(0);
-    return;
 
-deadlock:
-    panic(NULL, true, "Deadlock occurred at %llx on lock %llx whose last acquirer was %llx", __builtin_return_address(0), lock, lock->last_acquirer);
+    return spins;
 }
 
-__attribute__((noinline)) void spinlock_acquire_no_dead_check(spinlock_t *lock) {
+#if LOCKSTAT
+__attribute__((noinline)) bool spinlock_test_and_acq(spinlock_t *lock) {
+    uint32_t owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+    if (!CAS(&lock->next, owner, owner + 1)) {
+        return false;
+    }
+    lock->last_acquirer = __builtin_return_address(0);
+    lockstat_acquired(lock, false, 0);
+    return true;
+}
+#endif
+
+// Waiters leave interrupts as they found them. Holding a spinlock does not
+// stop preemption, so a waiter on the holder's CPU has to let the tick in to
+// ever see the lock released. A lock that interrupt handlers also take has to
+// be taken with spinlock_acquire_irqsave() everywhere instead, or a handler
+// could queue behind a ticket its own CPU holds.
+static inline void acquire(spinlock_t *lock, bool dead_check, void *caller) {
+    uint32_t owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+    if (CAS(&lock->next, owner, owner + 1)) {
+        lock->last_acquirer = caller;
+#if LOCKSTAT
+        lockstat_acquired(lock, false, 0);
+#endif
+        return;
+    }
+
+#if LOCKSTAT
+    uint64_t spin_start = rdtsc();
+#endif
+
+    // With interrupts off a TLB shootdown IPI cannot get in either, and the
+    // CPU holding the lock may be waiting for us to flush, so check by hand
+    bool irqs_off = !interrupt_state();
+
+    volatile size_t deadlock_counter = 0;
+    uint32_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_SEQ_CST);
     for (;;) {
-        if (spinlock_test_and_acq(lock)) {
+        owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+        if (owner == ticket) {
             break;
         }
+        if (irqs_off) {
+            vmm_tlb_shootdown_poll();
+        }
+        // Counted in pauses, so backing off does not stretch the timeout
+        if (dead_check && deadlock_counter >= 100000000) {
+            panic(NULL, true, "Deadlock occurred at %llx on lock %llx whose last acquirer was %llx", caller, lock, lock->last_acquirer);
+        }
+        deadlock_counter += spinlock_backoff(ticket - owner - 1) + 1;
 #if defined (__x86_64__)
         asm volatile ("pause");
 #endif
     }
-    lock->last_acquirer = __builtin_return_address(0);
+
+    lock->last_acquirer = caller;
+#if LOCKSTAT
+    lockstat_acquired(lock, true, rdtsc() - spin_start);
+#endif
 }
 
+__attribute__((noinline)) void spinlock_acquire(spinlock_t *lock) {
+    acquire(lock, true, __builtin_return_address(0));
+}
+
+__attribute__((noinline)) void spinlock_acquire_no_dead_check(spinlock_t *lock) {
+    acquire(lock, false, __builtin_return_address(0));
+}
+
+// For locks also taken from interrupt handlers, which must not interrupt the
+// holder or a waiter on its own CPU. Only these wait with interrupts off.
+__attribute__((noinline)) bool spinlock_acquire_irqsave(spinlock_t *lock) {
+    bool old_state = interrupt_toggle(false);
+    acquire(lock, true, __builtin_return_address(0));
+    return old_state;
+}
+
+void spinlock_release_irqrestore(spinlock_t *lock, bool old_state) {
+    spinlock_release(lock);
+    interrupt_toggle(old_state);
+}
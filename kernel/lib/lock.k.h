@@ -1,29 +1,66 @@
 #ifndef _LIB__LOCK_K_H
 #define _LIB__LOCK_K_H
 
+#include <stdint.h>
 #include <stdbool.h>
 #include <lib/misc.k.h>
 
+// Build with LYRE_LOCKSTAT=1 to collect lock statistics, see lockstat.c
+#ifndef LOCKSTAT
+#define LOCKSTAT 0
+#endif
+
+// Ticket lock: acquirers take a ticket from `next` and wait for `owner` to
+// reach it, so the lock is handed out in the order it was asked for
 #ifndef HAVE_SPINLOCK_T
 typedef struct {
-    int lock;
+    uint32_t next;
+    uint32_t owner;
     void *last_acquirer;
+#if LOCKSTAT
+    uint64_t acquired_at;
+#endif
 } spinlock_t;
 #define HAVE_SPINLOCK_T
 #endif
 
-#define SPINLOCK_INIT {0, NULL}
+#if LOCKSTAT
+#define SPINLOCK_INIT {0, 0, NULL, 0}
+
+void lockstat_acquired(spinlock_t *lock, bool contended, uint64_t spin_cycles);
+void lockstat_released(spinlock_t *lock);
+
+// Out of line so it can tell where it was called from
+bool spinlock_test_and_acq(spinlock_t *lock);
+#else
+#define SPINLOCK_INIT {0, 0, NULL}
 
 static inline bool spinlock_test_and_acq(spinlock_t *lock) {
-    return CAS(&lock->lock, 0, 1);
+    uint32_t owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+    return CAS(&lock->next, owner, owner + 1);
 }
+#endif
 
 void spinlock_acquire(spinlock_t *lock);
 void spinlock_acquire_no_dead_check(spinlock_t *lock);
+bool spinlock_acquire_irqsave(spinlock_t *lock);
+void spinlock_release_irqrestore(spinlock_t *lock, bool old_state);
 
 static inline void spinlock_release(spinlock_t *lock) {
+#if LOCKSTAT
+    lockstat_released(lock);
+#endif
+
     lock->last_acquirer = NULL;
-    __atomic_store_n(&lock->lock, 0, __ATOMIC_SEQ_CST);
+
+    // Releasing a lock nobody holds is a no-op
+    uint32_t owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+    while (owner != __atomic_load_n(&lock->next, __ATOMIC_RELAXED)) {
+        if (__atomic_compare_exchange_n(&lock->owner, &owner, owner + 1, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
 }
 
 #endif
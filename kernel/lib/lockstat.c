@@ -0,0 +1,171 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <lib/lock.k.h>
+
+#if LOCKSTAT
+
+#include <lib/alloc.k.h>
+#include <lib/errno.k.h>
+#include <lib/libc.k.h>
+#include <lib/lockstat.k.h>
+#include <lib/resource.k.h>
+#include <lib/trace.k.h>
+#include <fs/devtmpfs.k.h>
+#include <sys/cpu.k.h>
+#include <printf/printf.h>
+
+// Spinlock statistics, one entry per place a lock is taken from. Entries
+// are claimed and updated with atomics only, as locking here would recurse.
+// Reading /dev/lockstat dumps them, writing to it resets the counters.
+
+#define LOCKSTAT_SITES 1024
+
+struct lockstat_site {
+    void *site;
+    spinlock_t *lock;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t spin_cycles;
+    uint64_t max_hold_cycles;
+};
+
+static struct lockstat_site sites[LOCKSTAT_SITES];
+
+static struct lockstat_site *site_get(void *site, bool create) {
+    if (site == NULL) {
+        return NULL;
+    }
+
+    size_t i = ((uintptr_t)site >> 2) % LOCKSTAT_SITES;
+    for (size_t probes = 0; probes < LOCKSTAT_SITES; probes++, i = (i + 1) % LOCKSTAT_SITES) {
+        void *cur = __atomic_load_n(&sites[i].site, __ATOMIC_ACQUIRE);
+        if (cur == site) {
+            return &sites[i];
+        }
+        if (cur != NULL) {
+            continue;
+        }
+        if (!create) {
+            return NULL;
+        }
+        if (CAS(&sites[i].site, NULL, site) || sites[i].site == site) {
+            return &sites[i];
+        }
+    }
+
+    return NULL;
+}
+
+void lockstat_acquired(spinlock_t *lock, bool contended, uint64_t spin_cycles) {
+    lock->acquired_at = rdtsc();
+
+    struct lockstat_site *entry = site_get(lock->last_acquirer, true);
+    if (entry == NULL) {
+        return;
+    }
+
+    entry->lock = lock;
+    __atomic_fetch_add(&entry->acquisitions, 1, __ATOMIC_RELAXED);
+    if (contended) {
+        __atomic_fetch_add(&entry->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&entry->spin_cycles, spin_cycles, __ATOMIC_RELAXED);
+    }
+}
+
+void lockstat_released(spinlock_t *lock) {
+    if (__atomic_load_n(&lock->owner, __ATOMIC_RELAXED) == __atomic_load_n(&lock->next, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    struct lockstat_site *entry = site_get(lock->last_acquirer, false);
+    if (entry == NULL) {
+        return;
+    }
+
+    uint64_t hold = rdtsc() - lock->acquired_at;
+    uint64_t max = __atomic_load_n(&entry->max_hold_cycles, __ATOMIC_RELAXED);
+    while (hold > max) {
+        if (__atomic_compare_exchange_n(&entry->max_hold_cycles, &max, hold, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+}
+
+static ssize_t lockstat_read(struct resource *this, struct f_description *description, void *buf, off_t offset, size_t count) {
+    (void)this;
+    (void)description;
+
+    // Enough for every site with a long symbol name
+    size_t line_size = 160;
+    size_t cap = (LOCKSTAT_SITES + 1) * line_size;
+    char *text = alloc(cap);
+    if (text == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t len = snprintf(text, cap, "%-48s %16s %12s %12s %16s %16s\n",
+                          "site", "lock", "acquired", "contended", "spin_cycles", "max_hold_cycles");
+
+    for (size_t i = 0; i < LOCKSTAT_SITES; i++) {
+        struct lockstat_site *entry = &sites[i];
+        if (entry->site == NULL || entry->acquisitions == 0) {
+            continue;
+        }
+
+        char name[48];
+        size_t sym_offset;
+        struct symbol sym;
+        if (trace_address((uintptr_t)entry->site, &sym_offset, &sym)) {
+            snprintf(name, sizeof(name), "%s+0x%lx", sym.name, sym_offset);
+        } else {
+            snprintf(name, sizeof(name), "%lx", (uintptr_t)entry->site);
+        }
+
+        len += snprintf(text + len, cap - len, "%-48s %16lx %12lu %12lu %16lu %16lu\n",
+                        name, (uintptr_t)entry->lock, entry->acquisitions, entry->contended,
+                        entry->spin_cycles, entry->max_hold_cycles);
+    }
+
+    ssize_t ret = 0;
+    if ((size_t)offset < len) {
+        ret = len - offset < count ? len - offset : count;
+        memcpy(buf, text + offset, ret);
+    }
+
+    free(text);
+    return ret;
+}
+
+static ssize_t lockstat_write(struct resource *this, struct f_description *description, const void *buf, off_t offset, size_t count) {
+    (void)this;
+    (void)description;
+    (void)buf;
+    (void)offset;
+
+    for (size_t i = 0; i < LOCKSTAT_SITES; i++) {
+        struct lockstat_site *entry = &sites[i];
+        __atomic_store_n(&entry->acquisitions, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&entry->contended, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&entry->spin_cycles, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&entry->max_hold_cycles, 0, __ATOMIC_RELAXED);
+    }
+
+    return count;
+}
+
+void lockstat_init(void) {
+    struct resource *res = resource_create(sizeof(struct resource));
+    res->read = lockstat_read;
+    res->write = lockstat_write;
+    res->stat.st_size = 0;
+    res->stat.st_blocks = 0;
+    res->stat.st_blksize = 4096;
+    res->stat.st_rdev = resource_create_dev_id();
+    res->stat.st_mode = 0644 | S_IFCHR;
+    devtmpfs_add_device(res, "lockstat");
+}
+
+#endif
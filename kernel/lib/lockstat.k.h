@@ -0,0 +1,10 @@
+#ifndef _LIB__LOCKSTAT_K_H
+#define _LIB__LOCKSTAT_K_H
+
+#include <lib/lock.k.h>
+
+#if LOCKSTAT
+void lockstat_init(void);
+#endif
+
+#endif
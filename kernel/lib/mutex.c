@@ -0,0 +1,152 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <lib/mutex.k.h>
+#include <lib/lock.k.h>
+#include <sys/cpu.k.h>
+#include <sched/proc.k.h>
+#include <sched/sched.k.h>
+
+static bool can_sleep(void) {
+    if (!interrupt_state()) {
+        return false;
+    }
+
+    struct thread *thread = sched_current_thread();
+    return thread != NULL && !thread->scheduling_off && thread->rcu_nesting == 0;
+}
+
+// Called with `lock` held, returns with it held again. Sleepers are pushed
+// onto `waiters`, linked through the threads, so there is no limit on how many
+// there can be.
+static void lock_wait(spinlock_t *lock, struct thread **waiters) {
+    if (!can_sleep()) {
+        spinlock_release(lock);
+#if defined (__x86_64__)
+        asm volatile ("pause");
+#endif
+        spinlock_acquire(lock);
+        return;
+    }
+
+    struct thread *thread = sched_current_thread();
+
+    bool old_ints = interrupt_toggle(false);
+
+    thread->lock_waiting = true;
+    thread->lock_wait_next = *waiters;
+    *waiters = thread;
+
+    // A wakeup in between finds the thread dequeued, so this cannot miss it
+    sched_dequeue_thread(thread);
+    spinlock_release(lock);
+    sched_yield(true);
+
+    interrupt_toggle(old_ints);
+    spinlock_acquire(lock);
+
+    // Woken by something else, such as exit(), and still on the list
+    if (thread->lock_waiting) {
+        for (struct thread **link = waiters; *link != NULL; link = &(*link)->lock_wait_next) {
+            if (*link == thread) {
+                *link = thread->lock_wait_next;
+                break;
+            }
+        }
+        thread->lock_waiting = false;
+    }
+}
+
+// Called with `lock` held. Wakes everyone up to check again, as with a rwlock
+// any number of them may get in.
+static void lock_wake(struct thread **waiters) {
+    if (*waiters == NULL) {
+        return;
+    }
+
+    bool old_ints = interrupt_toggle(false);
+
+    struct thread *thread = *waiters;
+    *waiters = NULL;
+
+    while (thread != NULL) {
+        struct thread *next = thread->lock_wait_next;
+        thread->lock_waiting = false;
+        sched_enqueue_thread(thread, false);
+        thread = next;
+    }
+
+    interrupt_toggle(old_ints);
+}
+
+bool mutex_test_and_acq(struct mutex *mutex) {
+    spinlock_acquire(&mutex->lock);
+
+    bool ret = !mutex->locked;
+    mutex->locked = true;
+
+    spinlock_release(&mutex->lock);
+    return ret;
+}
+
+void mutex_acquire(struct mutex *mutex) {
+    spinlock_acquire(&mutex->lock);
+
+    while (mutex->locked) {
+        lock_wait(&mutex->lock, &mutex->waiters);
+    }
+    mutex->locked = true;
+
+    spinlock_release(&mutex->lock);
+}
+
+void mutex_release(struct mutex *mutex) {
+    spinlock_acquire(&mutex->lock);
+
+    mutex->locked = false;
+    lock_wake(&mutex->waiters);
+
+    spinlock_release(&mutex->lock);
+}
+
+void rwlock_acquire_read(struct rwlock *rwlock) {
+    spinlock_acquire(&rwlock->lock);
+
+    while (rwlock->writer || rwlock->writers_waiting > 0) {
+        lock_wait(&rwlock->lock, &rwlock->waiters);
+    }
+    rwlock->readers++;
+
+    spinlock_release(&rwlock->lock);
+}
+
+void rwlock_release_read(struct rwlock *rwlock) {
+    spinlock_acquire(&rwlock->lock);
+
+    if (--rwlock->readers == 0) {
+        lock_wake(&rwlock->waiters);
+    }
+
+    spinlock_release(&rwlock->lock);
+}
+
+void rwlock_acquire_write(struct rwlock *rwlock) {
+    spinlock_acquire(&rwlock->lock);
+
+    rwlock->writers_waiting++;
+    while (rwlock->writer || rwlock->readers > 0) {
+        lock_wait(&rwlock->lock, &rwlock->waiters);
+    }
+    rwlock->writers_waiting--;
+    rwlock->writer = true;
+
+    spinlock_release(&rwlock->lock);
+}
+
+void rwlock_release_write(struct rwlock *rwlock) {
+    spinlock_acquire(&rwlock->lock);
+
+    rwlock->writer = false;
+    lock_wake(&rwlock->waiters);
+
+    spinlock_release(&rwlock->lock);
+}
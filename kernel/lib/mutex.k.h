@@ -0,0 +1,41 @@
+#ifndef _LIB__MUTEX_K_H
+#define _LIB__MUTEX_K_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <lib/lock.k.h>
+
+// Locks whose waiters sleep instead of spinning. Where sleeping is not
+// possible (interrupts off, scheduling off) they spin like spinlocks. They
+// must not be taken from interrupt handlers.
+
+struct mutex {
+    spinlock_t lock;
+    bool locked;
+    struct thread *waiters;
+};
+
+#define MUTEX_INIT {SPINLOCK_INIT, false, NULL}
+
+bool mutex_test_and_acq(struct mutex *mutex);
+void mutex_acquire(struct mutex *mutex);
+void mutex_release(struct mutex *mutex);
+
+// Any number of readers or a single writer. Waiting writers keep new readers
+// out so they do not starve.
+struct rwlock {
+    spinlock_t lock;
+    size_t readers;
+    bool writer;
+    size_t writers_waiting;
+    struct thread *waiters;
+};
+
+#define RWLOCK_INIT {SPINLOCK_INIT, 0, false, 0, NULL}
+
+void rwlock_acquire_read(struct rwlock *rwlock);
+void rwlock_release_read(struct rwlock *rwlock);
+void rwlock_acquire_write(struct rwlock *rwlock);
+void rwlock_release_write(struct rwlock *rwlock);
+
+#endif
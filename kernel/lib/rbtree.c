@@ -0,0 +1,258 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <lib/rbtree.k.h>
+
+static void rotate_left(struct rb_tree *tree, struct rb_node *node) {
+    struct rb_node *right = node->right;
+
+    node->right = right->left;
+    if (right->left != NULL) {
+        right->left->parent = node;
+    }
+
+    right->parent = node->parent;
+    if (node->parent == NULL) {
+        tree->root = right;
+    } else if (node == node->parent->left) {
+        node->parent->left = right;
+    } else {
+        node->parent->right = right;
+    }
+
+    right->left = node;
+    node->parent = right;
+}
+
+static void rotate_right(struct rb_tree *tree, struct rb_node *node) {
+    struct rb_node *left = node->left;
+
+    node->left = left->right;
+    if (left->right != NULL) {
+        left->right->parent = node;
+    }
+
+    left->parent = node->parent;
+    if (node->parent == NULL) {
+        tree->root = left;
+    } else if (node == node->parent->right) {
+        node->parent->right = left;
+    } else {
+        node->parent->left = left;
+    }
+
+    left->right = node;
+    node->parent = left;
+}
+
+static inline bool is_red(struct rb_node *node) {
+    return node != NULL && node->red;
+}
+
+void rb_insert(struct rb_tree *tree, struct rb_node *node, rb_less_t less) {
+    struct rb_node *parent = NULL;
+    struct rb_node **link = &tree->root;
+    bool leftmost = true;
+
+    while (*link != NULL) {
+        parent = *link;
+        if (less(node, parent)) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->red = true;
+    *link = node;
+
+    if (leftmost) {
+        tree->leftmost = node;
+    }
+
+    while (is_red(node->parent)) {
+        struct rb_node *gparent = node->parent->parent;
+
+        if (node->parent == gparent->left) {
+            struct rb_node *uncle = gparent->right;
+            if (is_red(uncle)) {
+                node->parent->red = false;
+                uncle->red = false;
+                gparent->red = true;
+                node = gparent;
+                continue;
+            }
+
+            if (node == node->parent->right) {
+                node = node->parent;
+                rotate_left(tree, node);
+            }
+
+            node->parent->red = false;
+            gparent->red = true;
+            rotate_right(tree, gparent);
+        } else {
+            struct rb_node *uncle = gparent->left;
+            if (is_red(uncle)) {
+                node->parent->red = false;
+                uncle->red = false;
+                gparent->red = true;
+                node = gparent;
+                continue;
+            }
+
+            if (node == node->parent->left) {
+                node = node->parent;
+                rotate_right(tree, node);
+            }
+
+            node->parent->red = false;
+            gparent->red = true;
+            rotate_left(tree, gparent);
+        }
+    }
+
+    tree->root->red = false;
+}
+
+struct rb_node *rb_next(struct rb_node *node) {
+    if (node->right != NULL) {
+        node = node->right;
+        while (node->left != NULL) {
+            node = node->left;
+        }
+        return node;
+    }
+
+    while (node->parent != NULL && node == node->parent->right) {
+        node = node->parent;
+    }
+
+    return node->parent;
+}
+
+static void transplant(struct rb_tree *tree, struct rb_node *old, struct rb_node *new) {
+    if (old->parent == NULL) {
+        tree->root = new;
+    } else if (old == old->parent->left) {
+        old->parent->left = new;
+    } else {
+        old->parent->right = new;
+    }
+
+    if (new != NULL) {
+        new->parent = old->parent;
+    }
+}
+
+void rb_erase(struct rb_tree *tree, struct rb_node *node) {
+    if (tree->leftmost == node) {
+        tree->leftmost = rb_next(node);
+    }
+
+    // `child` replaces the removed position, `parent` is its parent since
+    // `child` may be NULL and have nowhere to store it.
+    struct rb_node *child, *parent;
+    bool removed_red;
+
+    if (node->left == NULL || node->right == NULL) {
+        child = node->left != NULL ? node->left : node->right;
+        parent = node->parent;
+        removed_red = node->red;
+        transplant(tree, node, child);
+    } else {
+        struct rb_node *successor = node->right;
+        while (successor->left != NULL) {
+            successor = successor->left;
+        }
+
+        removed_red = successor->red;
+        child = successor->right;
+
+        if (successor->parent == node) {
+            parent = successor;
+        } else {
+            parent = successor->parent;
+            transplant(tree, successor, successor->right);
+            successor->right = node->right;
+            successor->right->parent = successor;
+        }
+
+        transplant(tree, node, successor);
+        successor->left = node->left;
+        successor->left->parent = successor;
+        successor->red = node->red;
+    }
+
+    if (removed_red) {
+        return;
+    }
+
+    while (child != tree->root && !is_red(child)) {
+        if (child == parent->left) {
+            struct rb_node *sibling = parent->right;
+
+            if (is_red(sibling)) {
+                sibling->red = false;
+                parent->red = true;
+                rotate_left(tree, parent);
+                sibling = parent->right;
+            }
+
+            if (!is_red(sibling->left) && !is_red(sibling->right)) {
+                sibling->red = true;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+
+            if (!is_red(sibling->right)) {
+                sibling->left->red = false;
+                sibling->red = true;
+                rotate_right(tree, sibling);
+                sibling = parent->right;
+            }
+
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->right->red = false;
+            rotate_left(tree, parent);
+            child = tree->root;
+        } else {
+            struct rb_node *sibling = parent->left;
+
+            if (is_red(sibling)) {
+                sibling->red = false;
+                parent->red = true;
+                rotate_right(tree, parent);
+                sibling = parent->left;
+            }
+
+            if (!is_red(sibling->left) && !is_red(sibling->right)) {
+                sibling->red = true;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+
+            if (!is_red(sibling->left)) {
+                sibling->right->red = false;
+                sibling->red = true;
+                rotate_left(tree, sibling);
+                sibling = parent->left;
+            }
+
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->left->red = false;
+            rotate_right(tree, parent);
+            child = tree->root;
+        }
+    }
+
+    if (child != NULL) {
+        child->red = false;
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef _LIB__RBTREE_K_H
+#define _LIB__RBTREE_K_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Intrusive red-black tree. Embed a struct rb_node in the structure to be
+// kept sorted and use RB_ENTRY() to get back to it.
+
+struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    bool red;
+};
+
+struct rb_tree {
+    struct rb_node *root;
+    struct rb_node *leftmost;
+};
+
+#define RB_TREE_INIT {NULL, NULL}
+
+#define RB_ENTRY(NODE, TYPE, MEMBER) ({ \
+    struct rb_node *RB_ENTRY_node = NODE; \
+    RB_ENTRY_node == NULL ? NULL : (TYPE *)((void *)RB_ENTRY_node - __builtin_offsetof(TYPE, MEMBER)); \
+})
+
+typedef bool (*rb_less_t)(struct rb_node *a, struct rb_node *b);
+
+void rb_insert(struct rb_tree *tree, struct rb_node *node, rb_less_t less);
+void rb_erase(struct rb_tree *tree, struct rb_node *node);
+struct rb_node *rb_next(struct rb_node *node);
+
+static inline struct rb_node *rb_first(struct rb_tree *tree) {
+    return tree->leftmost;
+}
+
+#endif
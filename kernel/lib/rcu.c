@@ -0,0 +1,205 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <lib/alloc.k.h>
+#include <lib/event.k.h>
+#include <lib/libc.k.h>
+#include <lib/lock.k.h>
+#include <lib/rcu.k.h>
+#include <sched/sched.k.h>
+#include <sys/cpu.k.h>
+#include <time/time.k.h>
+
+// Quiescent state based: every callback waits for a grace period number of
+// its own, and a CPU that goes through sched_reschedule() records the
+// current number. Once every CPU that is not idle recorded a number at least
+// as high, the callback can run. CPUs that take too long are sent an IPI.
+
+#define RCU_RECLAIM_INTERVAL (20 * 1000000)
+
+static uint64_t rcu_gp = 0;
+
+static spinlock_t rcu_lock = SPINLOCK_INIT;
+static struct rcu_head *rcu_callbacks = NULL;
+static struct rcu_head **rcu_callbacks_tail = &rcu_callbacks;
+static struct event rcu_event;
+
+void rcu_quiescent(struct cpu_local *cpu) {
+    __atomic_store_n(&cpu->rcu_qs_gp, __atomic_load_n(&rcu_gp, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+void rcu_call(struct rcu_head *head, void (*func)(struct rcu_head *head)) {
+    head->func = func;
+    head->next = NULL;
+
+    spinlock_acquire(&rcu_lock);
+
+    head->gp = __atomic_add_fetch(&rcu_gp, 1, __ATOMIC_SEQ_CST);
+
+    bool was_empty = rcu_callbacks == NULL;
+    *rcu_callbacks_tail = head;
+    rcu_callbacks_tail = &head->next;
+
+    spinlock_release(&rcu_lock);
+
+    if (was_empty) {
+        event_trigger(&rcu_event, false);
+    }
+}
+
+struct rcu_free_node {
+    struct rcu_head rcu;
+    void *ptr;
+};
+
+static void rcu_free_callback(struct rcu_head *head) {
+    struct rcu_free_node *node = (struct rcu_free_node *)head;
+    free(node->ptr);
+    free(node);
+}
+
+void rcu_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    struct rcu_free_node *node = ALLOC(struct rcu_free_node);
+    if (node == NULL) {
+        // Leaking it beats freeing it under a reader
+        return;
+    }
+
+    node->ptr = ptr;
+    rcu_call(&node->rcu, rcu_free_callback);
+}
+
+static void rcu_reclaim(void) {
+    // We are not in a read section ourselves
+    bool old_ints = interrupt_toggle(false);
+    struct cpu_local *us = this_cpu();
+    rcu_quiescent(us);
+    interrupt_toggle(old_ints);
+
+    uint64_t completed = UINT64_MAX;
+    for (size_t i = 0; i < cpu_count; i++) {
+        struct cpu_local *cpu = &cpus[i];
+        // Idle CPUs have no readers
+        if (!cpu->active) {
+            continue;
+        }
+        uint64_t gp = __atomic_load_n(&cpu->rcu_qs_gp, __ATOMIC_SEQ_CST);
+        if (gp < completed) {
+            completed = gp;
+        }
+    }
+
+    spinlock_acquire(&rcu_lock);
+
+    struct rcu_head *done = rcu_callbacks;
+    struct rcu_head *last_done = NULL;
+    for (struct rcu_head *it = rcu_callbacks; it != NULL && it->gp <= completed; it = it->next) {
+        last_done = it;
+    }
+
+    if (last_done == NULL) {
+        done = NULL;
+    } else {
+        rcu_callbacks = last_done->next;
+        if (rcu_callbacks == NULL) {
+            rcu_callbacks_tail = &rcu_callbacks;
+        }
+        last_done->next = NULL;
+    }
+
+    uint64_t waiting_for = rcu_callbacks != NULL ? rcu_callbacks->gp : 0;
+
+    spinlock_release(&rcu_lock);
+
+    // Make CPUs holding up the oldest callback go through the scheduler,
+    // one running user code without a tick might not for a long time
+    if (waiting_for != 0) {
+        for (size_t i = 0; i < cpu_count; i++) {
+            struct cpu_local *cpu = &cpus[i];
+            if (cpu != us && cpu->active && __atomic_load_n(&cpu->rcu_qs_gp, __ATOMIC_SEQ_CST) < waiting_for) {
+                sched_kick(cpu);
+            }
+        }
+    }
+
+    while (done != NULL) {
+        struct rcu_head *next = done->next;
+        done->func(done);
+        done = next;
+    }
+}
+
+static void rcu_thread(void) {
+    for (;;) {
+        spinlock_acquire(&rcu_lock);
+        bool empty = rcu_callbacks == NULL;
+        spinlock_release(&rcu_lock);
+
+        if (empty) {
+            struct event *events[] = {&rcu_event};
+            event_await(events, 1, true);
+        } else {
+            time_nsleep(RCU_RECLAIM_INTERVAL);
+        }
+
+        rcu_reclaim();
+    }
+}
+
+void rcu_init(void) {
+    sched_new_kernel_thread(rcu_thread, NULL, true);
+}
+
+bool rcu_array_insert(struct rcu_array **array, void *item) {
+    struct rcu_array *old = *array;
+    size_t length = old != NULL ? old->length : 0;
+
+    struct rcu_array *new = alloc(sizeof(struct rcu_array) + (length + 1) * sizeof(void *));
+    if (new == NULL) {
+        return false;
+    }
+
+    if (old != NULL) {
+        memcpy(new->items, old->items, length * sizeof(void *));
+    }
+    new->items[length] = item;
+    new->length = length + 1;
+
+    RCU_ASSIGN_POINTER(*array, new);
+    if (old != NULL) {
+        rcu_free(old);
+    }
+    return true;
+}
+
+bool rcu_array_remove(struct rcu_array **array, void *item) {
+    struct rcu_array *old = *array;
+    if (old == NULL) {
+        return false;
+    }
+
+    size_t index = 0;
+    while (index < old->length && old->items[index] != item) {
+        index++;
+    }
+    if (index == old->length) {
+        return false;
+    }
+
+    struct rcu_array *new = alloc(sizeof(struct rcu_array) + (old->length - 1) * sizeof(void *));
+    if (new == NULL) {
+        return false;
+    }
+
+    memcpy(new->items, old->items, index * sizeof(void *));
+    memcpy(&new->items[index], &old->items[index + 1], (old->length - index - 1) * sizeof(void *));
+    new->length = old->length - 1;
+
+    RCU_ASSIGN_POINTER(*array, new);
+    rcu_free(old);
+    return true;
+}
@@ -0,0 +1,50 @@
+#ifndef _LIB__RCU_K_H
+#define _LIB__RCU_K_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sched/proc.k.h>
+
+// Read-copy-update. Readers run between rcu_read_lock() and rcu_read_unlock()
+// without taking any lock, and must not sleep in between. Writers serialise
+// among themselves, publish new versions with RCU_ASSIGN_POINTER() and hand
+// old ones to rcu_call() or rcu_free(), which run once every CPU went through
+// the scheduler or was idle, so no reader can still see them.
+
+struct rcu_head {
+    struct rcu_head *next;
+    uint64_t gp;
+    void (*func)(struct rcu_head *head);
+};
+
+#define RCU_DEREFERENCE(PTR) __atomic_load_n(&(PTR), __ATOMIC_ACQUIRE)
+#define RCU_ASSIGN_POINTER(PTR, VALUE) __atomic_store_n(&(PTR), (VALUE), __ATOMIC_RELEASE)
+
+// The scheduler does not switch away from a thread inside a read section
+static inline void rcu_read_lock(void) {
+    sched_current_thread()->rcu_nesting++;
+    asm volatile ("" ::: "memory");
+}
+
+static inline void rcu_read_unlock(void) {
+    asm volatile ("" ::: "memory");
+    sched_current_thread()->rcu_nesting--;
+}
+
+void rcu_init(void);
+void rcu_quiescent(struct cpu_local *cpu);
+void rcu_call(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void rcu_free(void *ptr);
+
+// Array of pointers that readers walk locklessly, writers replace it whole
+struct rcu_array {
+    struct rcu_head rcu;
+    size_t length;
+    void *items[];
+};
+
+bool rcu_array_insert(struct rcu_array **array, void *item);
+bool rcu_array_remove(struct rcu_array **array, void *item);
+
+#endif
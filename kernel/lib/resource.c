@@ -34,6 +34,8 @@ int resource_default_ioctl(struct resource *this, struct f_description *descript
     return -1;
 }
 
+static struct kmem_cache f_description_cache = KMEM_CACHE_INIT("f_description", sizeof(struct f_description), _Alignof(struct f_description), NULL);
+
 static ssize_t stub_read(struct resource *this, struct f_description *description, void *buf, off_t offset, size_t count) {
     (void)this;
     (void)description;
@@ -258,7 +260,7 @@ int fdnum_dup(struct process *old_proc, int old_fdnum, struct process *new_proc,
 }
 
 struct f_descriptor *fd_create_from_resource(struct resource *res, int flags) {
-    struct f_description *description = ALLOC(struct f_description);
+    struct f_description *description = kmem_cache_alloc(&f_description_cache);
     if (description == NULL) {
         goto fail;
     }
@@ -0,0 +1,45 @@
+#ifndef _LIB__SEQCOUNT_K_H
+#define _LIB__SEQCOUNT_K_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Sequence counter for data with a single writer (or writers serialised by
+// some other lock) and lock-free readers. The count is odd while a write is
+// in progress, readers copy the data and retry if the count moved:
+//
+//     uint32_t seq;
+//     do {
+//         seq = seqcount_read_begin(&sc);
+//         copy = data;
+//     } while (seqcount_read_retry(&sc, seq));
+
+struct seqcount {
+    uint32_t sequence;
+};
+
+#define SEQCOUNT_INIT {0}
+
+static inline uint32_t seqcount_read_begin(struct seqcount *sc) {
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&sc->sequence, __ATOMIC_ACQUIRE)) & 1) {
+        asm volatile ("pause");
+    }
+    return seq;
+}
+
+static inline bool seqcount_read_retry(struct seqcount *sc, uint32_t seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&sc->sequence, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void seqcount_write_begin(struct seqcount *sc) {
+    __atomic_store_n(&sc->sequence, sc->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqcount_write_end(struct seqcount *sc) {
+    __atomic_store_n(&sc->sequence, sc->sequence + 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -4,7 +4,9 @@
 #include <sys/mman.h>
 #include <lib/alloc.k.h>
 #include <lib/errno.k.h>
+#include <lib/libc.k.h>
 #include <lib/lock.k.h>
+#include <lib/mutex.k.h>
 #include <lib/misc.k.h>
 #include <lib/print.k.h>
 #include <lib/resource.k.h>
@@ -46,55 +48,202 @@ void mmap_list_ranges(struct pagemap *pagemap) {
     );
 }
 
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+#ifndef MADV_NOHUGEPAGE
+#define MADV_NOHUGEPAGE 15
+#endif
+
+#define HUGE_PAGE_PAGES (PAGE_SIZE_2M / PAGE_SIZE)
+
+static uint64_t prot_to_pte_flags(int prot) {
+    uint64_t pt_flags = PTE_PRESENT | PTE_USER;
+
+    if ((prot & PROT_WRITE) != 0) {
+        pt_flags |= PTE_WRITABLE;
+    }
+    if ((prot & PROT_EXEC) == 0) {
+        pt_flags |= PTE_NX;
+    }
+
+    return pt_flags;
+}
+
+// Backs the 2 MiB around virt with a single large page, if the range covers
+// all of it and none of it has been paged in yet. Called with the fault lock
+// of the range held.
+static bool map_huge_page(struct mmap_range_local *local_range, uintptr_t virt) {
+    if ((local_range->flags & MAP_SHARED) != 0 || local_range->no_huge_pages) {
+        return false;
+    }
+
+    uintptr_t base = ALIGN_DOWN(virt, PAGE_SIZE_2M);
+    if (base < local_range->base || base + PAGE_SIZE_2M > local_range->base + local_range->length) {
+        return false;
+    }
+
+    struct mmap_range_global *global = local_range->global;
+    uint64_t pt_flags = prot_to_pte_flags(local_range->prot);
+
+    void *block = pmm_alloc_nozero(HUGE_PAGE_PAGES);
+    if (block == NULL) {
+        return false;
+    }
+
+    // The shadow pagemap is never loaded, so the block is only cleared once
+    // it is known that nothing is in the way
+    if (!vmm_map_large_page(global->shadow_pagemap, base, (uintptr_t)block, pt_flags, PAGE_SIZE_2M)) {
+        goto fail;
+    }
+
+    memset(block + VMM_HIGHER_HALF, 0, PAGE_SIZE_2M);
+
+    if (!vmm_map_large_page(local_range->pagemap, base, (uintptr_t)block, pt_flags, PAGE_SIZE_2M)) {
+        vmm_unmap_large_page(global->shadow_pagemap, base, false);
+        goto fail;
+    }
+
+    return true;
+
+fail:
+    pmm_free(block, HUGE_PAGE_PAGES);
+    return false;
+}
+
+// Gives the faulting process a page of its own, or just write access if no
+// other process shares the page anymore. Called with the pagemap lock held.
+static bool break_cow(struct pagemap *pagemap, struct mmap_range_global *global, uintptr_t virt) {
+    virt = ALIGN_DOWN(virt, PAGE_SIZE);
+
+    uint64_t *pte = vmm_virt2pte(pagemap, virt, false);
+    if (pte == NULL || (PTE_GET_FLAGS(*pte) & PTE_PRESENT) == 0) {
+        return false;
+    }
+
+    // Another thread got here first
+    if ((PTE_GET_FLAGS(*pte) & PTE_WRITABLE) != 0) {
+        return true;
+    }
+
+    if ((PTE_GET_FLAGS(*pte) & PTE_COW) == 0) {
+        return false;
+    }
+
+    void *old_page = (void *)PTE_GET_ADDR(*pte);
+    uint64_t flags = (PTE_GET_FLAGS(*pte) & ~PTE_COW) | PTE_WRITABLE;
+
+    bool shared = pmm_page_shared(old_page);
+    if (shared) {
+        void *page = pmm_alloc_nozero(1);
+        if (page == NULL) {
+            return false;
+        }
+
+        memcpy(page + VMM_HIGHER_HALF, old_page + VMM_HIGHER_HALF, PAGE_SIZE);
+        *pte = (uint64_t)page | flags;
+    } else {
+        *pte = (uint64_t)old_page | flags;
+    }
+
+    uint64_t *spte = vmm_virt2pte(global->shadow_pagemap, virt, false);
+    if (spte != NULL && (PTE_GET_FLAGS(*spte) & PTE_PRESENT) != 0) {
+        *spte = *pte;
+    }
+
+    vmm_tlb_shootdown(pagemap);
+
+    if (shared) {
+        pmm_page_unref(old_page);
+    }
+
+    return true;
+}
+
 bool mmap_handle_pf(struct cpu_ctx *ctx) {
-    if ((ctx->err & 0x1) != 0) {
+    // Of the faults on present pages, only writes can be to copy-on-write pages
+    if ((ctx->err & 0x3) == 0x1) {
         return false;
     }
 
-    // TODO: mmap can be expensive, consider enabling interrupts
-    // temporarily
     uint64_t cr2 = read_cr2();
 
+    // Paging in may have to wait for the pagemap or the backing resource.
+    // Run with interrupts on if the faulting code did, so that waiting
+    // sleeps instead of spinning.
+    interrupt_toggle((ctx->rflags & (1 << 9)) != 0);
+
+    bool ret = false;
+
     struct thread *thread = sched_current_thread();
     struct process *process = thread->process;
     struct pagemap *pagemap = process->pagemap;
 
-    spinlock_acquire(&pagemap->lock);
+    mutex_acquire(&pagemap->lock);
 
     struct addr2range range = addr2range(pagemap, cr2);
     struct mmap_range_local *local_range = range.range;
 
-    spinlock_release(&pagemap->lock);
+    if ((ctx->err & 0x1) != 0) {
+        if (local_range != NULL && (local_range->prot & PROT_WRITE) != 0) {
+            ret = break_cow(pagemap, local_range->global, cr2);
+        }
+
+        mutex_release(&pagemap->lock);
+        goto cleanup;
+    }
+
+    mutex_release(&pagemap->lock);
 
     if (local_range == NULL) {
-        return false;
+        goto cleanup;
+    }
+
+    struct mmap_range_global *global = local_range->global;
+    mutex_acquire(&global->fault_lock);
+
+    // Another thread paged it in while this one was waiting
+    if (vmm_virt2phys(pagemap, cr2) != INVALID_PHYS) {
+        ret = true;
+        goto cleanup_locked;
     }
 
     void *page = NULL;
     if ((local_range->flags & MAP_ANONYMOUS) != 0) {
+        if (map_huge_page(local_range, cr2)) {
+            ret = true;
+            goto cleanup_locked;
+        }
+
         page = pmm_alloc(1);
     } else {
-        struct resource *res = page = local_range->global->res;
+        struct resource *res = page = global->res;
         page = res->mmap(res, range.file_page, local_range->flags);
     }
 
     if (page == NULL) {
-        return false;
+        goto cleanup_locked;
     }
 
-    return mmap_page_in_range(local_range->global, range.memory_page * PAGE_SIZE, (uintptr_t)page, local_range->prot);
+    uintptr_t virt = range.memory_page * PAGE_SIZE;
+    ret = mmap_page_in_range(global, virt, (uintptr_t)page, local_range->prot);
+
+    // Ranges split off by mprotect() and madvise() are not among the locals
+    // of their global range
+    if (ret && vmm_virt2phys(pagemap, virt) == INVALID_PHYS) {
+        ret = vmm_map_page(pagemap, virt, (uintptr_t)page, prot_to_pte_flags(local_range->prot));
+    }
+
+cleanup_locked:
+    mutex_release(&global->fault_lock);
+cleanup:
+    interrupt_toggle(false);
+    return ret;
 }
 
 bool mmap_page_in_range(struct mmap_range_global *global, uintptr_t virt,
                             uintptr_t phys, int prot) {
-    uint64_t pt_flags = PTE_PRESENT | PTE_USER;
-
-    if ((prot & PROT_WRITE) != 0) {
-        pt_flags |= PTE_WRITABLE;
-    }
-    if ((prot & PROT_EXEC) == 0) {
-        pt_flags |= PTE_NX;
-    }
+    uint64_t pt_flags = prot_to_pte_flags(prot);
 
     if (!vmm_map_page(global->shadow_pagemap, virt, phys, pt_flags)) {
         return false;
@@ -130,6 +279,7 @@ bool mmap_range(struct pagemap *pagemap, uintptr_t virt, uintptr_t phys,
         goto cleanup;
     }
 
+    global_range->fault_lock = (struct mutex)MUTEX_INIT;
     global_range->shadow_pagemap = vmm_new_pagemap();
     if (global_range->shadow_pagemap == NULL) {
         goto cleanup;
@@ -153,11 +303,11 @@ bool mmap_range(struct pagemap *pagemap, uintptr_t virt, uintptr_t phys,
 
     VECTOR_PUSH_BACK(&global_range->locals, local_range);
 
-    spinlock_acquire(&pagemap->lock);
+    mutex_acquire(&pagemap->lock);
 
     VECTOR_PUSH_BACK(&pagemap->mmap_ranges, local_range);
 
-    spinlock_release(&pagemap->lock);
+    mutex_release(&pagemap->lock);
 
     for (size_t i = 0; i < aligned_length; i += PAGE_SIZE) {
         if (!mmap_page_in_range(global_range, aligned_virt + i, phys + i, prot)) {
@@ -208,7 +358,7 @@ int mprotect(struct pagemap *pagemap, uintptr_t addr, size_t length, int prot) {
         uintptr_t snip_end = i;
         uintptr_t snip_size = snip_end - snip_begin;
 
-        spinlock_acquire(&pagemap->lock);
+        mutex_acquire(&pagemap->lock);
 
         if (snip_begin > local_range->base && snip_end < local_range->base + local_range->length) {
             struct mmap_range_local *postsplit_range = ALLOC(struct mmap_range_local);
@@ -220,6 +370,7 @@ int mprotect(struct pagemap *pagemap, uintptr_t addr, size_t length, int prot) {
             postsplit_range->offset = local_range->offset + (off_t)(snip_end - local_range->base);
             postsplit_range->prot = local_range->prot;
             postsplit_range->flags = local_range->flags;
+            postsplit_range->no_huge_pages = local_range->no_huge_pages;
 
             VECTOR_PUSH_BACK(&pagemap->mmap_ranges, postsplit_range);
 
@@ -227,13 +378,20 @@ int mprotect(struct pagemap *pagemap, uintptr_t addr, size_t length, int prot) {
         }
 
         for (uintptr_t j = snip_begin; j < snip_end; j += PAGE_SIZE) {
-            uint64_t pt_flags = PTE_PRESENT | PTE_USER;
-
-            if ((prot & PROT_WRITE) != 0) {
-                pt_flags |= PTE_WRITABLE;
+            uint64_t pt_flags = prot_to_pte_flags(prot);
+
+            // Huge pages only have to be split if the change covers part of
+            // them
+            if (j % PAGE_SIZE_2M == 0 && snip_end - j >= PAGE_SIZE_2M &&
+                vmm_flag_large_page(pagemap, false, j, pt_flags)) {
+                j += PAGE_SIZE_2M - PAGE_SIZE;
+                continue;
             }
-            if ((prot & PROT_EXEC) == 0) {
-                pt_flags |= PTE_NX;
+
+            // Shared pages stay read-only until written to
+            uint64_t *pte = vmm_virt2pte(pagemap, j, false);
+            if (pte != NULL && (PTE_GET_FLAGS(*pte) & PTE_COW) != 0) {
+                pt_flags = (pt_flags & ~PTE_WRITABLE) | PTE_COW;
             }
 
             vmm_flag_page(pagemap, false, j, pt_flags);
@@ -256,10 +414,11 @@ int mprotect(struct pagemap *pagemap, uintptr_t addr, size_t length, int prot) {
         new_range->offset = new_offset;
         new_range->prot = prot;
         new_range->flags = local_range->flags;
+        new_range->no_huge_pages = local_range->no_huge_pages;
 
         VECTOR_PUSH_BACK(&pagemap->mmap_ranges, new_range);
 
-        spinlock_release(&pagemap->lock);
+        mutex_release(&pagemap->lock);
     }
 
     ret = 0;
@@ -293,6 +452,11 @@ void *mmap(struct pagemap *pagemap, uintptr_t addr, size_t length, int prot,
         }
         base = addr;
     } else {
+        // Give huge pages a chance in anything big enough to hold one
+        if (length >= PAGE_SIZE_2M) {
+            process->mmap_anon_base = ALIGN_UP(process->mmap_anon_base, PAGE_SIZE_2M);
+        }
+
         base = process->mmap_anon_base;
         process->mmap_anon_base += length + PAGE_SIZE;
     }
@@ -303,6 +467,7 @@ void *mmap(struct pagemap *pagemap, uintptr_t addr, size_t length, int prot,
         goto cleanup;
     }
 
+    global_range->fault_lock = (struct mutex)MUTEX_INIT;
     global_range->shadow_pagemap = vmm_new_pagemap();
     if (global_range->shadow_pagemap == NULL) {
         goto cleanup;
@@ -328,11 +493,11 @@ void *mmap(struct pagemap *pagemap, uintptr_t addr, size_t length, int prot,
 
     VECTOR_PUSH_BACK(&global_range->locals, local_range);
 
-    spinlock_acquire(&pagemap->lock);
+    mutex_acquire(&pagemap->lock);
 
     VECTOR_PUSH_BACK(&pagemap->mmap_ranges, local_range);
 
-    spinlock_release(&pagemap->lock);
+    mutex_release(&pagemap->lock);
 
     if (res != NULL) {
         res->refcount++;
@@ -381,14 +546,14 @@ bool munmap(struct pagemap *pagemap, uintptr_t addr, size_t length) {
         uintptr_t snip_end = i;
         size_t snip_length = snip_end - snip_begin;
 
-        spinlock_acquire(&pagemap->lock);
+        mutex_acquire(&pagemap->lock);
 
         if (snip_begin > local_range->base && snip_end < local_range->base + local_range->length) {
             struct mmap_range_local *postsplit_range = ALLOC(struct mmap_range_local);
             if (postsplit_range == NULL) {
                 // FIXME: Page map is in inconsistent state at this point!
                 errno = ENOMEM;
-                spinlock_release(&pagemap->lock);
+                mutex_release(&pagemap->lock);
                 return false;
             }
 
@@ -399,6 +564,7 @@ bool munmap(struct pagemap *pagemap, uintptr_t addr, size_t length) {
             postsplit_range->offset = local_range->offset + (off_t)(snip_end - local_range->base);
             postsplit_range->prot = local_range->prot;
             postsplit_range->flags = local_range->flags;
+            postsplit_range->no_huge_pages = local_range->no_huge_pages;
 
             VECTOR_PUSH_BACK(&pagemap->mmap_ranges, postsplit_range);
 
@@ -406,6 +572,11 @@ bool munmap(struct pagemap *pagemap, uintptr_t addr, size_t length) {
         }
 
         for (uintptr_t j = snip_begin; j < snip_end; j += PAGE_SIZE) {
+            if (j % PAGE_SIZE_2M == 0 && snip_end - j >= PAGE_SIZE_2M && vmm_unmap_large_page(pagemap, j, true)) {
+                j += PAGE_SIZE_2M - PAGE_SIZE;
+                continue;
+            }
+
             vmm_unmap_page(pagemap, j, true);
         }
 
@@ -413,7 +584,7 @@ bool munmap(struct pagemap *pagemap, uintptr_t addr, size_t length) {
             VECTOR_REMOVE_BY_VALUE(&pagemap->mmap_ranges, local_range);
         }
 
-        spinlock_release(&pagemap->lock);
+        mutex_release(&pagemap->lock);
 
         if (snip_length == local_range->length && global_range->locals.length == 1) {
             if ((local_range->flags & MAP_ANONYMOUS) != 0) {
@@ -423,12 +594,20 @@ bool munmap(struct pagemap *pagemap, uintptr_t addr, size_t length) {
                         continue;
                     }
 
+                    // Forking splits huge pages, one that is still whole is
+                    // not shared
+                    if (j % PAGE_SIZE_2M == 0 && vmm_unmap_large_page(global_range->shadow_pagemap, j, true)) {
+                        pmm_free((void *)phys, HUGE_PAGE_PAGES);
+                        j += PAGE_SIZE_2M - PAGE_SIZE;
+                        continue;
+                    }
+
                     if (!vmm_unmap_page(global_range->shadow_pagemap, j, true)) {
                         // FIXME: Page map is in inconsistent state at this point!
                         errno = EINVAL;
                         return false;
                     }
-                    pmm_free((void *)phys, 1);
+                    pmm_page_unref((void *)phys);
                 }
             } else {
                 // TODO: res->unmap();
@@ -446,6 +625,82 @@ bool munmap(struct pagemap *pagemap, uintptr_t addr, size_t length) {
     return true;
 }
 
+// Only the huge page hints do anything, everything else is accepted and
+// ignored
+int madvise(struct pagemap *pagemap, uintptr_t addr, size_t length, int advice) {
+    if (length == 0 || addr % PAGE_SIZE != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    length = ALIGN_UP(length, PAGE_SIZE);
+
+    if (advice != MADV_HUGEPAGE && advice != MADV_NOHUGEPAGE) {
+        return 0;
+    }
+    bool no_huge_pages = advice == MADV_NOHUGEPAGE;
+
+    mutex_acquire(&pagemap->lock);
+
+    for (uintptr_t i = addr; i < addr + length; i += PAGE_SIZE) {
+        struct mmap_range_local *local_range = addr2range(pagemap, i).range;
+        if (local_range == NULL) {
+            continue;
+        }
+
+        uintptr_t snip_begin = i;
+        uintptr_t snip_end = MIN(local_range->base + local_range->length, addr + length);
+
+        if (local_range->no_huge_pages == no_huge_pages) {
+            i = snip_end - PAGE_SIZE;
+            continue;
+        }
+
+        // Give the advised part a range of its own
+        if (snip_end < local_range->base + local_range->length) {
+            struct mmap_range_local *postsplit_range = ALLOC(struct mmap_range_local);
+            if (postsplit_range == NULL) {
+                mutex_release(&pagemap->lock);
+                errno = ENOMEM;
+                return -1;
+            }
+
+            *postsplit_range = *local_range;
+            postsplit_range->base = snip_end;
+            postsplit_range->length = (local_range->base + local_range->length) - snip_end;
+            postsplit_range->offset = local_range->offset + (off_t)(snip_end - local_range->base);
+
+            VECTOR_PUSH_BACK(&pagemap->mmap_ranges, postsplit_range);
+
+            local_range->length -= postsplit_range->length;
+        }
+
+        if (snip_begin > local_range->base) {
+            struct mmap_range_local *new_range = ALLOC(struct mmap_range_local);
+            if (new_range == NULL) {
+                mutex_release(&pagemap->lock);
+                errno = ENOMEM;
+                return -1;
+            }
+
+            *new_range = *local_range;
+            new_range->base = snip_begin;
+            new_range->length = snip_end - snip_begin;
+            new_range->offset = local_range->offset + (off_t)(snip_begin - local_range->base);
+
+            VECTOR_PUSH_BACK(&pagemap->mmap_ranges, new_range);
+
+            local_range->length -= new_range->length;
+            local_range = new_range;
+        }
+
+        local_range->no_huge_pages = no_huge_pages;
+        i = snip_end - PAGE_SIZE;
+    }
+
+    mutex_release(&pagemap->lock);
+    return 0;
+}
+
 void *syscall_mmap(void *_, uintptr_t hint, size_t length, uint64_t flags, int fdnum, off_t offset) {
     (void)_;
 
@@ -502,3 +757,17 @@ int syscall_mprotect(void *_, uintptr_t addr, size_t length, int prot) {
     DEBUG_SYSCALL_LEAVE("%d", ret);
     return ret;
 }
+
+int syscall_madvise(void *_, uintptr_t addr, size_t length, int advice) {
+    (void)_;
+
+    DEBUG_SYSCALL_ENTER("madvise(%lx, %lx, %d)", addr, length, advice);
+
+    struct thread *thread = sched_current_thread();
+    struct process *proc = thread->process;
+
+    int ret = madvise(proc->pagemap, addr, length, advice);
+
+    DEBUG_SYSCALL_LEAVE("%d", ret);
+    return ret;
+}
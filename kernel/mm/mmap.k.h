@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <lib/mutex.k.h>
 #include <lib/vector.k.h>
 #include <mm/vmm.k.h>
 #include <sys/cpu.k.h>
@@ -12,6 +13,8 @@
 
 struct mmap_range_global {
     struct pagemap *shadow_pagemap;
+    // Serialises paging in, so that racing faults map a page only once
+    struct mutex fault_lock;
     VECTOR_TYPE(struct mmap_range_local *) locals;
     struct resource *res;
     uintptr_t base;
@@ -27,6 +30,7 @@ struct mmap_range_local {
     off_t offset;
     int prot;
     int flags;
+    bool no_huge_pages;
 };
 
 void mmap_list_ranges(struct pagemap *pagemap);
@@ -38,5 +42,6 @@ bool mmap_range(struct pagemap *pagemap, uintptr_t virt, uintptr_t phys,
 void *mmap(struct pagemap *pagemap, uintptr_t addr, size_t length, int prot,
            int flags, struct resource *res, off_t offset);
 bool munmap(struct pagemap *pagemap, uintptr_t addr, size_t length);
+int madvise(struct pagemap *pagemap, uintptr_t addr, size_t length, int advice);
 
 #endif
@@ -1,28 +1,127 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdnoreturn.h>
 #include <limine.h>
+#include <lib/alloc.k.h>
 #include <lib/bitmap.k.h>
+#include <lib/event.k.h>
 #include <lib/libc.k.h>
 #include <lib/lock.k.h>
 #include <lib/misc.k.h>
 #include <lib/print.k.h>
+#include <lib/resource.k.h>
+#include <fs/devtmpfs.k.h>
 #include <mm/pmm.k.h>
 #include <mm/vmm.k.h>
+#include <sched/sched.k.h>
+#include <sys/cpu.k.h>
+#include <sys/idt.k.h>
+#include <dev/lapic.k.h>
+#include <printf/printf.h>
 
 volatile struct limine_memmap_request memmap_request = {
     .id = LIMINE_MEMMAP_REQUEST,
     .revision = 0
 };
 
+// Buddy allocator. Free memory is kept as naturally aligned blocks of 2^order
+// pages on one list per order, linked through the blocks themselves. Freeing
+// a block merges it with its buddy for as long as the buddy is free too.
+// Page counts that are not a power of two are handled by freeing the unused
+// tail of the block on allocation, and by splitting the range on free.
+
+#define PMM_MAX_ORDER 18
+
+struct free_block {
+    struct free_block *next;
+    struct free_block *prev;
+};
+
 static spinlock_t lock = SPINLOCK_INIT;
-static uint8_t *bitmap = NULL;
+static struct free_block *free_lists[PMM_MAX_ORDER + 1];
+// order + 1 for pages heading a free block, 0 for every other page
+static uint8_t *free_orders = NULL;
+// Owners beyond the first of pages shared copy-on-write, so that a freshly
+// allocated page needs no setup
+static uint32_t *page_refs = NULL;
 static uint64_t highest_page_index = 0;
-static uint64_t last_used_index = 0;
 static uint64_t usable_pages = 0;
 static uint64_t used_pages = 0;
 static uint64_t reserved_pages = 0;
 
+static inline struct free_block *page_to_block(uint64_t page) {
+    return (struct free_block *)(page * PAGE_SIZE + VMM_HIGHER_HALF);
+}
+
+static inline uint64_t block_to_page(struct free_block *block) {
+    return ((uintptr_t)block - VMM_HIGHER_HALF) / PAGE_SIZE;
+}
+
+static void free_list_push(uint64_t page, int order) {
+    struct free_block *block = page_to_block(page);
+
+    block->prev = NULL;
+    block->next = free_lists[order];
+    if (block->next != NULL) {
+        block->next->prev = block;
+    }
+    free_lists[order] = block;
+
+    free_orders[page] = order + 1;
+}
+
+static void free_list_remove(uint64_t page, int order) {
+    struct free_block *block = page_to_block(page);
+
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        free_lists[order] = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+
+    free_orders[page] = 0;
+}
+
+static void free_block(uint64_t page, int order) {
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy = page ^ ((uint64_t)1 << order);
+        if (buddy >= highest_page_index || free_orders[buddy] != order + 1) {
+            break;
+        }
+
+        free_list_remove(buddy, order);
+        page &= ~((uint64_t)1 << order);
+        order++;
+    }
+
+    free_list_push(page, order);
+}
+
+// Free an arbitrary range as the largest aligned blocks that fit in it
+static void free_range(uint64_t page, uint64_t count) {
+    while (count != 0) {
+        int order = page == 0 ? PMM_MAX_ORDER : __builtin_ctzll(page);
+        if (order > PMM_MAX_ORDER) {
+            order = PMM_MAX_ORDER;
+        }
+        while (((uint64_t)1 << order) > count) {
+            order--;
+        }
+
+        free_block(page, order);
+
+        page += (uint64_t)1 << order;
+        count -= (uint64_t)1 << order;
+    }
+}
+
+static uint8_t drain_ipi_vector;
+static void drain_ipi_handler(int vector, struct cpu_ctx *ctx);
+
 void pmm_init(void) {
     // TODO: Check if memmap and hhdm responses are null and panic
     struct limine_memmap_response *memmap = memmap_request.response;
@@ -53,14 +152,17 @@ void pmm_init(void) {
         }
     }
 
-    // Calculate the needed size for the bitmap in bytes and align it to page size.
+    // One byte of free block order and a reference count per page, aligned
+    // to page size.
     highest_page_index = highest_addr / PAGE_SIZE;
-    uint64_t bitmap_size = ALIGN_UP(highest_page_index / 8, PAGE_SIZE);
+    uint64_t free_orders_size = ALIGN_UP(highest_page_index, PAGE_SIZE);
+    uint64_t page_refs_size = ALIGN_UP(highest_page_index * sizeof(uint32_t), PAGE_SIZE);
 
     kernel_print("pmm: Highest address: %lx\n", highest_addr);
-    kernel_print("pmm: Bitmap size: %lu bytes\n", bitmap_size);
+    kernel_print("pmm: Free order map size: %lu bytes\n", free_orders_size);
+    kernel_print("pmm: Page reference map size: %lu bytes\n", page_refs_size);
 
-    // Find a hole for the bitmap in the memory map.
+    // Find a hole for both maps in the memory map.
     for (size_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry *entry = entries[i];
 
@@ -68,20 +170,22 @@ void pmm_init(void) {
             continue;
         }
 
-        if (entry->length >= bitmap_size) {
-            bitmap = (uint8_t *)(entry->base + hhdm->offset);
+        if (entry->length >= free_orders_size + page_refs_size) {
+            free_orders = (uint8_t *)(entry->base + hhdm->offset);
+            page_refs = (uint32_t *)(entry->base + free_orders_size + hhdm->offset);
 
-            // Initialise entire bitmap to 1 (non-free)
-            memset(bitmap, 0xff, bitmap_size);
+            // Nothing is free until the memory map says so
+            memset(free_orders, 0, free_orders_size);
+            memset(page_refs, 0, page_refs_size);
 
-            entry->length -= bitmap_size;
-            entry->base += bitmap_size;
+            entry->length -= free_orders_size + page_refs_size;
+            entry->base += free_orders_size + page_refs_size;
 
             break;
         }
     }
 
-    // Populate free bitmap entries according to the memory map.
+    // Hand the usable memory to the free lists.
     for (size_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry *entry = entries[i];
 
@@ -89,36 +193,132 @@ void pmm_init(void) {
             continue;
         }
 
-        for (uint64_t j = 0; j < entry->length; j += PAGE_SIZE) {
-            bitmap_reset(bitmap, (entry->base + j) / PAGE_SIZE);
-        }
+        free_range(entry->base / PAGE_SIZE, entry->length / PAGE_SIZE);
     }
 
     kernel_print("pmm: Usable memory: %luMiB\n", (usable_pages * 4096) / 1024 / 1024);
     kernel_print("pmm: Reserved memory: %luMiB\n", (reserved_pages * 4096) / 1024 / 1024);
+
+    drain_ipi_vector = idt_allocate_vector();
+    isr[drain_ipi_vector] = drain_ipi_handler;
 }
 
-static void *inner_alloc(size_t pages, uint64_t limit) {
-    size_t p = 0;
+// Single pages zeroed ahead of time by a nice 19 thread on each CPU, so that
+// pmm_alloc() callers on fault paths do not have to. They are kept in the
+// CPU's own cache, so taking one needs no lock, and the thread is woken up
+// to refill it once it runs low. It leaves the last 1/ZERO_POOL_MIN_FREE of
+// memory alone, and the pools are drained with the page caches when the
+// buddy allocator runs dry.
 
-    while (last_used_index < limit) {
-        if (!bitmap_test(bitmap, last_used_index++)) {
-            if (++p == pages) {
-                size_t page = last_used_index - pages;
-                for (size_t i = page; i < last_used_index; i++) {
-                    bitmap_set(bitmap, i);
-                }
-                return (void *)(page * PAGE_SIZE);
+#define ZERO_POOL_LOW 64
+#define ZERO_POOL_MIN_FREE 32
+
+static void *cpu_cache_alloc(void);
+
+static bool zero_pool_may_refill(void) {
+    uint64_t used = __atomic_load_n(&used_pages, __ATOMIC_RELAXED);
+    return used < usable_pages && usable_pages - used > usable_pages / ZERO_POOL_MIN_FREE;
+}
+
+static struct event *zero_pool_events = NULL;
+
+static void *zero_pool_take(void) {
+    bool old_state = interrupt_toggle(false);
+
+    struct cpu_local *cpu = this_cpu();
+    struct pmm_cpu_cache *cache = &cpu->pmm_cache;
+
+    void *ret = NULL;
+    if (cache->zeroed_length > 0) {
+        ret = cache->zeroed[--cache->zeroed_length];
+    }
+
+    bool wake = cache->zeroed_length <= ZERO_POOL_LOW && !cache->refilling && zero_pool_may_refill();
+    if (wake) {
+        cache->refilling = true;
+    }
+
+    interrupt_toggle(old_state);
+
+    if (wake) {
+        event_trigger(&zero_pool_events[cpu->cpu_number], false);
+    }
+
+    return ret;
+}
+
+// Pinned to `cpu`, so only interrupts can get at its cache under us
+static noreturn void zero_pool_thread(struct cpu_local *cpu) {
+    struct pmm_cpu_cache *cache = &cpu->pmm_cache;
+
+    for (;;) {
+        // Not pmm_alloc_nozero(), running out here is no reason to drain
+        // every CPU's cache
+        while (zero_pool_may_refill()) {
+            void *page = cpu_cache_alloc();
+            if (page == NULL) {
+                break;
+            }
+
+            memset(page + VMM_HIGHER_HALF, 0, PAGE_SIZE);
+
+            bool old_state = interrupt_toggle(false);
+            bool full = cache->zeroed_length == PMM_CPU_ZEROED_SIZE;
+            if (!full) {
+                cache->zeroed[cache->zeroed_length++] = page;
+            }
+            interrupt_toggle(old_state);
+
+            if (full) {
+                pmm_free(page, 1);
+                break;
             }
-        } else {
-            p = 0;
         }
+
+        bool old_state = interrupt_toggle(false);
+        cache->refilling = false;
+        interrupt_toggle(old_state);
+
+        // A wakeup in between stays pending
+        struct event *events[] = {&zero_pool_events[cpu->cpu_number]};
+        event_await(events, 1, true);
+    }
+}
+
+void pmm_zero_pool_init(void) {
+    struct event *events = alloc(cpu_count * sizeof(struct event));
+    if (events == NULL) {
+        return;
     }
 
-    return NULL;
+    // Nobody wakes up a thread that is still to be started
+    for (size_t i = 0; i < cpu_count; i++) {
+        cpus[i].pmm_cache.refilling = true;
+    }
+    __atomic_store_n(&zero_pool_events, events, __ATOMIC_RELEASE);
+
+    for (size_t i = 0; i < cpu_count; i++) {
+        struct thread *thread = sched_new_kernel_thread(zero_pool_thread, &cpus[i], false);
+        if (thread == NULL) {
+            continue;
+        }
+
+        cpu_mask_t mask = {0};
+        bitmap_set(&mask, i);
+        sched_set_affinity(thread, &mask);
+        sched_set_nice(thread, NICE_MAX);
+        sched_enqueue_thread(thread, false);
+    }
 }
 
 void *pmm_alloc(size_t pages) {
+    if (pages == 1 && __atomic_load_n(&zero_pool_events, __ATOMIC_ACQUIRE) != NULL) {
+        void *ret = zero_pool_take();
+        if (ret != NULL) {
+            return ret;
+        }
+    }
+
     void *ret = pmm_alloc_nozero(pages);
     if (ret != NULL) {
         memset(ret + VMM_HIGHER_HALF, 0, pages * PAGE_SIZE);
@@ -127,32 +327,292 @@ void *pmm_alloc(size_t pages) {
     return ret;
 }
 
-void *pmm_alloc_nozero(size_t pages) {
-    spinlock_acquire(&lock);
+// Pages up to the highest usable address, holes included
+size_t pmm_page_count(void) {
+    return highest_page_index;
+}
+
+// Pages outside of the map (such as framebuffers mapped privately) are not
+// the PMM's to free, they always count as shared so that writes copy them.
+void pmm_page_ref(void *addr) {
+    uint64_t page = (uintptr_t)addr / PAGE_SIZE;
+    if (page < highest_page_index) {
+        __atomic_add_fetch(&page_refs[page], 1, __ATOMIC_RELAXED);
+    }
+}
+
+bool pmm_page_shared(void *addr) {
+    uint64_t page = (uintptr_t)addr / PAGE_SIZE;
+    if (page >= highest_page_index) {
+        return true;
+    }
 
-    size_t last = last_used_index;
-    void *ret = inner_alloc(pages, highest_page_index);
+    return __atomic_load_n(&page_refs[page], __ATOMIC_ACQUIRE) != 0;
+}
 
-    if (ret == NULL) {
-        last_used_index = 0;
-        ret = inner_alloc(pages, last);
+// Drops one owner of the page, the last one frees it
+void pmm_page_unref(void *addr) {
+    uint64_t page = (uintptr_t)addr / PAGE_SIZE;
+    if (page >= highest_page_index) {
+        return;
+    }
+
+    uint32_t refs = __atomic_load_n(&page_refs[page], __ATOMIC_RELAXED);
+    do {
+        if (refs == 0) {
+            pmm_free(addr, 1);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&page_refs[page], &refs, refs - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+}
+
+static void *buddy_alloc(size_t pages) {
+    int order = 0;
+    while (((size_t)1 << order) < pages) {
+        order++;
+    }
+    if (order > PMM_MAX_ORDER) {
+        return NULL;
+    }
+
+    int found = order;
+    while (found <= PMM_MAX_ORDER && free_lists[found] == NULL) {
+        found++;
+    }
+    if (found > PMM_MAX_ORDER) {
+        return NULL;
+    }
+
+    uint64_t page = block_to_page(free_lists[found]);
+    free_list_remove(page, found);
+
+    // Put back the upper halves we do not need
+    while (found > order) {
+        found--;
+        free_list_push(page + ((uint64_t)1 << found), found);
+    }
+
+    // And the tail of the block past what was asked for
+    if (pages < ((size_t)1 << order)) {
+        free_range(page + pages, ((size_t)1 << order) - pages);
     }
 
-    // TODO: Check if ret is null and panic
     used_pages += pages;
+    return (void *)(page * PAGE_SIZE);
+}
+
+static void buddy_free(void *addr, size_t pages) {
+    free_range((uint64_t)addr / PAGE_SIZE, pages);
+    used_pages -= pages;
+}
+
+// Single pages go through a per-CPU stack once the other CPUs are up, which
+// is refilled and drained PMM_CPU_CACHE_BATCH pages at a time, so most page
+// faults and page table allocations do not touch the global lock. The top of
+// the stack holds the most recently freed, cache hot pages, and drains give
+// back the coldest ones from the bottom.
 
+// Gives every page in the cache and the zeroed pool back to the buddy
+// allocator. Called with interrupts off, on the CPU the cache belongs to.
+static void cpu_cache_drain(struct pmm_cpu_cache *cache) {
+    spinlock_acquire(&lock);
+    for (size_t i = 0; i < cache->length; i++) {
+        buddy_free(cache->pages[i], 1);
+    }
+    for (size_t i = 0; i < cache->zeroed_length; i++) {
+        buddy_free(cache->zeroed[i], 1);
+    }
     spinlock_release(&lock);
+
+    cache->length = 0;
+    cache->zeroed_length = 0;
+}
+
+// A drain asked for by another CPU, either through the IPI or noticed by the
+// next cache operation if the IPI could not get in
+static void cpu_cache_drain_poll(struct pmm_cpu_cache *cache) {
+    if (__atomic_load_n(&cache->drain, __ATOMIC_ACQUIRE)) {
+        cpu_cache_drain(cache);
+        __atomic_store_n(&cache->drain, false, __ATOMIC_RELEASE);
+    }
+}
+
+static void drain_ipi_handler(int vector, struct cpu_ctx *ctx) {
+    (void)vector;
+    (void)ctx;
+
+    cpu_cache_drain_poll(&this_cpu()->pmm_cache);
+
+    lapic_eoi();
+}
+
+#define DRAIN_WAIT_SPINS 1000000
+
+// Pages sitting in the caches of all CPUs, which also keep their buddies from
+// merging. Waits a while for the other CPUs to give theirs back, but not for
+// ever: one spinning with interrupts off gets to it on its next allocation.
+static void drain_all_caches(void) {
+    bool old_state = interrupt_toggle(false);
+
+    struct cpu_local *us = this_cpu();
+
+    for (size_t i = 0; i < cpu_count; i++) {
+        struct cpu_local *cpu = &cpus[i];
+        if (cpu != us) {
+            __atomic_store_n(&cpu->pmm_cache.drain, true, __ATOMIC_RELEASE);
+            lapic_send_ipi(cpu->lapic_id, drain_ipi_vector | (1 << 14));
+        }
+    }
+
+    cpu_cache_drain(&us->pmm_cache);
+
+    for (size_t i = 0; i < cpu_count; i++) {
+        struct cpu_local *cpu = &cpus[i];
+        for (size_t spins = 0; spins < DRAIN_WAIT_SPINS && __atomic_load_n(&cpu->pmm_cache.drain, __ATOMIC_ACQUIRE); spins++) {
+            // Another CPU may be draining at the same time, and waiting on us
+            cpu_cache_drain_poll(&us->pmm_cache);
+            asm volatile ("pause");
+        }
+    }
+
+    interrupt_toggle(old_state);
+}
+
+static void *cpu_cache_alloc(void) {
+    bool old_state = interrupt_toggle(false);
+
+    struct pmm_cpu_cache *cache = &this_cpu()->pmm_cache;
+    cpu_cache_drain_poll(cache);
+
+    if (cache->length == 0) {
+        spinlock_acquire(&lock);
+        while (cache->length < PMM_CPU_CACHE_BATCH) {
+            void *page = buddy_alloc(1);
+            if (page == NULL) {
+                break;
+            }
+            cache->pages[cache->length++] = page;
+        }
+        spinlock_release(&lock);
+    }
+
+    void *ret = NULL;
+    if (cache->length > 0) {
+        ret = cache->pages[--cache->length];
+    }
+
+    interrupt_toggle(old_state);
+    return ret;
+}
+
+static void cpu_cache_free(void *addr) {
+    bool old_state = interrupt_toggle(false);
+
+    struct pmm_cpu_cache *cache = &this_cpu()->pmm_cache;
+    cpu_cache_drain_poll(cache);
+
+    if (cache->length == PMM_CPU_CACHE_SIZE) {
+        spinlock_acquire(&lock);
+        for (size_t i = 0; i < PMM_CPU_CACHE_BATCH; i++) {
+            buddy_free(cache->pages[i], 1);
+        }
+        spinlock_release(&lock);
+
+        cache->length -= PMM_CPU_CACHE_BATCH;
+        memmove(cache->pages, &cache->pages[PMM_CPU_CACHE_BATCH], cache->length * sizeof(void *));
+    }
+
+    cache->pages[cache->length++] = addr;
+
+    interrupt_toggle(old_state);
+}
+
+void *pmm_alloc_nozero(size_t pages) {
+    if (pages == 0) {
+        return NULL;
+    }
+
+    void *ret = NULL;
+    if (pages == 1 && smp_started) {
+        ret = cpu_cache_alloc();
+    } else {
+        // The per-CPU caches take the lock from interrupt context too
+        bool old_state = spinlock_acquire_irqsave(&lock);
+        ret = buddy_alloc(pages);
+        spinlock_release_irqrestore(&lock, old_state);
+    }
+
+    if (ret == NULL && smp_started) {
+        drain_all_caches();
+
+        bool old_state = spinlock_acquire_irqsave(&lock);
+        ret = buddy_alloc(pages);
+        spinlock_release_irqrestore(&lock, old_state);
+    }
+
     return ret;
 }
 
 void pmm_free(void *addr, size_t pages) {
-    spinlock_acquire(&lock);
+    if (pages == 1 && smp_started) {
+        cpu_cache_free(addr);
+        return;
+    }
+
+    bool old_state = spinlock_acquire_irqsave(&lock);
+    buddy_free(addr, pages);
+    spinlock_release_irqrestore(&lock, old_state);
+}
 
-    size_t page = (uint64_t)addr / PAGE_SIZE;
-    for (size_t i = page; i < page + pages; i++) {
-        bitmap_reset(bitmap, i);
+// /dev/meminfo: page counts, and the free blocks of every order so that
+// fragmentation shows. Pages in the per-CPU caches count as used by the buddy
+// allocator, they are listed apart, read without stopping their CPUs.
+static ssize_t meminfo_read(struct resource *this, struct f_description *description, void *buf, off_t offset, size_t count) {
+    (void)this;
+    (void)description;
+
+    char text[512];
+    uint64_t blocks[PMM_MAX_ORDER + 1];
+
+    bool old_state = spinlock_acquire_irqsave(&lock);
+    uint64_t used = used_pages;
+    for (int order = 0; order <= PMM_MAX_ORDER; order++) {
+        blocks[order] = 0;
+        for (struct free_block *block = free_lists[order]; block != NULL; block = block->next) {
+            blocks[order]++;
+        }
     }
-    used_pages -= pages;
+    spinlock_release_irqrestore(&lock, old_state);
 
-    spinlock_release(&lock);
+    uint64_t cached = 0;
+    for (size_t i = 0; smp_started && i < cpu_count; i++) {
+        cached += __atomic_load_n(&cpus[i].pmm_cache.length, __ATOMIC_RELAXED);
+        cached += __atomic_load_n(&cpus[i].pmm_cache.zeroed_length, __ATOMIC_RELAXED);
+    }
+
+    size_t len = snprintf(text, sizeof(text), "usable %lu\nused %lu\ncached %lu\nreserved %lu\nfree_blocks",
+                          usable_pages, used, cached, reserved_pages);
+    for (int order = 0; order <= PMM_MAX_ORDER; order++) {
+        len += snprintf(text + len, sizeof(text) - len, " %lu", blocks[order]);
+    }
+    len += snprintf(text + len, sizeof(text) - len, "\n");
+
+    ssize_t ret = 0;
+    if ((size_t)offset < len) {
+        ret = len - offset < count ? len - offset : count;
+        memcpy(buf, text + offset, ret);
+    }
+
+    return ret;
+}
+
+void meminfo_init(void) {
+    struct resource *res = resource_create(sizeof(struct resource));
+    res->read = meminfo_read;
+    res->stat.st_size = 0;
+    res->stat.st_blocks = 0;
+    res->stat.st_blksize = 4096;
+    res->stat.st_rdev = resource_create_dev_id();
+    res->stat.st_mode = 0444 | S_IFCHR;
+    devtmpfs_add_device(res, "meminfo");
 }
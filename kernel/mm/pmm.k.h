@@ -1,14 +1,21 @@
 #ifndef _MM__PMM_K_H
 #define _MM__PMM_K_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <limine.h>
 
 extern volatile struct limine_memmap_request memmap_request;
 
 void pmm_init(void);
+void pmm_zero_pool_init(void);
 void *pmm_alloc(size_t pages);
 void *pmm_alloc_nozero(size_t pages);
 void pmm_free(void *addr, size_t pages);
+size_t pmm_page_count(void);
+void pmm_page_ref(void *addr);
+bool pmm_page_shared(void *addr);
+void pmm_page_unref(void *addr);
+void meminfo_init(void);
 
 #endif
@@ -2,21 +2,44 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <limine.h>
+#include <lib/alloc.k.h>
+#include <lib/errno.k.h>
 #include <lib/libc.k.h>
 #include <lib/lock.k.h>
 #include <lib/misc.k.h>
+#include <lib/panic.k.h>
+#include <lib/resource.k.h>
+#include <fs/devtmpfs.k.h>
 #include <mm/pmm.k.h>
 #include <mm/slab.k.h>
+#include <mm/vmalloc.k.h>
 #include <mm/vmm.k.h>
+#include <sys/cpu.k.h>
+#include <printf/printf.h>
+
+// A slab is a naturally aligned block of 1 to KMEM_SLAB_MAX_PAGES pages
+// starting with a struct slab, followed by the objects, with free objects
+// linked through their first word. Larger objects get larger slabs so that
+// little of each slab goes to waste. Every page of a slab maps back to it in
+// page_slabs, anything else passed to free() is a large allocation.
+//
+// Caches keep partially used slabs and fully free ones on separate lists,
+// and give free slabs beyond KMEM_EMPTY_SLABS back to the PMM. Once SMP is
+// up, every CPU also keeps a magazine of objects per cache, refilled from
+// and flushed to the slabs half a magazine at a time.
+
+#define KMEM_SLAB_MAX_PAGES 8
+#define KMEM_EMPTY_SLABS 2
+// Growing a buffer past this size moves it to vmalloc(), so realloc() never
+// needs a long run of physically contiguous pages
+#define SLAB_VREALLOC_MIN (64 * 1024)
 
 struct slab {
-    spinlock_t lock;
+    struct kmem_cache *cache;
+    struct slab *next;
+    struct slab *prev;
     void **first_free;
-    size_t ent_size;
-};
-
-struct slab_header {
-    struct slab *slab;
+    size_t inuse;
 };
 
 struct alloc_metadata {
@@ -24,87 +47,358 @@ struct alloc_metadata {
     size_t size;
 };
 
-static struct slab slabs[10];
+static struct kmem_cache size_caches[] = {
+    KMEM_CACHE_INIT("size-8", 8, 8, NULL),
+    KMEM_CACHE_INIT("size-16", 16, 16, NULL),
+    KMEM_CACHE_INIT("size-24", 24, 8, NULL),
+    KMEM_CACHE_INIT("size-32", 32, 32, NULL),
+    KMEM_CACHE_INIT("size-48", 48, 16, NULL),
+    KMEM_CACHE_INIT("size-64", 64, 64, NULL),
+    KMEM_CACHE_INIT("size-128", 128, 64, NULL),
+    KMEM_CACHE_INIT("size-256", 256, 64, NULL),
+    KMEM_CACHE_INIT("size-512", 512, 64, NULL),
+    KMEM_CACHE_INIT("size-1024", 1024, 64, NULL),
+    KMEM_CACHE_INIT("size-1536", 1536, 64, NULL),
+    KMEM_CACHE_INIT("size-2048", 2048, 64, NULL),
+    KMEM_CACHE_INIT("size-3072", 3072, 64, NULL),
+    KMEM_CACHE_INIT("size-4096", 4096, 64, NULL),
+};
+
+static spinlock_t caches_lock = SPINLOCK_INIT;
+static struct kmem_cache *caches = NULL;
+static struct kmem_cache **caches_tail = &caches;
+
+static struct slab **page_slabs = NULL;
 
-static inline struct slab *slab_for(size_t size) {
-    for (size_t i = 0; i < SIZEOF_ARRAY(slabs); i++) {
-        struct slab *slab = &slabs[i];
-        if (slab->ent_size >= size) {
-            return slab;
+static inline struct kmem_cache *slab_for(size_t size) {
+    for (size_t i = 0; i < SIZEOF_ARRAY(size_caches); i++) {
+        struct kmem_cache *cache = &size_caches[i];
+        if (cache->size >= size) {
+            return cache;
         }
     }
     return NULL;
 }
 
-static void create_slab(struct slab *slab, size_t ent_size) {
-    slab->lock = (spinlock_t)SPINLOCK_INIT;
-    slab->first_free = pmm_alloc_nozero(1) + VMM_HIGHER_HALF;
-    slab->ent_size = ent_size;
+static inline struct slab *slab_of(void *addr) {
+    return page_slabs[((uintptr_t)addr - VMM_HIGHER_HALF) / PAGE_SIZE];
+}
 
-    size_t header_offset = ALIGN_UP(sizeof(struct slab_header), ent_size);
-    size_t available_size = PAGE_SIZE - header_offset;
+static inline size_t cache_align(struct kmem_cache *cache) {
+    return cache->align != 0 ? cache->align : sizeof(void *);
+}
 
-    struct slab_header *slab_ptr = (struct slab_header *)slab->first_free;
-    slab_ptr->slab = slab;
-    slab->first_free = (void **)((void *)slab->first_free + header_offset);
+static inline size_t cache_stride(struct kmem_cache *cache) {
+    return ALIGN_UP(MAX(cache->size, sizeof(void *)), cache_align(cache));
+}
 
-    void **arr = (void **)slab->first_free;
-    size_t max = available_size / ent_size - 1;
-    size_t fact = ent_size / sizeof(void *);
+static inline size_t slab_header_size(struct kmem_cache *cache) {
+    return ALIGN_UP(sizeof(struct slab), cache_align(cache));
+}
 
-    for (size_t i = 0; i < max; i++) {
-        arr[i * fact] = &arr[(i + 1) * fact];
+// Pick the smallest slab that wastes at most an eighth of itself, or failing
+// that the largest one
+static bool cache_layout(struct kmem_cache *cache) {
+    size_t stride = cache_stride(cache);
+
+    for (size_t pages = 1; pages <= KMEM_SLAB_MAX_PAGES; pages *= 2) {
+        size_t slab_size = pages * PAGE_SIZE;
+        size_t count = (slab_size - slab_header_size(cache)) / stride;
+        if (count == 0) {
+            continue;
+        }
+
+        cache->slab_pages = pages;
+        cache->slab_objects = count;
+        if (slab_size - count * stride <= slab_size / 8) {
+            break;
+        }
     }
-    arr[max * fact] = NULL;
+
+    return cache->slab_objects != 0;
 }
 
-static void *alloc_from_slab(struct slab *slab) {
-    spinlock_acquire(&slab->lock);
+static void cache_register(struct kmem_cache *cache) {
+    if (cache->registered) {
+        return;
+    }
 
-    if (slab->first_free == NULL) {
-        create_slab(slab, slab->ent_size);
+    spinlock_acquire(&caches_lock);
+    cache->next = NULL;
+    *caches_tail = cache;
+    caches_tail = &cache->next;
+    spinlock_release(&caches_lock);
+
+    cache->registered = true;
+}
+
+static void slab_list_push(struct slab **list, struct slab *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (slab->next != NULL) {
+        slab->next->prev = slab;
+    }
+    *list = slab;
+}
+
+static void slab_list_remove(struct slab **list, struct slab *slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+// Called with the cache lock held
+static bool create_slab(struct kmem_cache *cache) {
+    if (cache->slab_objects == 0 && !cache_layout(cache)) {
+        return false;
+    }
+
+    void *phys = pmm_alloc_nozero(cache->slab_pages);
+    if (phys == NULL) {
+        return false;
+    }
+
+    cache_register(cache);
+
+    struct slab *slab = phys + VMM_HIGHER_HALF;
+    slab->cache = cache;
+    slab->first_free = NULL;
+    slab->inuse = 0;
+
+    size_t stride = cache_stride(cache);
+    void *objs = (void *)slab + slab_header_size(cache);
+    for (size_t i = cache->slab_objects; i > 0; i--) {
+        void **obj = objs + (i - 1) * stride;
+        *obj = slab->first_free;
+        slab->first_free = obj;
     }
 
-    void **old_free = slab->first_free;
-    slab->first_free = *old_free;
-    memset(old_free, 0, slab->ent_size);
+    for (size_t i = 0; i < cache->slab_pages; i++) {
+        page_slabs[(uintptr_t)phys / PAGE_SIZE + i] = slab;
+    }
 
-    spinlock_release(&slab->lock);
-    return old_free;
+    slab_list_push(&cache->empty, slab);
+    cache->empty_slabs++;
+    cache->slabs++;
+    cache->objects += cache->slab_objects;
+    cache->free_objects += cache->slab_objects;
+    return true;
 }
 
-static void free_in_slab(struct slab *slab, void *addr) {
-    spinlock_acquire(&slab->lock);
+// Called with the cache lock held
+static void destroy_slab(struct kmem_cache *cache, struct slab *slab) {
+    slab_list_remove(&cache->empty, slab);
+    cache->empty_slabs--;
+    cache->slabs--;
+    cache->objects -= cache->slab_objects;
+    cache->free_objects -= cache->slab_objects;
+
+    void *phys = (void *)slab - VMM_HIGHER_HALF;
+    for (size_t i = 0; i < cache->slab_pages; i++) {
+        page_slabs[(uintptr_t)phys / PAGE_SIZE + i] = NULL;
+    }
 
-    if (addr == NULL) {
-        goto cleanup;
+    pmm_free(phys, cache->slab_pages);
+}
+
+// Called with the cache lock held
+static void *take_free(struct kmem_cache *cache) {
+    struct slab *slab = cache->partial;
+    if (slab == NULL) {
+        if (cache->empty == NULL && !create_slab(cache)) {
+            return NULL;
+        }
+
+        slab = cache->empty;
+        slab_list_remove(&cache->empty, slab);
+        cache->empty_slabs--;
+        slab_list_push(&cache->partial, slab);
     }
 
-    void **new_head = addr;
+    void **obj = slab->first_free;
+    slab->first_free = *obj;
+    slab->inuse++;
+    cache->free_objects--;
+
+    // Full slabs are on no list, freeing into them puts them back
+    if (slab->first_free == NULL) {
+        slab_list_remove(&cache->partial, slab);
+    }
+
+    return obj;
+}
+
+// Called with the cache lock held
+static void put_free(struct kmem_cache *cache, void *obj) {
+    struct slab *slab = slab_of(obj);
+
+    if (slab->first_free == NULL) {
+        slab_list_push(&cache->partial, slab);
+    }
+
+    void **new_head = obj;
     *new_head = slab->first_free;
     slab->first_free = new_head;
+    slab->inuse--;
+    cache->free_objects++;
+
+    if (slab->inuse == 0) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->empty, slab);
+        cache->empty_slabs++;
+
+        // Keep a few around so a cache going back and forth around a slab
+        // boundary does not keep hitting the PMM
+        if (cache->empty_slabs > KMEM_EMPTY_SLABS) {
+            destroy_slab(cache, cache->empty);
+        }
+    }
+}
+
+// Magazines are only set up once we know how many CPUs there are. Allocating
+// them can come back here for the same cache, which then goes without.
+static struct kmem_magazine *cache_magazines(struct kmem_cache *cache) {
+    struct kmem_magazine *magazines = __atomic_load_n(&cache->magazines, __ATOMIC_ACQUIRE);
+    if (magazines != NULL || !smp_started) {
+        return magazines;
+    }
+
+    if (!CAS(&cache->creating_magazines, false, true)) {
+        return NULL;
+    }
+
+    magazines = alloc(cpu_count * sizeof(struct kmem_magazine));
+    if (magazines == NULL) {
+        __atomic_store_n(&cache->creating_magazines, false, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    __atomic_store_n(&cache->magazines, magazines, __ATOMIC_RELEASE);
+    return magazines;
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *obj)) {
+    struct kmem_cache layout = {.size = size, .align = align};
+    if (size == 0 || !cache_layout(&layout)) {
+        errno = EINVAL;
+        return NULL;
+    }
 
-cleanup:
-    spinlock_release(&slab->lock);
+    struct kmem_cache *cache = ALLOC(struct kmem_cache);
+    if (cache == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    *cache = (struct kmem_cache)KMEM_CACHE_INIT(name, size, align, ctor);
+    return cache;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+    void *obj = NULL;
+
+    struct kmem_magazine *magazines = cache_magazines(cache);
+    if (magazines != NULL) {
+        bool old_state = interrupt_toggle(false);
+        struct kmem_magazine *magazine = &magazines[this_cpu()->cpu_number];
+
+        if (magazine->rounds == 0) {
+            spinlock_acquire(&cache->lock);
+            while (magazine->rounds < KMEM_MAGAZINE_SIZE / 2) {
+                void *round = take_free(cache);
+                if (round == NULL) {
+                    break;
+                }
+                magazine->objs[magazine->rounds++] = round;
+            }
+            spinlock_release(&cache->lock);
+        }
+
+        if (magazine->rounds > 0) {
+            obj = magazine->objs[--magazine->rounds];
+            magazine->allocs++;
+        }
+
+        interrupt_toggle(old_state);
+    } else {
+        spinlock_acquire(&cache->lock);
+        obj = take_free(cache);
+        if (obj != NULL) {
+            cache->allocs++;
+        }
+        spinlock_release(&cache->lock);
+    }
+
+    if (obj == NULL) {
+        return NULL;
+    }
+
+    if (cache->ctor != NULL) {
+        cache->ctor(obj);
+    } else {
+        memset(obj, 0, cache->size);
+    }
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj) {
+    if (obj == NULL) {
+        return;
+    }
+
+    struct kmem_magazine *magazines = cache_magazines(cache);
+    if (magazines != NULL) {
+        bool old_state = interrupt_toggle(false);
+        struct kmem_magazine *magazine = &magazines[this_cpu()->cpu_number];
+
+        if (magazine->rounds == KMEM_MAGAZINE_SIZE) {
+            spinlock_acquire(&cache->lock);
+            for (size_t i = 0; i < KMEM_MAGAZINE_SIZE / 2; i++) {
+                put_free(cache, magazine->objs[i]);
+            }
+            spinlock_release(&cache->lock);
+
+            magazine->rounds -= KMEM_MAGAZINE_SIZE / 2;
+            memmove(magazine->objs, &magazine->objs[KMEM_MAGAZINE_SIZE / 2],
+                    magazine->rounds * sizeof(void *));
+        }
+
+        magazine->objs[magazine->rounds++] = obj;
+        magazine->frees++;
+
+        interrupt_toggle(old_state);
+        return;
+    }
+
+    spinlock_acquire(&cache->lock);
+    put_free(cache, obj);
+    cache->frees++;
+    spinlock_release(&cache->lock);
 }
 
 void slab_init(void) {
-    create_slab(&slabs[0], 8);
-    create_slab(&slabs[1], 16);
-    create_slab(&slabs[2], 24);
-    create_slab(&slabs[3], 32);
-    create_slab(&slabs[4], 48);
-    create_slab(&slabs[5], 64);
-    create_slab(&slabs[6], 128);
-    create_slab(&slabs[7], 256);
-    create_slab(&slabs[8], 512);
-    create_slab(&slabs[9], 1024);
+    size_t table_size = pmm_page_count() * sizeof(struct slab *);
+    void *table = pmm_alloc(DIV_ROUNDUP(table_size, PAGE_SIZE));
+    if (table == NULL) {
+        panic(NULL, true, "slab: No memory for the page to slab table (%lu bytes)", table_size);
+    }
+    page_slabs = table + VMM_HIGHER_HALF;
+
+    // Have the general purpose caches listed first
+    for (size_t i = 0; i < SIZEOF_ARRAY(size_caches); i++) {
+        cache_register(&size_caches[i]);
+    }
 }
 
 void *slab_alloc(size_t size) {
-    struct slab *slab = slab_for(size);
-    if (slab != NULL) {
-        return alloc_from_slab(slab);
+    struct kmem_cache *cache = slab_for(size);
+    if (cache != NULL) {
+        return kmem_cache_alloc(cache);
     }
 
     size_t page_count = DIV_ROUNDUP(size, PAGE_SIZE);
@@ -127,7 +421,25 @@ void *slab_realloc(void *addr, size_t new_size) {
         return slab_alloc(new_size);
     }
 
-    if (((uintptr_t)addr & 0xfff) == 0) {
+    if (is_vmalloc_addr(addr)) {
+        return vrealloc(addr, new_size);
+    }
+
+    struct slab *slab = slab_of(addr);
+
+    size_t old_size = slab != NULL ? slab->cache->size : ((struct alloc_metadata *)(addr - PAGE_SIZE))->size;
+    if (new_size >= SLAB_VREALLOC_MIN && new_size > old_size && vmm_initialised) {
+        void *new_addr = vmalloc(new_size);
+        if (new_addr == NULL) {
+            return NULL;
+        }
+
+        memcpy(new_addr, addr, old_size);
+        slab_free(addr);
+        return new_addr;
+    }
+
+    if (slab == NULL) {
         struct alloc_metadata *metadata = (struct alloc_metadata *)(addr - PAGE_SIZE);
         if (DIV_ROUNDUP(metadata->size, PAGE_SIZE) == DIV_ROUNDUP(new_size, PAGE_SIZE)) {
             metadata->size = new_size;
@@ -149,17 +461,16 @@ void *slab_realloc(void *addr, size_t new_size) {
         return new_addr;
     }
 
-    struct slab_header *slab_header = (struct slab_header *)((uintptr_t)addr & ~0xfff);
-    struct slab *slab = slab_header->slab;
+    struct kmem_cache *cache = slab->cache;
 
-    if (new_size > slab->ent_size) {
+    if (new_size > cache->size) {
         void *new_addr = slab_alloc(new_size);
         if (new_addr == NULL) {
             return NULL;
         }
 
-        memcpy(new_addr, addr, slab->ent_size);
-        free_in_slab(slab, addr);
+        memcpy(new_addr, addr, cache->size);
+        kmem_cache_free(cache, addr);
         return new_addr;
     }
 
@@ -171,12 +482,86 @@ void slab_free(void *addr) {
         return;
     }
 
-    if (((uintptr_t)addr & 0xfff) == 0) {
+    if (is_vmalloc_addr(addr)) {
+        vfree(addr);
+        return;
+    }
+
+    struct slab *slab = slab_of(addr);
+
+    if (slab == NULL) {
         struct alloc_metadata *metadata = (struct alloc_metadata *)(addr - PAGE_SIZE);
         pmm_free((void *)metadata - VMM_HIGHER_HALF, metadata->pages + 1);
         return;
     }
 
-    struct slab_header *slab_header = (struct slab_header *)((uintptr_t)addr & ~0xfff);
-    free_in_slab(slab_header->slab, addr);
+    kmem_cache_free(slab->cache, addr);
+}
+
+// /dev/slabinfo: one line per cache, with the pages per slab. Objects sitting
+// in magazines count as free, the magazine counters are read without stopping
+// their CPUs.
+static ssize_t slabinfo_read(struct resource *this, struct f_description *description, void *buf, off_t offset, size_t count) {
+    (void)this;
+    (void)description;
+
+    size_t line_size = 128;
+
+    spinlock_acquire(&caches_lock);
+
+    size_t cache_count = 0;
+    for (struct kmem_cache *cache = caches; cache != NULL; cache = cache->next) {
+        cache_count++;
+    }
+
+    size_t cap = (cache_count + 1) * line_size;
+    char *text = alloc(cap);
+    if (text == NULL) {
+        spinlock_release(&caches_lock);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t len = snprintf(text, cap, "%-24s %8s %10s %10s %8s %6s %14s %14s\n",
+                          "name", "objsize", "active", "total", "slabs", "pages", "allocs", "frees");
+
+    for (struct kmem_cache *cache = caches; cache != NULL; cache = cache->next) {
+        size_t cached = 0;
+        uint64_t allocs = cache->allocs;
+        uint64_t frees = cache->frees;
+
+        struct kmem_magazine *magazines = __atomic_load_n(&cache->magazines, __ATOMIC_ACQUIRE);
+        for (size_t i = 0; magazines != NULL && i < cpu_count; i++) {
+            cached += magazines[i].rounds;
+            allocs += magazines[i].allocs;
+            frees += magazines[i].frees;
+        }
+
+        size_t active = cache->objects - cache->free_objects - cached;
+        len += snprintf(text + len, cap - len, "%-24s %8lu %10lu %10lu %8lu %6lu %14lu %14lu\n",
+                        cache->name, cache->size, active, cache->objects, cache->slabs,
+                        cache->slab_pages, allocs, frees);
+    }
+
+    spinlock_release(&caches_lock);
+
+    ssize_t ret = 0;
+    if ((size_t)offset < len) {
+        ret = len - offset < count ? len - offset : count;
+        memcpy(buf, text + offset, ret);
+    }
+
+    free(text);
+    return ret;
+}
+
+void slabinfo_init(void) {
+    struct resource *res = resource_create(sizeof(struct resource));
+    res->read = slabinfo_read;
+    res->stat.st_size = 0;
+    res->stat.st_blocks = 0;
+    res->stat.st_blksize = 4096;
+    res->stat.st_rdev = resource_create_dev_id();
+    res->stat.st_mode = 0444 | S_IFCHR;
+    devtmpfs_add_device(res, "slabinfo");
 }
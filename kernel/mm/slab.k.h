@@ -1,9 +1,58 @@
 #ifndef _MM__SLAB_K_H
 #define _MM__SLAB_K_H
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <lib/lock.k.h>
+
+#define KMEM_MAGAZINE_SIZE 16
+
+// Objects a CPU keeps for itself, taken and returned without the cache lock
+struct slab;
+
+struct kmem_magazine {
+    size_t rounds;
+    void *objs[KMEM_MAGAZINE_SIZE];
+    uint64_t allocs;
+    uint64_t frees;
+};
+
+// A cache of equally sized objects. Objects are zeroed on allocation, or
+// handed to the constructor instead if the cache has one. Caches can be
+// defined statically with KMEM_CACHE_INIT, and set themselves up on first use.
+struct kmem_cache {
+    const char *name;
+    size_t size;
+    size_t align;
+    void (*ctor)(void *obj);
+    spinlock_t lock;
+    size_t slab_pages;
+    size_t slab_objects;
+    struct slab *partial;
+    struct slab *empty;
+    size_t empty_slabs;
+    bool registered;
+    bool creating_magazines;
+    struct kmem_magazine *magazines;
+    struct kmem_cache *next;
+    size_t slabs;
+    size_t objects;
+    size_t free_objects;
+    uint64_t allocs;
+    uint64_t frees;
+};
+
+#define KMEM_CACHE_INIT(NAME, SIZE, ALIGN, CTOR) { \
+    .name = (NAME), .size = (SIZE), .align = (ALIGN), .ctor = (CTOR), .lock = SPINLOCK_INIT \
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *obj));
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
 
 void slab_init(void);
+void slabinfo_init(void);
 void *slab_alloc(size_t size);
 void *slab_realloc(void *addr, size_t size);
 void slab_free(void *addr);
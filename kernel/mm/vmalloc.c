@@ -0,0 +1,333 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <lib/alloc.k.h>
+#include <lib/lock.k.h>
+#include <lib/misc.k.h>
+#include <lib/panic.k.h>
+#include <mm/pmm.k.h>
+#include <mm/vmalloc.k.h>
+#include <mm/vmm.k.h>
+
+// Areas are kept sorted by address, each one followed by an unmapped guard
+// page. A new area goes into the first gap with room for twice its size, so
+// that vrealloc() can usually grow it in place by mapping more pages at its
+// end. When it cannot, the area moves to a bigger gap by moving its page
+// table entries; the data itself is never copied.
+//
+// Only this file maps pages in the vmalloc range, so the page tables are
+// walked under the vmalloc lock rather than the kernel pagemap lock.
+
+#define VMALLOC_GUARD_PAGES 1
+
+struct vmalloc_area {
+    uintptr_t base;
+    size_t pages;
+    struct vmalloc_area *next;
+};
+
+static spinlock_t lock = SPINLOCK_INIT;
+static struct vmalloc_area *areas = NULL;
+
+static inline uintptr_t area_end(struct vmalloc_area *area) {
+    return area->base + (area->pages + VMALLOC_GUARD_PAGES) * PAGE_SIZE;
+}
+
+static inline uintptr_t area_limit(struct vmalloc_area *area) {
+    return area->next != NULL ? area->next->base : VMALLOC_BASE + VMALLOC_SIZE;
+}
+
+// Returns the base of the first gap with room for the given number of pages,
+// and the area to link the new one after (NULL for the head of the list).
+static uintptr_t find_gap(size_t pages, struct vmalloc_area **prev) {
+    uintptr_t base = VMALLOC_BASE;
+    *prev = NULL;
+
+    for (struct vmalloc_area *area = areas; ; area = area->next) {
+        uintptr_t limit = area != NULL ? area->base : VMALLOC_BASE + VMALLOC_SIZE;
+        if (limit - base >= (pages + VMALLOC_GUARD_PAGES) * PAGE_SIZE) {
+            return base;
+        }
+
+        if (area == NULL) {
+            return 0;
+        }
+
+        base = area_end(area);
+        *prev = area;
+    }
+}
+
+static uintptr_t find_room(size_t pages, struct vmalloc_area **prev) {
+    uintptr_t base = find_gap(pages * 2, prev);
+    if (base == 0) {
+        base = find_gap(pages, prev);
+    }
+    return base;
+}
+
+static void link_area(struct vmalloc_area *area, struct vmalloc_area *prev) {
+    if (prev == NULL) {
+        area->next = areas;
+        areas = area;
+    } else {
+        area->next = prev->next;
+        prev->next = area;
+    }
+}
+
+static struct vmalloc_area *unlink_area(uintptr_t base) {
+    for (struct vmalloc_area **link = &areas; *link != NULL; link = &(*link)->next) {
+        struct vmalloc_area *area = *link;
+        if (area->base == base) {
+            *link = area->next;
+            return area;
+        }
+    }
+
+    return NULL;
+}
+
+static struct vmalloc_area *find_area(uintptr_t base) {
+    for (struct vmalloc_area *area = areas; area != NULL; area = area->next) {
+        if (area->base == base) {
+            return area;
+        }
+    }
+
+    return NULL;
+}
+
+// Clears the page table entries and links the pages onto *freed, threaded
+// through the pages themselves. They go back to the PMM in flush_and_free(),
+// after the lock is dropped.
+static void unmap_pages(uintptr_t virt, size_t count, void **freed) {
+    for (size_t i = 0; i < count; i++) {
+        uint64_t *pte = vmm_virt2pte(vmm_kernel_pagemap, virt + i * PAGE_SIZE, false);
+        void *page = (void *)PTE_GET_ADDR(*pte);
+        *pte = 0;
+
+        *(void **)(page + VMM_HIGHER_HALF) = *freed;
+        *freed = page;
+    }
+}
+
+// Called without the lock held, as other CPUs waiting for it could hold up
+// the shootdown. Areas whose entries were cleared stay linked until this is
+// done, so their addresses are not handed out while still in some TLB.
+static void flush_and_free(void *freed) {
+    vmm_tlb_shootdown(vmm_kernel_pagemap);
+
+    while (freed != NULL) {
+        void *next = *(void **)(freed + VMM_HIGHER_HALF);
+        pmm_free(freed, 1);
+        freed = next;
+    }
+}
+
+// Nothing was mapped at these addresses since the last shootdown, so there is
+// nothing to shoot down
+static bool map_pages(uintptr_t virt, size_t count, void **freed) {
+    for (size_t i = 0; i < count; i++) {
+        uint64_t *pte = vmm_virt2pte(vmm_kernel_pagemap, virt + i * PAGE_SIZE, true);
+        void *page = pte != NULL ? pmm_alloc(1) : NULL;
+        if (page == NULL) {
+            unmap_pages(virt, i, freed);
+            return false;
+        }
+
+        *pte = (uint64_t)page | PTE_PRESENT | PTE_WRITABLE | PTE_NX;
+    }
+
+    return true;
+}
+
+static bool reserve_tables(uintptr_t virt, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (vmm_virt2pte(vmm_kernel_pagemap, virt + i * PAGE_SIZE, true) == NULL) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static inline size_t size_to_pages(size_t size) {
+    if (size > VMALLOC_SIZE / 2) {
+        return 0;
+    }
+
+    return size == 0 ? 1 : DIV_ROUNDUP(size, PAGE_SIZE);
+}
+
+void *vmalloc(size_t size) {
+    size_t pages = size_to_pages(size);
+    if (pages == 0) {
+        return NULL;
+    }
+
+    struct vmalloc_area *area = ALLOC(struct vmalloc_area);
+    if (area == NULL) {
+        return NULL;
+    }
+
+    spinlock_acquire(&lock);
+
+    struct vmalloc_area *prev = NULL;
+    uintptr_t base = find_room(pages, &prev);
+    if (base == 0) {
+        spinlock_release(&lock);
+        free(area);
+        return NULL;
+    }
+
+    area->base = base;
+    area->pages = pages;
+    link_area(area, prev);
+
+    void *freed = NULL;
+    bool ok = map_pages(base, pages, &freed);
+
+    spinlock_release(&lock);
+
+    if (ok) {
+        return (void *)base;
+    }
+
+    flush_and_free(freed);
+
+    spinlock_acquire(&lock);
+    unlink_area(base);
+    spinlock_release(&lock);
+
+    free(area);
+    return NULL;
+}
+
+void *vrealloc(void *addr, size_t size) {
+    if (addr == NULL) {
+        return vmalloc(size);
+    }
+
+    size_t new_pages = size_to_pages(size);
+    if (new_pages == 0) {
+        return NULL;
+    }
+
+    // For the new addresses, should the area have to move
+    struct vmalloc_area *moved = ALLOC(struct vmalloc_area);
+    if (moved == NULL) {
+        return NULL;
+    }
+
+    void *ret = NULL;
+    void *freed = NULL;
+    bool flush = false;
+
+    // Applied once the shootdown is done: either an area to unlink, or the
+    // size the area ends up with
+    struct vmalloc_area *stale = NULL;
+    size_t final_pages = 0;
+
+    spinlock_acquire(&lock);
+
+    struct vmalloc_area *area = find_area((uintptr_t)addr);
+    if (area == NULL) {
+        panic(NULL, true, "vrealloc() of unknown address %p", addr);
+    }
+
+    if (new_pages <= area->pages) {
+        unmap_pages(area->base + new_pages * PAGE_SIZE, area->pages - new_pages, &freed);
+        flush = new_pages < area->pages;
+        final_pages = new_pages;
+        ret = addr;
+        goto cleanup;
+    }
+
+    size_t extra = new_pages - area->pages;
+
+    if (area->base + (new_pages + VMALLOC_GUARD_PAGES) * PAGE_SIZE <= area_limit(area)) {
+        size_t old_pages = area->pages;
+        area->pages = new_pages;
+        if (map_pages(area->base + old_pages * PAGE_SIZE, extra, &freed)) {
+            ret = addr;
+        } else {
+            flush = true;
+            final_pages = old_pages;
+        }
+        goto cleanup;
+    }
+
+    struct vmalloc_area *prev = NULL;
+    uintptr_t new_base = find_room(new_pages, &prev);
+    if (new_base == 0 || !reserve_tables(new_base, area->pages)) {
+        goto cleanup;
+    }
+
+    moved->base = new_base;
+    moved->pages = new_pages;
+    link_area(moved, prev);
+
+    flush = true;
+    stale = moved;
+    moved = NULL;
+
+    if (!map_pages(new_base + area->pages * PAGE_SIZE, extra, &freed)) {
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < area->pages; i++) {
+        uint64_t *old_pte = vmm_virt2pte(vmm_kernel_pagemap, area->base + i * PAGE_SIZE, false);
+        uint64_t *new_pte = vmm_virt2pte(vmm_kernel_pagemap, new_base + i * PAGE_SIZE, false);
+        *new_pte = *old_pte;
+        *old_pte = 0;
+    }
+
+    stale = area;
+    ret = (void *)new_base;
+
+cleanup:
+    spinlock_release(&lock);
+
+    if (flush) {
+        flush_and_free(freed);
+
+        spinlock_acquire(&lock);
+        if (stale != NULL) {
+            unlink_area(stale->base);
+        } else {
+            area->pages = final_pages;
+        }
+        spinlock_release(&lock);
+    }
+
+    free(stale);
+    free(moved);
+    return ret;
+}
+
+void vfree(void *addr) {
+    if (addr == NULL) {
+        return;
+    }
+
+    spinlock_acquire(&lock);
+
+    struct vmalloc_area *area = find_area((uintptr_t)addr);
+    if (area == NULL) {
+        panic(NULL, true, "vfree() of unknown address %p", addr);
+    }
+
+    void *freed = NULL;
+    unmap_pages(area->base, area->pages, &freed);
+
+    spinlock_release(&lock);
+
+    flush_and_free(freed);
+
+    spinlock_acquire(&lock);
+    unlink_area(area->base);
+    spinlock_release(&lock);
+
+    free(area);
+}
@@ -0,0 +1,23 @@
+#ifndef _MM__VMALLOC_K_H
+#define _MM__VMALLOC_K_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Kernel memory that is only virtually contiguous, backed by single pages
+// mapped into a range of the higher half the HHDM does not reach. It must not
+// be handed to devices, and virt - VMM_HIGHER_HALF is not its physical
+// address: use vmm_virt2phys() on the kernel pagemap instead.
+#define VMALLOC_BASE ((uintptr_t)0xffffc00000000000)
+#define VMALLOC_SIZE ((uintptr_t)0x8000000000)
+
+void *vmalloc(size_t size);
+void *vrealloc(void *addr, size_t size);
+void vfree(void *addr);
+
+static inline bool is_vmalloc_addr(const void *addr) {
+    return (uintptr_t)addr >= VMALLOC_BASE && (uintptr_t)addr < VMALLOC_BASE + VMALLOC_SIZE;
+}
+
+#endif
@@ -5,12 +5,14 @@
 #include <lib/alloc.k.h>
 #include <lib/errno.k.h>
 #include <lib/lock.k.h>
+#include <lib/mutex.k.h>
 #include <lib/misc.k.h>
 #include <lib/panic.k.h>
 #include <lib/resource.k.h>
 #include <lib/vector.k.h>
 #include <mm/pmm.k.h>
 #include <mm/mmap.k.h>
+#include <mm/vmalloc.k.h>
 #include <mm/vmm.k.h>
 #include <sys/idt.k.h>
 #include <dev/lapic.k.h>
@@ -51,6 +53,198 @@ static uint64_t *get_next_level(uint64_t *top_level, size_t idx, bool allocate)
     return next_level + VMM_HIGHER_HALF;
 }
 
+static inline bool is_large(uint64_t entry) {
+    return (entry & (PTE_PRESENT | PTE_LARGE)) == (PTE_PRESENT | PTE_LARGE);
+}
+
+// Bit 12 of a large page entry is the PAT bit, not part of the address
+static inline uintptr_t large_page_addr(uint64_t entry, size_t page_size) {
+    return PTE_GET_ADDR(entry) & ~(page_size - 1);
+}
+
+// Replaces a large page with a table that maps the same memory with pages of
+// the next size down
+static bool split_large_page(uint64_t *entry, size_t page_size) {
+    uint64_t *table = pmm_alloc_nozero(1);
+    if (table == NULL) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    size_t child_size = page_size / 512;
+    uintptr_t phys = large_page_addr(*entry, page_size);
+    uint64_t flags = PTE_GET_FLAGS(*entry);
+    if (child_size == PAGE_SIZE) {
+        flags &= ~PTE_LARGE;
+    }
+
+    uint64_t *children = (void *)table + VMM_HIGHER_HALF;
+    for (size_t i = 0; i < 512; i++) {
+        children[i] = (phys + i * child_size) | flags;
+    }
+
+    *entry = (uint64_t)table | PTE_PRESENT | PTE_WRITABLE | PTE_USER;
+    return true;
+}
+
+// Returns the PML3 or PML2 entry for a 1 GiB or 2 MiB page at virt
+static uint64_t *get_large_entry(struct pagemap *pagemap, uintptr_t virt, size_t page_size) {
+    size_t pml4_entry = (virt & (0x1ffull << 39)) >> 39;
+    size_t pml3_entry = (virt & (0x1ffull << 30)) >> 30;
+    size_t pml2_entry = (virt & (0x1ffull << 21)) >> 21;
+
+    uint64_t *pml3 = get_next_level(pagemap->top_level, pml4_entry, true);
+    if (pml3 == NULL) {
+        return NULL;
+    }
+    if (page_size == PAGE_SIZE_1G) {
+        return &pml3[pml3_entry];
+    }
+
+    if (is_large(pml3[pml3_entry]) && !split_large_page(&pml3[pml3_entry], PAGE_SIZE_1G)) {
+        return NULL;
+    }
+    uint64_t *pml2 = get_next_level(pml3, pml3_entry, true);
+    if (pml2 == NULL) {
+        return NULL;
+    }
+
+    return &pml2[pml2_entry];
+}
+
+// Returns the PML2 entry of the 2 MiB page mapped at virt, if there is one
+static uint64_t *get_mapped_large_entry(struct pagemap *pagemap, uintptr_t virt) {
+    size_t pml4_entry = (virt & (0x1ffull << 39)) >> 39;
+    size_t pml3_entry = (virt & (0x1ffull << 30)) >> 30;
+    size_t pml2_entry = (virt & (0x1ffull << 21)) >> 21;
+
+    uint64_t *pml3 = get_next_level(pagemap->top_level, pml4_entry, false);
+    if (pml3 == NULL || is_large(pml3[pml3_entry])) {
+        return NULL;
+    }
+    uint64_t *pml2 = get_next_level(pml3, pml3_entry, false);
+    if (pml2 == NULL || !is_large(pml2[pml2_entry])) {
+        return NULL;
+    }
+
+    return &pml2[pml2_entry];
+}
+
+static bool gigabyte_pages = false;
+
+#define MSR_MTRRCAP 0xfe
+#define MSR_MTRR_PHYSBASE(n) (0x200 + (n) * 2)
+#define MSR_MTRR_PHYSMASK(n) (0x201 + (n) * 2)
+#define MSR_MTRR_DEF_TYPE 0x2ff
+
+#define MTRR_MAX_VARIABLE 32
+
+struct mtrr_range {
+    uint64_t base;
+    uint64_t mask;
+};
+
+static struct mtrr_range mtrr_ranges[MTRR_MAX_VARIABLE];
+static size_t mtrr_range_count = 0;
+
+static void mtrr_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    if (!cpuid(1, 0, &eax, &ebx, &ecx, &edx) || (edx & CPUID_MTRR) == 0) {
+        return;
+    }
+
+    // With MTRRs disabled all of memory is uncacheable, which is one type
+    if ((rdmsr(MSR_MTRR_DEF_TYPE) & (1 << 11)) == 0) {
+        return;
+    }
+
+    size_t count = MIN(rdmsr(MSR_MTRRCAP) & 0xff, (uint64_t)MTRR_MAX_VARIABLE);
+    for (size_t i = 0; i < count; i++) {
+        uint64_t mask = rdmsr(MSR_MTRR_PHYSMASK(i));
+        if ((mask & (1 << 11)) == 0) {
+            continue;
+        }
+
+        mask &= ~(uint64_t)0xfff;
+        mtrr_ranges[mtrr_range_count].base = rdmsr(MSR_MTRR_PHYSBASE(i)) & mask;
+        mtrr_ranges[mtrr_range_count].mask = mask;
+        mtrr_range_count++;
+    }
+}
+
+static bool is_ram(uint64_t type) {
+    switch (type) {
+        case LIMINE_MEMMAP_USABLE:
+        case LIMINE_MEMMAP_ACPI_RECLAIMABLE:
+        case LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE:
+        case LIMINE_MEMMAP_KERNEL_AND_MODULES:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// A large page must not mix memory types, or the CPU's behaviour is
+// undefined. Only allow them over RAM from the memory map, never over the
+// low 2 MiB with its fixed range MTRRs and legacy holes, and never across
+// the edge of a variable range MTRR.
+static bool can_map_large(uintptr_t phys, size_t page_size) {
+    if (phys < PAGE_SIZE_2M) {
+        return false;
+    }
+
+    struct limine_memmap_response *memmap = memmap_request.response;
+    uintptr_t covered = phys;
+    for (size_t i = 0; i < memmap->entry_count && covered < phys + page_size; ) {
+        struct limine_memmap_entry *entry = memmap->entries[i];
+        if (is_ram(entry->type) && entry->base <= covered && covered < entry->base + entry->length) {
+            covered = entry->base + entry->length;
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+    if (covered < phys + page_size) {
+        return false;
+    }
+
+    // An MTRR whose mask has no bits inside the page matches all of it or
+    // none of it; otherwise it must not match any of it
+    for (size_t i = 0; i < mtrr_range_count; i++) {
+        struct mtrr_range *range = &mtrr_ranges[i];
+        if ((range->mask & (page_size - 1)) != 0
+         && (phys & range->mask & ~(page_size - 1)) == (range->base & ~(page_size - 1))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Maps a physically contiguous range with the largest pages its alignment
+// and memory types allow
+static void map_linear(uintptr_t virt, uintptr_t phys, size_t length, uint64_t flags) {
+    uintptr_t end = virt + length;
+
+    while (virt < end) {
+        if (gigabyte_pages && ((virt | phys) & (PAGE_SIZE_1G - 1)) == 0 && end - virt >= PAGE_SIZE_1G
+         && can_map_large(phys, PAGE_SIZE_1G)) {
+            ASSERT(vmm_map_large_page(vmm_kernel_pagemap, virt, phys, flags, PAGE_SIZE_1G));
+            virt += PAGE_SIZE_1G;
+            phys += PAGE_SIZE_1G;
+        } else if (((virt | phys) & (PAGE_SIZE_2M - 1)) == 0 && end - virt >= PAGE_SIZE_2M
+                && can_map_large(phys, PAGE_SIZE_2M)) {
+            ASSERT(vmm_map_large_page(vmm_kernel_pagemap, virt, phys, flags, PAGE_SIZE_2M));
+            virt += PAGE_SIZE_2M;
+            phys += PAGE_SIZE_2M;
+        } else {
+            ASSERT(vmm_map_page(vmm_kernel_pagemap, virt, phys, flags));
+            virt += PAGE_SIZE;
+            phys += PAGE_SIZE;
+        }
+    }
+}
+
 static uint8_t tlb_shootdown_ipi_vector;
 static void tlb_shootdown_handler(int vector, struct cpu_ctx *ctx);
 
@@ -58,7 +252,7 @@ void vmm_init(void) {
     ASSERT(kaddr_request.response != NULL);
 
     vmm_kernel_pagemap = ALLOC(struct pagemap);
-    vmm_kernel_pagemap->lock = (spinlock_t)SPINLOCK_INIT;
+    vmm_kernel_pagemap->lock = (struct mutex)MUTEX_INIT;
     vmm_kernel_pagemap->top_level = pmm_alloc(1);
 
     ASSERT(vmm_kernel_pagemap->top_level != NULL);
@@ -68,6 +262,8 @@ void vmm_init(void) {
         ASSERT(get_next_level(vmm_kernel_pagemap->top_level, i, true) != NULL);
     }
 
+    ASSERT(VMM_HIGHER_HALF + pmm_page_count() * PAGE_SIZE <= VMALLOC_BASE);
+
     uintptr_t text_start = ALIGN_DOWN((uintptr_t)text_start_addr, PAGE_SIZE),
         rodata_start = ALIGN_DOWN((uintptr_t)rodata_start_addr, PAGE_SIZE),
         data_start = ALIGN_DOWN((uintptr_t)data_start_addr, PAGE_SIZE),
@@ -92,10 +288,12 @@ void vmm_init(void) {
         ASSERT(vmm_map_page(vmm_kernel_pagemap, data_addr, phys, PTE_PRESENT | PTE_WRITABLE | PTE_NX));
     }
 
-    for (uintptr_t addr = 0x1000; addr < 0x100000000; addr += PAGE_SIZE) {
-        ASSERT(vmm_map_page(vmm_kernel_pagemap, addr, addr, PTE_PRESENT | PTE_WRITABLE));
-        ASSERT(vmm_map_page(vmm_kernel_pagemap, addr + VMM_HIGHER_HALF, addr, PTE_PRESENT | PTE_WRITABLE | PTE_NX));
-    }
+    uint32_t eax, ebx, ecx, edx;
+    gigabyte_pages = cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx) && (edx & CPUID_PDPE1GB) != 0;
+    mtrr_init();
+
+    map_linear(0x1000, 0x1000, 0x100000000 - 0x1000, PTE_PRESENT | PTE_WRITABLE);
+    map_linear(VMM_HIGHER_HALF, 0, 0x100000000, PTE_PRESENT | PTE_WRITABLE | PTE_NX);
 
     struct limine_memmap_response *memmap = memmap_request.response;
     for (size_t i = 0; i < memmap->entry_count; i++) {
@@ -106,15 +304,12 @@ void vmm_init(void) {
         if (top <= 0x100000000) {
             continue;
         }
-
-        for (uintptr_t j = base; j < top; j += PAGE_SIZE) {
-            if (j < 0x100000000) {
-                continue;
-            }
-
-            ASSERT(vmm_map_page(vmm_kernel_pagemap, j, j, PTE_PRESENT | PTE_WRITABLE));
-            ASSERT(vmm_map_page(vmm_kernel_pagemap, j + VMM_HIGHER_HALF, j, PTE_PRESENT | PTE_WRITABLE | PTE_NX));
+        if (base < 0x100000000) {
+            base = 0x100000000;
         }
+
+        map_linear(base, base, top - base, PTE_PRESENT | PTE_WRITABLE);
+        map_linear(base + VMM_HIGHER_HALF, base, top - base, PTE_PRESENT | PTE_WRITABLE | PTE_NX);
     }
 
     tlb_shootdown_ipi_vector = idt_allocate_vector();
@@ -131,7 +326,7 @@ struct pagemap *vmm_new_pagemap(void) {
         goto cleanup;
     }
 
-    pagemap->lock = (spinlock_t)SPINLOCK_INIT;
+    pagemap->lock = (struct mutex)MUTEX_INIT;
     pagemap->top_level = pmm_alloc(1);
     if (pagemap->top_level == NULL) {
         errno = ENOMEM;
@@ -153,14 +348,102 @@ cleanup:
     return NULL;
 }
 
+// Shares the present pages of a private range copy-on-write with a new global
+// range for the child. On failure everything shared so far is taken back.
+static struct mmap_range_global *fork_private_range(struct pagemap *pagemap, struct pagemap *new_pagemap,
+                                                    struct mmap_range_local *local_range) {
+    struct mmap_range_global *global_range = local_range->global;
+
+    struct mmap_range_global *new_global_range = ALLOC(struct mmap_range_global);
+    if (new_global_range == NULL) {
+        return NULL;
+    }
+
+    new_global_range->fault_lock = (struct mutex)MUTEX_INIT;
+    new_global_range->shadow_pagemap = vmm_new_pagemap();
+    if (new_global_range->shadow_pagemap == NULL) {
+        free(new_global_range);
+        return NULL;
+    }
+
+    new_global_range->base = global_range->base;
+    new_global_range->length = global_range->length;
+    new_global_range->res = global_range->res;
+    new_global_range->offset = global_range->offset;
+
+    // Private pages are shared read-only, the first write on either side
+    // copies the page in mmap_handle_pf()
+    uintptr_t i;
+    for (i = local_range->base; i < local_range->base + local_range->length; i += PAGE_SIZE) {
+        uint64_t *old_pte = vmm_virt2pte(pagemap, i, false);
+        if (old_pte == NULL || (PTE_GET_FLAGS(*old_pte) & PTE_PRESENT) == 0) {
+            continue;
+        }
+
+        uint64_t *new_pte = vmm_virt2pte(new_pagemap, i, true);
+        if (new_pte == NULL) {
+            goto fail;
+        }
+
+        uint64_t *new_spte = vmm_virt2pte(new_global_range->shadow_pagemap, i, true);
+        if (new_spte == NULL) {
+            goto fail;
+        }
+
+        *old_pte = (*old_pte & ~PTE_WRITABLE) | PTE_COW;
+
+        uint64_t *old_spte = vmm_virt2pte(global_range->shadow_pagemap, i, false);
+        if (old_spte != NULL && (PTE_GET_FLAGS(*old_spte) & PTE_PRESENT) != 0) {
+            *old_spte = *old_pte;
+        }
+
+        pmm_page_ref((void *)PTE_GET_ADDR(*old_pte));
+        *new_pte = *old_pte;
+        *new_spte = *new_pte;
+    }
+
+    return new_global_range;
+
+fail:
+    // The child's page tables go away with its pagemap. A page the parent
+    // is the only owner of again can be written to directly.
+    for (uintptr_t j = local_range->base; j < i; j += PAGE_SIZE) {
+        uint64_t *new_spte = vmm_virt2pte(new_global_range->shadow_pagemap, j, false);
+        if (new_spte == NULL || (PTE_GET_FLAGS(*new_spte) & PTE_PRESENT) == 0) {
+            continue;
+        }
+
+        void *page = (void *)PTE_GET_ADDR(*new_spte);
+        pmm_page_unref(page);
+
+        if ((local_range->prot & PROT_WRITE) == 0 || pmm_page_shared(page)) {
+            continue;
+        }
+
+        uint64_t *old_pte = vmm_virt2pte(pagemap, j, false);
+        *old_pte = (*old_pte | PTE_WRITABLE) & ~PTE_COW;
+
+        uint64_t *old_spte = vmm_virt2pte(global_range->shadow_pagemap, j, false);
+        if (old_spte != NULL && (PTE_GET_FLAGS(*old_spte) & PTE_PRESENT) != 0) {
+            *old_spte = *old_pte;
+        }
+    }
+
+    vmm_destroy_pagemap(new_global_range->shadow_pagemap);
+    free(new_global_range);
+    return NULL;
+}
+
 struct pagemap *vmm_fork_pagemap(struct pagemap *pagemap) {
-    spinlock_acquire(&pagemap->lock);
+    mutex_acquire(&pagemap->lock);
 
     struct pagemap *new_pagemap = vmm_new_pagemap();
     if (new_pagemap == NULL) {
         goto cleanup;
     }
 
+    // A range only joins the new pagemap once it is complete, anything
+    // already in there is undone by vmm_destroy_pagemap()
     VECTOR_FOR_EACH(&pagemap->mmap_ranges, it,
         struct mmap_range_local *local_range = *it;
         struct mmap_range_global *global_range = local_range->global;
@@ -174,12 +457,7 @@ struct pagemap *vmm_fork_pagemap(struct pagemap *pagemap) {
         // NOTE: Not present in vinix, in case of weird VMM bugs keep this line in mind :^)
         new_local_range->pagemap = new_pagemap;
 
-        if (global_range->res != NULL) {
-            global_range->res->refcount++;
-        }
-
         if ((local_range->flags & MAP_SHARED) != 0) {
-            VECTOR_PUSH_BACK(&global_range->locals, new_local_range);
             for (uintptr_t i = local_range->base; i < local_range->base + local_range->length; i += PAGE_SIZE) {
                 uint64_t *old_pte = vmm_virt2pte(pagemap, i, false);
                 if (old_pte == NULL) {
@@ -188,94 +466,86 @@ struct pagemap *vmm_fork_pagemap(struct pagemap *pagemap) {
 
                 uint64_t *new_pte = vmm_virt2pte(new_pagemap, i, true);
                 if (new_pte == NULL) {
+                    free(new_local_range);
                     goto cleanup;
                 }
                 *new_pte = *old_pte;
             }
+            VECTOR_PUSH_BACK(&global_range->locals, new_local_range);
         } else {
-            struct mmap_range_global *new_global_range = ALLOC(struct mmap_range_global);
+            struct mmap_range_global *new_global_range = fork_private_range(pagemap, new_pagemap, local_range);
             if (new_global_range == NULL) {
+                free(new_local_range);
                 goto cleanup;
             }
 
-            new_global_range->shadow_pagemap = vmm_new_pagemap();
-            if (new_global_range->shadow_pagemap == NULL) {
-                goto cleanup;
-            }
-
-            new_global_range->base = global_range->base;
-            new_global_range->length = global_range->length;
-            new_global_range->res = global_range->res;
-            new_global_range->offset = global_range->offset;
-
+            new_local_range->global = new_global_range;
             VECTOR_PUSH_BACK(&new_global_range->locals, new_local_range);
+        }
 
-            if ((local_range->flags & MAP_ANONYMOUS) != 0) {
-                for (uintptr_t i = local_range->base; i < local_range->base + local_range->length; i += PAGE_SIZE) {
-                    uint64_t *old_pte = vmm_virt2pte(pagemap, i, false);
-                    if (old_pte == NULL || (PTE_GET_FLAGS(*old_pte) & PTE_PRESENT) == 0) {
-                        continue;
-                    }
-
-                    uint64_t *new_pte = vmm_virt2pte(new_pagemap, i, true);
-                    if (new_pte == NULL) {
-                        goto cleanup;
-                    }
-
-                    uint64_t *new_spte = vmm_virt2pte(new_global_range->shadow_pagemap, i, true);
-                    if (new_spte == NULL) {
-                        goto cleanup;
-                    }
-
-                    void *old_page = (void *)PTE_GET_ADDR(*old_pte);
-                    void *page = pmm_alloc_nozero(1);
-                    if (page == NULL) {
-                        goto cleanup;
-                    }
-
-                    memcpy(page + VMM_HIGHER_HALF, old_page + VMM_HIGHER_HALF, PAGE_SIZE);
-                    *new_pte = PTE_GET_FLAGS(*old_pte) | (uint64_t)page;
-                    *new_spte = *new_pte;
-                }
-            } else {
-                panic(NULL, true, "Non anon fork");
-            }
+        if (global_range->res != NULL) {
+            global_range->res->refcount++;
         }
 
         VECTOR_PUSH_BACK(&new_pagemap->mmap_ranges, new_local_range);
     );
 
-    spinlock_release(&pagemap->lock);
+    vmm_tlb_shootdown(pagemap);
+    mutex_release(&pagemap->lock);
     return new_pagemap;
 
 cleanup:
-    spinlock_release(&pagemap->lock);
+    vmm_tlb_shootdown(pagemap);
+    mutex_release(&pagemap->lock);
     if (new_pagemap != NULL) {
         vmm_destroy_pagemap(new_pagemap);
     }
     return NULL;
 }
 
-static void tlb_shootdown_handler(int vector, struct cpu_ctx *ctx) {
-    (void)vector;
-    (void)ctx;
+// Flushes this CPU's TLB if another CPU asked for it. Also called by spinlock
+// waiters spinning with interrupts off, so that the CPU holding the lock can
+// finish a shootdown and let go of it.
+void vmm_tlb_shootdown_poll(void) {
+    if (!smp_started) {
+        return;
+    }
 
     struct cpu_local *cpu = this_cpu();
+    if (!__atomic_load_n(&cpu->tlb_shootdown_pending, __ATOMIC_ACQUIRE)) {
+        return;
+    }
 
-    if (read_cr3() == cpu->tlb_shootdown_cr3) {
+    // A zero cr3 stands for the kernel pagemap, whose higher half every
+    // pagemap shares
+    if (cpu->tlb_shootdown_cr3 == 0 || read_cr3() == cpu->tlb_shootdown_cr3) {
         write_cr3(read_cr3());
     }
 
-    spinlock_release(&cpu->tlb_shootdown_done);
+    __atomic_store_n(&cpu->tlb_shootdown_pending, false, __ATOMIC_RELEASE);
+}
+
+static void tlb_shootdown_handler(int vector, struct cpu_ctx *ctx) {
+    (void)vector;
+    (void)ctx;
+
+    vmm_tlb_shootdown_poll();
 
     lapic_eoi();
 }
 
-static void tlb_shootdown(struct pagemap *pagemap) {
+// Does not return before every other CPU has flushed, as pages are freed and
+// addresses reused right after
+void vmm_tlb_shootdown(struct pagemap *pagemap) {
     if (!smp_started) {
         return;
     }
 
+    uintptr_t cr3 = 0;
+    if (pagemap != vmm_kernel_pagemap) {
+        cr3 = (uintptr_t)pagemap->top_level - VMM_HIGHER_HALF;
+    }
+
     struct thread *thread = sched_current_thread();
 
     bool old_sched_state = thread->scheduling_off;
@@ -289,31 +559,26 @@ static void tlb_shootdown(struct pagemap *pagemap) {
         struct cpu_local *cpu = &cpus[i];
 
         if (cpu == us) {
-            if (read_cr3() == (uintptr_t)pagemap->top_level - VMM_HIGHER_HALF) {
+            if (cr3 == 0 || read_cr3() == cr3) {
                 write_cr3(read_cr3());
             }
             continue;
         }
 
         spinlock_acquire(&cpu->tlb_shootdown_lock);
-        spinlock_acquire(&cpu->tlb_shootdown_done);
 
-        cpu->tlb_shootdown_cr3 = (uintptr_t)pagemap->top_level - VMM_HIGHER_HALF;
-        asm volatile ("" ::: "memory");
+        cpu->tlb_shootdown_cr3 = cr3;
+        __atomic_store_n(&cpu->tlb_shootdown_pending, true, __ATOMIC_RELEASE);
         lapic_send_ipi(cpu->lapic_id, tlb_shootdown_ipi_vector | (1 << 14));
 
-        volatile int timeout = 0;
-        while (!spinlock_test_and_acq(&cpu->tlb_shootdown_done)) {
-            if (++timeout % 100) {
-                asm ("pause");
-                continue;
-            }
-            if (timeout % 1000 == 0) {
-                break;
+        // Send the IPI again now and then in case it got lost
+        for (size_t spins = 1; __atomic_load_n(&cpu->tlb_shootdown_pending, __ATOMIC_ACQUIRE); spins++) {
+            if (spins % 1000 == 0) {
+                lapic_send_ipi(cpu->lapic_id, tlb_shootdown_ipi_vector | (1 << 14));
             }
-            lapic_send_ipi(cpu->lapic_id, tlb_shootdown_ipi_vector | (1 << 14));
+            asm volatile ("pause");
         }
-        spinlock_release(&cpu->tlb_shootdown_done);
+
         spinlock_release(&cpu->tlb_shootdown_lock);
     }
 
@@ -328,6 +593,10 @@ static void destroy_level(uint64_t *pml, size_t start, size_t end, int level) {
     }
 
     for (size_t i = start; i < end; i++) {
+        if (is_large(pml[i])) {
+            continue;
+        }
+
         uint64_t *next_level = get_next_level(pml, i, false);
         if (next_level == NULL) {
             continue;
@@ -340,7 +609,7 @@ static void destroy_level(uint64_t *pml, size_t start, size_t end, int level) {
 }
 
 void vmm_destroy_pagemap(struct pagemap *pagemap) {
-    //spinlock_acquire(&pagemap->lock);
+    //mutex_acquire(&pagemap->lock);
 
     while (pagemap->mmap_ranges.length > 0) {
         struct mmap_range_local *local_range = pagemap->mmap_ranges.data[0];
@@ -348,7 +617,7 @@ void vmm_destroy_pagemap(struct pagemap *pagemap) {
         munmap(pagemap, local_range->base, local_range->length);
     }
 
-    spinlock_acquire(&pagemap->lock);
+    mutex_acquire(&pagemap->lock);
 
     destroy_level(pagemap->top_level, 0, 256, 4);
     free(pagemap);
@@ -364,127 +633,164 @@ void vmm_switch_to(struct pagemap *pagemap) {
 }
 
 bool vmm_map_page(struct pagemap *pagemap, uintptr_t virt, uintptr_t phys, uint64_t flags) {
-    spinlock_acquire(&pagemap->lock);
+    mutex_acquire(&pagemap->lock);
 
     bool ok = false;
-    size_t pml4_entry = (virt & (0x1ffull << 39)) >> 39;
-    size_t pml3_entry = (virt & (0x1ffull << 30)) >> 30;
-    size_t pml2_entry = (virt & (0x1ffull << 21)) >> 21;
-    size_t pml1_entry = (virt & (0x1ffull << 12)) >> 12;
 
-    uint64_t *pml4 = pagemap->top_level;
-    uint64_t *pml3 = get_next_level(pml4, pml4_entry, true);
-    if (pml3 == NULL) {
+    uint64_t *pte = vmm_virt2pte(pagemap, virt, true);
+    if (pte == NULL) {
         goto cleanup;
     }
-    uint64_t *pml2 = get_next_level(pml3, pml3_entry, true);
-    if (pml2 == NULL) {
+
+    if ((*pte & PTE_PRESENT) != 0) {
+        errno = EINVAL;
         goto cleanup;
     }
-    uint64_t *pml1 = get_next_level(pml2, pml2_entry, true);
-    if (pml1 == NULL) {
+
+    ok = true;
+    *pte = phys | flags;
+
+cleanup:
+    vmm_tlb_shootdown(pagemap);
+
+    mutex_release(&pagemap->lock);
+    return ok;
+}
+
+bool vmm_map_large_page(struct pagemap *pagemap, uintptr_t virt, uintptr_t phys, uint64_t flags, size_t page_size) {
+    mutex_acquire(&pagemap->lock);
+
+    bool ok = false;
+
+    uint64_t *entry = get_large_entry(pagemap, virt, page_size);
+    if (entry == NULL) {
         goto cleanup;
     }
 
-    if ((pml1[pml1_entry] & PTE_PRESENT) != 0) {
+    // Whatever is mapped there now, including an empty table, is in the way
+    if (*entry != 0) {
         errno = EINVAL;
         goto cleanup;
     }
 
     ok = true;
-    pml1[pml1_entry] = phys | flags;
+    *entry = phys | flags | PTE_LARGE;
 
 cleanup:
-    tlb_shootdown(pagemap);
+    vmm_tlb_shootdown(pagemap);
 
-    spinlock_release(&pagemap->lock);
+    mutex_release(&pagemap->lock);
     return ok;
 }
 
-bool vmm_flag_page(struct pagemap *pagemap, bool lock, uintptr_t virt, uint64_t flags) {
+// Only succeeds if a 2 MiB page is mapped at virt, nothing is split
+bool vmm_flag_large_page(struct pagemap *pagemap, bool lock, uintptr_t virt, uint64_t flags) {
     if (lock) {
-        spinlock_acquire(&pagemap->lock);
+        mutex_acquire(&pagemap->lock);
     }
 
     bool ok = false;
-    size_t pml4_entry = (virt & (0x1ffull << 39)) >> 39;
-    size_t pml3_entry = (virt & (0x1ffull << 30)) >> 30;
-    size_t pml2_entry = (virt & (0x1ffull << 21)) >> 21;
-    size_t pml1_entry = (virt & (0x1ffull << 12)) >> 12;
 
-    uint64_t *pml4 = pagemap->top_level;
-    uint64_t *pml3 = get_next_level(pml4, pml4_entry, false);
-    if (pml3 == NULL) {
+    uint64_t *entry = get_mapped_large_entry(pagemap, virt);
+    if (entry == NULL) {
         goto cleanup;
     }
-    uint64_t *pml2 = get_next_level(pml3, pml3_entry, false);
-    if (pml2 == NULL) {
-        goto cleanup;
+
+    ok = true;
+    *entry = large_page_addr(*entry, PAGE_SIZE_2M) | flags | PTE_LARGE;
+    vmm_tlb_shootdown(pagemap);
+
+cleanup:
+    if (lock) {
+        mutex_release(&pagemap->lock);
     }
-    uint64_t *pml1 = get_next_level(pml2, pml2_entry, false);
-    if (pml1 == NULL) {
+    return ok;
+}
+
+bool vmm_flag_page(struct pagemap *pagemap, bool lock, uintptr_t virt, uint64_t flags) {
+    if (lock) {
+        mutex_acquire(&pagemap->lock);
+    }
+
+    bool ok = false;
+
+    uint64_t *pte = vmm_virt2pte(pagemap, virt, false);
+    if (pte == NULL) {
         goto cleanup;
     }
 
-    if ((pml1[pml1_entry] & PTE_PRESENT) == 0) {
+    if ((*pte & PTE_PRESENT) == 0) {
         errno = EINVAL;
         goto cleanup;
     }
 
     ok = true;
-    pml1[pml1_entry] = PTE_GET_ADDR(pml1[pml1_entry]) | flags;
+    *pte = PTE_GET_ADDR(*pte) | flags;
 
 cleanup:
-    tlb_shootdown(pagemap);
+    vmm_tlb_shootdown(pagemap);
 
     if (lock) {
-        spinlock_release(&pagemap->lock);
+        mutex_release(&pagemap->lock);
     }
     return ok;
 }
 
 bool vmm_unmap_page(struct pagemap *pagemap, uintptr_t virt, bool already_locked) {
     if (!already_locked) {
-        spinlock_acquire(&pagemap->lock);
+        mutex_acquire(&pagemap->lock);
     }
 
     bool ok = false;
-    size_t pml4_entry = (virt & (0x1ffull << 39)) >> 39;
-    size_t pml3_entry = (virt & (0x1ffull << 30)) >> 30;
-    size_t pml2_entry = (virt & (0x1ffull << 21)) >> 21;
-    size_t pml1_entry = (virt & (0x1ffull << 12)) >> 12;
 
-    uint64_t *pml4 = pagemap->top_level;
-    uint64_t *pml3 = get_next_level(pml4, pml4_entry, false);
-    if (pml3 == NULL) {
+    uint64_t *pte = vmm_virt2pte(pagemap, virt, false);
+    if (pte == NULL) {
         goto cleanup;
     }
-    uint64_t *pml2 = get_next_level(pml3, pml3_entry, false);
-    if (pml2 == NULL) {
+
+    if ((*pte & PTE_PRESENT) == 0) {
+        errno = EINVAL;
         goto cleanup;
     }
-    uint64_t *pml1 = get_next_level(pml2, pml2_entry, false);
-    if (pml1 == NULL) {
-        goto cleanup;
+
+    ok = true;
+    *pte = 0;
+
+cleanup:
+    vmm_tlb_shootdown(pagemap);
+
+    if (!already_locked) {
+        mutex_release(&pagemap->lock);
     }
+    return ok;
+}
 
-    if ((pml1[pml1_entry] & PTE_PRESENT) == 0) {
-        errno = EINVAL;
+// Only succeeds if a 2 MiB page is mapped at virt, nothing is split
+bool vmm_unmap_large_page(struct pagemap *pagemap, uintptr_t virt, bool already_locked) {
+    if (!already_locked) {
+        mutex_acquire(&pagemap->lock);
+    }
+
+    bool ok = false;
+
+    uint64_t *entry = get_mapped_large_entry(pagemap, virt);
+    if (entry == NULL) {
         goto cleanup;
     }
 
     ok = true;
-    pml1[pml1_entry] = 0;
+    *entry = 0;
+    vmm_tlb_shootdown(pagemap);
 
 cleanup:
-    tlb_shootdown(pagemap);
-
     if (!already_locked) {
-        spinlock_release(&pagemap->lock);
+        mutex_release(&pagemap->lock);
     }
     return ok;
 }
 
+// Large pages on the way down are split, as the caller asked for the PML1
+// entry of the address
 uint64_t *vmm_virt2pte(struct pagemap *pagemap, uintptr_t virt, bool allocate) {
     size_t pml4_entry = (virt & (0x1ffull << 39)) >> 39;
     size_t pml3_entry = (virt & (0x1ffull << 30)) >> 30;
@@ -496,10 +802,16 @@ uint64_t *vmm_virt2pte(struct pagemap *pagemap, uintptr_t virt, bool allocate) {
     if (pml3 == NULL) {
         return NULL;
     }
+    if (is_large(pml3[pml3_entry]) && !split_large_page(&pml3[pml3_entry], PAGE_SIZE_1G)) {
+        return NULL;
+    }
     uint64_t *pml2 = get_next_level(pml3, pml3_entry, allocate);
     if (pml2 == NULL) {
         return NULL;
     }
+    if (is_large(pml2[pml2_entry]) && !split_large_page(&pml2[pml2_entry], PAGE_SIZE_2M)) {
+        return NULL;
+    }
     uint64_t *pml1 = get_next_level(pml2, pml2_entry, allocate);
     if (pml1 == NULL) {
         return NULL;
@@ -508,11 +820,33 @@ uint64_t *vmm_virt2pte(struct pagemap *pagemap, uintptr_t virt, bool allocate) {
     return &pml1[pml1_entry];
 }
 
+// Returns the physical address of the 4 KiB page holding virt, also when it
+// is part of a large page
 uintptr_t vmm_virt2phys(struct pagemap *pagemap, uintptr_t virt) {
-    uint64_t *pte = vmm_virt2pte(pagemap, virt, false);
-    if (pte == NULL || (PTE_GET_FLAGS(*pte) & PTE_PRESENT) == 0) {
+    size_t pml4_entry = (virt & (0x1ffull << 39)) >> 39;
+    size_t pml3_entry = (virt & (0x1ffull << 30)) >> 30;
+    size_t pml2_entry = (virt & (0x1ffull << 21)) >> 21;
+    size_t pml1_entry = (virt & (0x1ffull << 12)) >> 12;
+
+    uint64_t *pml4 = pagemap->top_level;
+    uint64_t *pml3 = get_next_level(pml4, pml4_entry, false);
+    if (pml3 == NULL) {
+        return INVALID_PHYS;
+    }
+    if (is_large(pml3[pml3_entry])) {
+        return large_page_addr(pml3[pml3_entry], PAGE_SIZE_1G) + ALIGN_DOWN(virt & (PAGE_SIZE_1G - 1), PAGE_SIZE);
+    }
+    uint64_t *pml2 = get_next_level(pml3, pml3_entry, false);
+    if (pml2 == NULL) {
+        return INVALID_PHYS;
+    }
+    if (is_large(pml2[pml2_entry])) {
+        return large_page_addr(pml2[pml2_entry], PAGE_SIZE_2M) + ALIGN_DOWN(virt & (PAGE_SIZE_2M - 1), PAGE_SIZE);
+    }
+    uint64_t *pml1 = get_next_level(pml2, pml2_entry, false);
+    if (pml1 == NULL || (pml1[pml1_entry] & PTE_PRESENT) == 0) {
         return INVALID_PHYS;
     }
 
-    return PTE_GET_ADDR(*pte);
+    return PTE_GET_ADDR(pml1[pml1_entry]);
 }
@@ -2,16 +2,23 @@
 #define _MM__VMM_K_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <limine.h>
-#include <lib/lock.k.h>
+#include <lib/mutex.k.h>
 #include <lib/vector.k.h>
 
 #define PAGE_SIZE 4096
+#define PAGE_SIZE_2M 0x200000
+#define PAGE_SIZE_1G 0x40000000
 
 #define PTE_PRESENT (1ull << 0ull)
 #define PTE_WRITABLE (1ull << 1ull)
 #define PTE_USER (1ull << 2ull)
+// Set in PML3 and PML2 entries that map a 1 GiB or 2 MiB page
+#define PTE_LARGE (1ull << 7ull)
+// Available to software: a read-only private page shared with another process
+#define PTE_COW (1ull << 9ull)
 #define PTE_NX (1ull << 63ull)
 
 #define PTE_ADDR_MASK 0x000ffffffffff000
@@ -19,7 +26,7 @@
 #define PTE_GET_FLAGS(VALUE) ((VALUE) & ~PTE_ADDR_MASK)
 
 struct pagemap {
-    spinlock_t lock;
+    struct mutex lock;
     uint64_t *top_level;
     VECTOR_TYPE(struct mmap_range_local *) mmap_ranges;
 };
@@ -38,9 +45,14 @@ struct pagemap *vmm_new_pagemap(void);
 struct pagemap *vmm_fork_pagemap(struct pagemap *pagemap);
 void vmm_destroy_pagemap(struct pagemap *pagemap);
 void vmm_switch_to(struct pagemap *pagemap);
+void vmm_tlb_shootdown(struct pagemap *pagemap);
+void vmm_tlb_shootdown_poll(void);
 bool vmm_map_page(struct pagemap *pagemap, uintptr_t virt, uintptr_t phys, uint64_t flags);
+bool vmm_map_large_page(struct pagemap *pagemap, uintptr_t virt, uintptr_t phys, uint64_t flags, size_t page_size);
 bool vmm_flag_page(struct pagemap *pagemap, bool lock, uintptr_t virt, uint64_t flags);
+bool vmm_flag_large_page(struct pagemap *pagemap, bool lock, uintptr_t virt, uint64_t flags);
 bool vmm_unmap_page(struct pagemap *pagemap, uintptr_t virt, bool already_locked);
+bool vmm_unmap_large_page(struct pagemap *pagemap, uintptr_t virt, bool already_locked);
 uint64_t *vmm_virt2pte(struct pagemap *pagemap, uintptr_t virt, bool allocate);
 uintptr_t vmm_virt2phys(struct pagemap *pagemap, uintptr_t virt);
 
@@ -0,0 +1,117 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <lib/alloc.k.h>
+#include <lib/lock.k.h>
+#include <lib/misc.k.h>
+#include <sched/pid.k.h>
+
+// PIDs are handed out from a bitmap, with a second level bitmap marking the
+// words of the first one that are full so a search skips over them. The
+// search starts after the last PID handed out, so recently freed ones do not
+// get reused right away.
+//
+// The pid -> process map is a two level radix table, leaves get allocated
+// the first time one of their PIDs is used.
+
+#define PID_WORDS (PID_MAX / 64)
+#define PID_LEAF_SIZE 512
+#define PID_LEAVES (PID_MAX / PID_LEAF_SIZE)
+
+static spinlock_t pid_lock = SPINLOCK_INIT;
+static uint64_t pid_bitmap[PID_WORDS];
+static uint64_t pid_full_words[(PID_WORDS + 63) / 64];
+static struct process **pid_table[PID_LEAVES];
+static int pid_last = -1;
+
+static int pid_find_free(int start) {
+    for (int word = start / 64; word < PID_WORDS; word++) {
+        if (pid_full_words[word / 64] & ((uint64_t)1 << (word % 64))) {
+            // Skip to the next word that is not full
+            continue;
+        }
+
+        uint64_t free_bits = ~pid_bitmap[word];
+        if (word == start / 64) {
+            free_bits &= ~(((uint64_t)1 << (start % 64)) - 1);
+        }
+
+        if (free_bits != 0) {
+            return word * 64 + __builtin_ctzll(free_bits);
+        }
+    }
+
+    return -1;
+}
+
+int pid_alloc(struct process *proc) {
+    spinlock_acquire(&pid_lock);
+
+    int pid = pid_find_free(pid_last + 1);
+    if (pid == -1) {
+        pid = pid_find_free(0);
+    }
+
+    if (pid == -1) {
+        goto cleanup;
+    }
+
+    struct process ***leaf = &pid_table[pid / PID_LEAF_SIZE];
+    if (*leaf == NULL) {
+        *leaf = alloc(PID_LEAF_SIZE * sizeof(struct process *));
+        if (*leaf == NULL) {
+            pid = -1;
+            goto cleanup;
+        }
+    }
+
+    (*leaf)[pid % PID_LEAF_SIZE] = proc;
+
+    int word = pid / 64;
+    pid_bitmap[word] |= (uint64_t)1 << (pid % 64);
+    if (pid_bitmap[word] == UINT64_MAX) {
+        pid_full_words[word / 64] |= (uint64_t)1 << (word % 64);
+    }
+
+    pid_last = pid;
+
+cleanup:
+    spinlock_release(&pid_lock);
+    return pid;
+}
+
+void pid_free(int pid) {
+    if (pid < 0 || pid >= PID_MAX) {
+        return;
+    }
+
+    spinlock_acquire(&pid_lock);
+
+    int word = pid / 64;
+    pid_bitmap[word] &= ~((uint64_t)1 << (pid % 64));
+    pid_full_words[word / 64] &= ~((uint64_t)1 << (word % 64));
+
+    struct process **leaf = pid_table[pid / PID_LEAF_SIZE];
+    if (leaf != NULL) {
+        leaf[pid % PID_LEAF_SIZE] = NULL;
+    }
+
+    spinlock_release(&pid_lock);
+}
+
+struct process *pid_lookup(int pid) {
+    if (pid < 0 || pid >= PID_MAX) {
+        return NULL;
+    }
+
+    spinlock_acquire(&pid_lock);
+
+    struct process *ret = NULL;
+    struct process **leaf = pid_table[pid / PID_LEAF_SIZE];
+    if (leaf != NULL) {
+        ret = leaf[pid % PID_LEAF_SIZE];
+    }
+
+    spinlock_release(&pid_lock);
+    return ret;
+}
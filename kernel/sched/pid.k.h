@@ -0,0 +1,14 @@
+#ifndef _SCHED__PID_K_H
+#define _SCHED__PID_K_H
+
+#include <stdbool.h>
+
+#define PID_MAX 32768
+
+struct process;
+
+int pid_alloc(struct process *proc);
+void pid_free(int pid);
+struct process *pid_lookup(int pid);
+
+#endif
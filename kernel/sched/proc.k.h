@@ -26,6 +26,15 @@ struct process {
     struct vfs_node *cwd;
     spinlock_t fds_lock;
     mode_t umask;
+    int nice;
+    // Set by exit(), the other threads die instead of going back to userspace
+    bool exiting;
+    // CPU time in TSC ticks of threads no longer in `threads`, and of
+    // children that were waited for
+    uint64_t user_time;
+    uint64_t kernel_time;
+    uint64_t children_user_time;
+    uint64_t children_kernel_time;
     struct f_descriptor *fds[MAX_FDS];
     char name[128];
 };
@@ -40,23 +49,45 @@ struct thread {
     spinlock_t lock;
     struct cpu_local *this_cpu;
     bool scheduling_off;
+    int rcu_nesting;
     int running_on;
     bool enqueued;
     bool enqueued_by_signal;
+    bool dead;
+    // On no process' thread list, so freed as soon as it is dead
+    bool detached;
+    struct cpu_local *run_queue;
+    struct rb_node run_queue_node;
     struct process *process;
+    int policy;
+    int rt_priority;
+    struct thread *rt_next;
+    struct thread *rt_prev;
+    int nice;
+    uint64_t weight;
+    uint64_t vruntime;
+    uint64_t exec_start;
+    cpu_mask_t affinity;
+    // CPU time in TSC ticks, accounted up to time_stamp
+    uint64_t user_time;
+    uint64_t kernel_time;
+    uint64_t time_stamp;
     int timeslice;
-    spinlock_t yield_await;
     struct cpu_ctx ctx;
     void *gs_base;
     void *fs_base;
     uint64_t cr3;
     void *fpu_storage;
+    struct cpu_local *fpu_cpu;
     VECTOR_TYPE(void *) stacks;
     void *pf_stack;
     void *kernel_stack;
     size_t which_event;
     size_t attached_events_i;
     struct event *attached_events[MAX_EVENTS];
+    // Set while asleep on a mutex or rwlock, see lib/mutex.c
+    bool lock_waiting;
+    struct thread *lock_wait_next;
 };
 
 static inline struct thread *sched_current_thread(void) {
@@ -7,7 +7,10 @@
 #include <lib/vector.k.h>
 #include <lib/resource.k.h>
 #include <lib/debug.k.h>
+#include <lib/bitmap.k.h>
+#include <lib/rcu.k.h>
 #include <sched/sched.k.h>
+#include <sched/pid.k.h>
 #include <dev/lapic.k.h>
 #include <sys/cpu.k.h>
 #include <sys/idt.k.h>
@@ -15,16 +18,21 @@
 #include <mm/pmm.k.h>
 #include <mm/vmm.k.h>
 #include <fs/vfs/vfs.k.h>
+#include <time/time.k.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 
 struct process *kernel_process;
 
-static struct thread *running_queue[MAX_RUNNING_THREADS];
+struct kmem_cache thread_cache = KMEM_CACHE_INIT("thread", sizeof(struct thread), _Alignof(struct thread), NULL);
 
 static uint8_t sched_vector;
 
 static void sched_entry(int vector, struct cpu_ctx *ctx);
 
+// Defined in sched/switch.S
+void sched_switch(void *sched_stack, void (*handler)(struct cpu_ctx *ctx));
+
 void sched_init(void) {
     sched_vector = idt_allocate_vector();
     kernel_print("sched: Scheduler interrupt vector is 0x%x\n", sched_vector);
@@ -35,44 +43,433 @@ void sched_init(void) {
     kernel_process = sched_new_process(NULL, vmm_kernel_pagemap);
 }
 
-static struct thread *get_next_thread(void) {
-    struct cpu_local *cpu = this_cpu();
+// Targeted scheduling latency and minimum timeslice, in microseconds. Every
+// runnable thread on a CPU gets to run once per latency period, for a share
+// of it proportional to its weight.
+#define SCHED_LATENCY 20000
+#define SCHED_MIN_GRANULARITY 2000
+
+#define NICE_0_WEIGHT 1024
+
+// Every nice level is ~10% more or less CPU time than the next one
+static const uint32_t nice_to_weight[NICE_MAX - NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548, 7620, 6100, 4904, 3906,
+    3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423,
+    335, 272, 215, 172, 137,
+    110, 87, 70, 56, 45,
+    36, 29, 23, 18, 15
+};
+
+// Real-time threads on a CPU may use up to RT_RUNTIME out of every RT_PERIOD
+// microseconds while normal threads are waiting, so a runaway one cannot
+// starve the rest of the system. Round robin ones are rotated every
+// RT_RR_TIMESLICE microseconds.
+#define RT_PERIOD 1000000
+#define RT_RUNTIME 950000
+#define RT_RR_TIMESLICE 100000
+
+static bool thread_is_rt(struct thread *thread) {
+    return thread->policy != SCHED_OTHER;
+}
 
-    int orig_i = cpu->last_run_queue_index;
+static bool cpu_allowed(struct thread *thread, struct cpu_local *cpu) {
+    return bitmap_test(&thread->affinity, cpu->cpu_number);
+}
+
+static bool vruntime_less(struct rb_node *a, struct rb_node *b) {
+    struct thread *thread_a = RB_ENTRY(a, struct thread, run_queue_node);
+    struct thread *thread_b = RB_ENTRY(b, struct thread, run_queue_node);
 
-    if (orig_i >= MAX_RUNNING_THREADS) {
-        orig_i = 0;
+    return (int64_t)(thread_a->vruntime - thread_b->vruntime) < 0;
+}
+
+// All of the run_queue_*() and rt_queue_*() functions must be called with the
+// run queue lock of `cpu` held.
+//
+// Real-time threads sit in one FIFO list per priority, with a bitmap of the
+// non-empty ones, everyone else in the vruntime ordered tree.
+static void rt_queue_push(struct cpu_local *cpu, struct thread *thread) {
+    int prio = thread->rt_priority;
+
+    thread->rt_next = NULL;
+    thread->rt_prev = cpu->rt_queue_tail[prio];
+    if (thread->rt_prev != NULL) {
+        thread->rt_prev->rt_next = thread;
+    } else {
+        cpu->rt_queue_head[prio] = thread;
     }
+    cpu->rt_queue_tail[prio] = thread;
 
-    int index = orig_i + 1;
+    cpu->rt_queue_bitmap[prio / 64] |= (uint64_t)1 << (prio % 64);
+}
 
-    for (;;) {
-        if (index >= MAX_RUNNING_THREADS) {
-            index = 0;
+static void rt_queue_remove(struct cpu_local *cpu, struct thread *thread) {
+    int prio = thread->rt_priority;
+
+    if (thread->rt_prev != NULL) {
+        thread->rt_prev->rt_next = thread->rt_next;
+    } else {
+        cpu->rt_queue_head[prio] = thread->rt_next;
+    }
+    if (thread->rt_next != NULL) {
+        thread->rt_next->rt_prev = thread->rt_prev;
+    } else {
+        cpu->rt_queue_tail[prio] = thread->rt_prev;
+    }
+
+    if (cpu->rt_queue_head[prio] == NULL) {
+        cpu->rt_queue_bitmap[prio / 64] &= ~((uint64_t)1 << (prio % 64));
+    }
+}
+
+// Highest priority with runnable real-time threads that is below `limit`, or
+// 0 if there is none
+static int rt_queue_highest_below(struct cpu_local *cpu, int limit) {
+    for (int word = (limit - 1) / 64; word >= 0; word--) {
+        uint64_t bits = cpu->rt_queue_bitmap[word];
+        if (word == (limit - 1) / 64 && (limit - 1) % 64 != 63) {
+            bits &= ((uint64_t)1 << ((limit - 1) % 64 + 1)) - 1;
         }
 
-        struct thread *thread = running_queue[index];
+        if (bits != 0) {
+            return word * 64 + 63 - __builtin_clzll(bits);
+        }
+    }
+
+    return 0;
+}
+
+// While a thread is off a run queue its vruntime is kept relative to the
+// min_vruntime of the queue it left, so it carries its lag over to whichever
+// CPU it gets enqueued on next.
+static void run_queue_push(struct cpu_local *cpu, struct thread *thread) {
+    thread->run_queue = cpu;
+    cpu->run_queue_length++;
+
+    if (thread_is_rt(thread)) {
+        rt_queue_push(cpu, thread);
+        return;
+    }
+
+    thread->vruntime += cpu->min_vruntime;
+
+    rb_insert(&cpu->run_queue, &thread->run_queue_node, vruntime_less);
+    cpu->run_queue_weight += thread->weight;
+}
+
+static void run_queue_remove(struct cpu_local *cpu, struct thread *thread) {
+    thread->run_queue = NULL;
+    cpu->run_queue_length--;
+
+    if (thread_is_rt(thread)) {
+        rt_queue_remove(cpu, thread);
+        return;
+    }
+
+    rb_erase(&cpu->run_queue, &thread->run_queue_node);
+    cpu->run_queue_weight -= thread->weight;
+
+    thread->vruntime -= cpu->min_vruntime;
+}
+
+static void run_queue_update_min(struct cpu_local *cpu) {
+    struct thread *leftmost = RB_ENTRY(rb_first(&cpu->run_queue), struct thread, run_queue_node);
+
+    if (leftmost != NULL && (int64_t)(leftmost->vruntime - cpu->min_vruntime) > 0) {
+        cpu->min_vruntime = leftmost->vruntime;
+    }
+}
+
+static void rt_update_period(struct cpu_local *cpu, uint64_t now) {
+    if (now - cpu->rt_period_start >= RT_PERIOD * (cpu->tsc_freq / 1000000)) {
+        cpu->rt_period_start = now;
+        cpu->rt_time = 0;
+        cpu->rt_throttled = false;
+    }
+}
 
-        if (thread != NULL) {
-            if (spinlock_test_and_acq(&thread->lock) == true) {
-                cpu->last_run_queue_index = index;
+// Charge the time `thread` spent running on `cpu` since it was last accounted
+static void update_curr(struct cpu_local *cpu, struct thread *thread) {
+    uint64_t now = rdtsc();
+    uint64_t delta = now - thread->exec_start;
+    thread->exec_start = now;
+
+    rt_update_period(cpu, now);
+
+    if (thread_is_rt(thread)) {
+        cpu->rt_time += delta;
+        if (cpu->rt_time >= RT_RUNTIME * (cpu->tsc_freq / 1000000)) {
+            cpu->rt_throttled = true;
+        }
+        return;
+    }
+
+    spinlock_acquire(&cpu->run_queue_lock);
+
+    // Threads queued on another CPU (woken up before they got switched out
+    // here) have their vruntime relative to that CPU, leave them alone.
+    if (thread->run_queue == NULL || thread->run_queue == cpu) {
+        bool queued = thread->run_queue == cpu;
+
+        if (queued) {
+            rb_erase(&cpu->run_queue, &thread->run_queue_node);
+        }
+
+        thread->vruntime += delta * NICE_0_WEIGHT / thread->weight;
+
+        if (queued) {
+            rb_insert(&cpu->run_queue, &thread->run_queue_node, vruntime_less);
+        }
+
+        run_queue_update_min(cpu);
+    }
+
+    spinlock_release(&cpu->run_queue_lock);
+}
+
+static int timeslice_for(struct cpu_local *cpu, struct thread *thread) {
+    if (thread_is_rt(thread)) {
+        // Come back in time to throttle it once the budget is used up
+        uint64_t used = cpu->rt_time / (cpu->tsc_freq / 1000000);
+        uint64_t timeslice = used < RT_RUNTIME ? RT_RUNTIME - used : 0;
+        if (thread->policy == SCHED_RR) {
+            timeslice = MIN(timeslice, (uint64_t)RT_RR_TIMESLICE);
+        }
+
+        return MAX(timeslice, (uint64_t)SCHED_MIN_GRANULARITY);
+    }
+
+    uint64_t total_weight = MAX(cpu->run_queue_weight, thread->weight);
+    uint64_t timeslice = SCHED_LATENCY * thread->weight / total_weight;
+
+    return MAX(timeslice, (uint64_t)SCHED_MIN_GRANULARITY);
+}
+
+// Returns the first runnable thread of the highest real-time priority, or
+// `current` if that is the one that is already running.
+static struct thread *rt_queue_pick(struct cpu_local *cpu, struct thread *current) {
+    for (int prio = rt_queue_highest_below(cpu, SCHED_RT_PRIO_MAX + 1); prio != 0;
+         prio = rt_queue_highest_below(cpu, prio)) {
+        for (struct thread *thread = cpu->rt_queue_head[prio]; thread != NULL; thread = thread->rt_next) {
+            if (thread == current) {
+                return current;
+            }
+
+            if (spinlock_test_and_acq(&thread->lock)) {
                 return thread;
             }
         }
+    }
 
-        if (index == orig_i) {
+    return NULL;
+}
+
+// Returns the runnable real-time thread to run next, or else the one with
+// the smallest vruntime, or `current` if that is the one already running.
+static struct thread *run_queue_pick(struct cpu_local *cpu, struct thread *current) {
+    struct thread *ret = NULL;
+
+    spinlock_acquire(&cpu->run_queue_lock);
+
+    if (!cpu->rt_throttled) {
+        ret = rt_queue_pick(cpu, current);
+        if (ret != NULL) {
+            goto out;
+        }
+    }
+
+    for (struct rb_node *node = rb_first(&cpu->run_queue); node != NULL; node = rb_next(node)) {
+        struct thread *thread = RB_ENTRY(node, struct thread, run_queue_node);
+
+        if (thread == current) {
+            ret = current;
+            break;
+        }
+
+        // Threads stay queued while running, skip the ones running elsewhere
+        if (spinlock_test_and_acq(&thread->lock)) {
+            ret = thread;
             break;
         }
+    }
 
-        index++;
+    // Throttling is only there to let normal threads run, if there are none
+    // do not leave the CPU idle
+    if (ret == NULL && cpu->rt_throttled) {
+        ret = rt_queue_pick(cpu, current);
     }
 
-    cpu->last_run_queue_index = index;
-    return NULL;
+out:
+    spinlock_release(&cpu->run_queue_lock);
+    return ret;
+}
+
+static struct thread *run_queue_steal(struct cpu_local *cpu) {
+    struct thread *ret = NULL;
+
+    spinlock_acquire(&cpu->run_queue_lock);
+
+    for (size_t i = 1; i < cpu_count && ret == NULL; i++) {
+        struct cpu_local *victim = &cpus[(cpu->cpu_number + i) % cpu_count];
+
+        if (victim->run_queue_length == 0) {
+            continue;
+        }
+
+        // Our own queue lock is held, so only ever try the remote one,
+        // otherwise two CPUs stealing from each other could deadlock.
+        if (!spinlock_test_and_acq(&victim->run_queue_lock)) {
+            continue;
+        }
+
+        for (int prio = rt_queue_highest_below(victim, SCHED_RT_PRIO_MAX + 1); prio != 0 && ret == NULL;
+             prio = rt_queue_highest_below(victim, prio)) {
+            for (struct thread *thread = victim->rt_queue_head[prio]; thread != NULL; thread = thread->rt_next) {
+                if (cpu_allowed(thread, cpu) && spinlock_test_and_acq(&thread->lock)) {
+                    run_queue_remove(victim, thread);
+                    run_queue_push(cpu, thread);
+                    ret = thread;
+                    break;
+                }
+            }
+        }
+
+        for (struct rb_node *node = rb_first(&victim->run_queue); node != NULL && ret == NULL; node = rb_next(node)) {
+            struct thread *thread = RB_ENTRY(node, struct thread, run_queue_node);
+
+            if (cpu_allowed(thread, cpu) && spinlock_test_and_acq(&thread->lock)) {
+                run_queue_remove(victim, thread);
+                run_queue_push(cpu, thread);
+                ret = thread;
+                break;
+            }
+        }
+
+        spinlock_release(&victim->run_queue_lock);
+    }
+
+    spinlock_release(&cpu->run_queue_lock);
+    return ret;
+}
+
+// Take `thread`, which runs on `cpu`, over from the run queue of the CPU it
+// got enqueued on meanwhile. Same lock order as run_queue_steal().
+static bool run_queue_pull(struct cpu_local *cpu, struct thread *thread) {
+    bool ret = false;
+
+    spinlock_acquire(&cpu->run_queue_lock);
+
+    struct cpu_local *queue = thread->run_queue;
+    if (queue == cpu) {
+        ret = true;
+    } else if (queue != NULL && spinlock_test_and_acq(&queue->run_queue_lock)) {
+        if (thread->run_queue == queue) {
+            run_queue_remove(queue, thread);
+            run_queue_push(cpu, thread);
+            ret = true;
+        }
+        spinlock_release(&queue->run_queue_lock);
+    }
+
+    spinlock_release(&cpu->run_queue_lock);
+    return ret;
+}
+
+// Whether the run queue of `cpu` has a thread that is not running anywhere.
+// Must be called with the run queue lock of `cpu` held.
+static bool run_queue_has_waiting(struct cpu_local *cpu) {
+    for (int prio = rt_queue_highest_below(cpu, SCHED_RT_PRIO_MAX + 1); prio != 0;
+         prio = rt_queue_highest_below(cpu, prio)) {
+        for (struct thread *thread = cpu->rt_queue_head[prio]; thread != NULL; thread = thread->rt_next) {
+            if (thread->running_on == -1) {
+                return true;
+            }
+        }
+    }
+
+    for (struct rb_node *node = rb_first(&cpu->run_queue); node != NULL; node = rb_next(node)) {
+        struct thread *thread = RB_ENTRY(node, struct thread, run_queue_node);
+
+        if (thread->running_on == -1) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static struct thread *get_next_thread(struct cpu_local *cpu, struct thread *current) {
+    struct thread *ret = run_queue_pick(cpu, current);
+    if (ret == NULL) {
+        ret = run_queue_steal(cpu);
+    }
+
+    return ret;
+}
+
+void sched_set_nice(struct thread *thread, int nice) {
+    nice = MIN(MAX(nice, NICE_MIN), NICE_MAX);
+
+    bool old_state = interrupt_toggle(false);
+
+    // Keep the weight of the queue the thread is on in sync
+    for (;;) {
+        struct cpu_local *cpu = thread->run_queue;
+        if (cpu == NULL) {
+            thread->nice = nice;
+            thread->weight = nice_to_weight[nice - NICE_MIN];
+            break;
+        }
+
+        spinlock_acquire(&cpu->run_queue_lock);
+
+        if (thread->run_queue == cpu) {
+            run_queue_remove(cpu, thread);
+            thread->nice = nice;
+            thread->weight = nice_to_weight[nice - NICE_MIN];
+            run_queue_push(cpu, thread);
+            spinlock_release(&cpu->run_queue_lock);
+            break;
+        }
+
+        spinlock_release(&cpu->run_queue_lock);
+    }
+
+    interrupt_toggle(old_state);
 }
 
 #if defined (__x86_64__)
 
+// Save the FPU state of `thread` if it is live in this CPU's registers and
+// was touched since it got loaded there.
+static void fpu_save_live(struct cpu_local *cpu, struct thread *thread) {
+    if (cpu->fpu_owner == thread && (read_cr0() & CR0_TS) == 0) {
+        fpu_save(thread->fpu_storage);
+    }
+}
+
+static void fpu_switch_to(struct cpu_local *cpu, struct thread *thread) {
+    // Kernel threads do not use the FPU, leave whatever is loaded alone
+    if (thread->fpu_storage == NULL) {
+        return;
+    }
+
+    // If the registers still hold what the thread last saved there is no
+    // need to restore, otherwise let the #NM handler do it on first use.
+    uint64_t cr0 = read_cr0();
+    uint64_t new_cr0 = cr0 | CR0_TS;
+    if (cpu->fpu_owner == thread && thread->fpu_cpu == cpu) {
+        new_cr0 &= ~CR0_TS;
+    }
+
+    if (new_cr0 != cr0) {
+        write_cr0(new_cr0);
+    }
+}
+
 static noreturn void thread_spinup(struct cpu_ctx *ctx) {
     asm volatile (
         "mov %0, %%rsp\n\t"
@@ -107,60 +504,143 @@ static noreturn void thread_spinup(struct cpu_ctx *ctx) {
 
 #endif
 
-static void sched_entry(int vector, struct cpu_ctx *ctx) {
-    (void)vector;
+// Make a thread of an exiting process that was interrupted in userspace
+// resume in sched_dequeue_and_die() instead, on its unused kernel stack
+static void redirect_if_exiting(struct thread *thread, struct cpu_ctx *ctx) {
+    if (ctx->cs != 0x4b || !__atomic_load_n(&thread->process->exiting, __ATOMIC_ACQUIRE)) {
+        return;
+    }
 
-    lapic_timer_stop();
+#if defined (__x86_64__)
+    ctx->cs = 0x28;
+    ctx->ds = ctx->es = ctx->ss = 0x30;
+    ctx->rflags = 0x202;
+    ctx->rip = (uint64_t)sched_dequeue_and_die;
+    ctx->rsp = (uint64_t)thread->kernel_stack;
+#endif
+}
+
+static void sched_arm_tick(struct cpu_local *cpu, uint64_t us) {
+    cpu->tick_armed = true;
+    lapic_timer_oneshot(us, sched_vector);
+}
+
+// Pick the next thread to run on this CPU and switch to it. This runs on the
+// scheduler stack, either from the scheduler interrupt or from sched_yield().
+// It only returns if the current thread is to keep running.
+static void sched_reschedule(struct cpu_ctx *ctx, bool from_irq) {
+    struct cpu_local *cpu = this_cpu();
+
+    // We can get here through an IPI with the tick still counting down
+    cpu->tick_armed = lapic_timer_armed();
 
     struct thread *current_thread = sched_current_thread();
 
-    if (current_thread && current_thread->scheduling_off) {
-        lapic_eoi();
-        lapic_timer_oneshot(current_thread->timeslice, sched_vector);
+    if (current_thread && (current_thread->scheduling_off || current_thread->rcu_nesting > 0)) {
+        if (from_irq) {
+            lapic_eoi();
+        }
+        if (!cpu->tick_armed) {
+            sched_arm_tick(cpu, current_thread->timeslice);
+        }
         return;
     }
 
-    struct cpu_local *cpu = this_cpu();
+    rcu_quiescent(cpu);
 
     cpu->active = true;
 
-    struct thread *next_thread = get_next_thread();
-
     if (current_thread != cpu->idle_thread) {
-        spinlock_release(&current_thread->yield_await);
+        update_curr(cpu, current_thread);
+
+        // Round robin threads go to the back of their list once their
+        // timeslice ran out, that is when we get here from the tick
+        if (from_irq && !cpu->tick_armed && current_thread->policy == SCHED_RR) {
+            spinlock_acquire(&cpu->run_queue_lock);
+            if (current_thread->run_queue == cpu) {
+                rt_queue_remove(cpu, current_thread);
+                rt_queue_push(cpu, current_thread);
+            }
+            spinlock_release(&cpu->run_queue_lock);
+        }
+    }
 
-        if (next_thread == NULL && current_thread->enqueued) {
-            lapic_eoi();
-            lapic_timer_oneshot(current_thread->timeslice, sched_vector);
+    struct thread *next_thread = get_next_thread(cpu, current_thread);
+
+    if (current_thread != cpu->idle_thread) {
+        // A thread woken up before it got switched out may have been queued
+        // on another CPU, only keep running it if we can take it over.
+        if (next_thread == current_thread
+         || (next_thread == NULL && current_thread->enqueued && cpu_allowed(current_thread, cpu)
+          && run_queue_pull(cpu, current_thread))) {
+            // Leave a pending tick alone, and only arm a new one if there is
+            // someone to preempt the thread for. Enqueuers check tick_armed
+            // after pushing under this lock, so they IPI us if we go without.
+            if (!cpu->tick_armed) {
+                spinlock_acquire(&cpu->run_queue_lock);
+                bool contended = run_queue_has_waiting(cpu);
+                spinlock_release(&cpu->run_queue_lock);
+
+                if (contended) {
+                    current_thread->timeslice = timeslice_for(cpu, current_thread);
+                    sched_arm_tick(cpu, current_thread->timeslice);
+                }
+            }
+            redirect_if_exiting(current_thread, ctx);
+            if (from_irq) {
+                lapic_eoi();
+            }
             return;
         }
 
         current_thread->ctx = *ctx;
 
+        uint64_t now = rdtsc();
+        if (ctx->cs == 0x4b) {
+            current_thread->user_time += now - current_thread->time_stamp;
+        } else {
+            current_thread->kernel_time += now - current_thread->time_stamp;
+        }
+
 #if defined (__x86_64__)
         current_thread->gs_base = get_kernel_gs_base();
         current_thread->fs_base = get_fs_base();
         current_thread->cr3 = read_cr3();
-        fpu_save(current_thread->fpu_storage);
+        fpu_save_live(cpu, current_thread);
 #endif
 
         current_thread->running_on = -1;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        struct cpu_local *queued_on = current_thread->run_queue;
         spinlock_release(&current_thread->lock);
+
+        // The CPU it is queued on skipped it while it ran here, and does not
+        // look at it again if it went idle meanwhile
+        if (queued_on != NULL && queued_on != cpu && queued_on->active == false) {
+            sched_kick(queued_on);
+        }
     }
 
     if (next_thread == NULL) {
-        lapic_eoi();
+        lapic_timer_stop();
+        cpu->tick_armed = false;
+        if (from_irq) {
+            lapic_eoi();
+        }
 #if defined (__x86_64__)
         set_gs_base(cpu->idle_thread);
         set_kernel_gs_base(cpu->idle_thread);
 #endif
         cpu->active = false;
+        cpu->rt_running_priority = 0;
         vmm_switch_to(vmm_kernel_pagemap);
         sched_await();
     }
 
     current_thread = next_thread;
 
+    redirect_if_exiting(current_thread, &current_thread->ctx);
+
 #if defined (__x86_64__)
     set_gs_base(current_thread);
     if (current_thread->ctx.cs == 0x4b) {
@@ -182,23 +662,49 @@ static void sched_entry(int vector, struct cpu_ctx *ctx) {
         write_cr3(current_thread->cr3);
     }
 
-    fpu_restore(current_thread->fpu_storage);
+    fpu_switch_to(cpu, current_thread);
 #endif
 
     current_thread->running_on = cpu->cpu_number;
     current_thread->this_cpu = cpu;
+    cpu->rt_running_priority = current_thread->rt_priority;
+    current_thread->exec_start = rdtsc();
+    current_thread->time_stamp = current_thread->exec_start;
+    current_thread->timeslice = timeslice_for(cpu, current_thread);
 
-    lapic_eoi();
-    lapic_timer_oneshot(current_thread->timeslice, sched_vector);
+    if (from_irq) {
+        lapic_eoi();
+    }
+    sched_arm_tick(cpu, current_thread->timeslice);
 
     struct cpu_ctx *new_ctx = &current_thread->ctx;
 
     thread_spinup(new_ctx);
 }
 
+static void sched_entry(int vector, struct cpu_ctx *ctx) {
+    (void)vector;
+
+    sched_reschedule(ctx, true);
+}
+
+static void sched_yield_entry(struct cpu_ctx *ctx) {
+    sched_reschedule(ctx, false);
+}
+
+// Idle CPUs do not tick, they sleep until sched_enqueue_thread() sends them
+// an IPI, and leave timers to the PIT.
 noreturn void sched_await(void) {
     interrupt_toggle(false);
-    lapic_timer_oneshot(20000, sched_vector);
+    struct cpu_local *cpu = this_cpu();
+    // Catch threads enqueued on us before our LAPIC could take the IPI. The
+    // ones still running elsewhere get us kicked once they are switched out.
+    spinlock_acquire(&cpu->run_queue_lock);
+    bool waiting = run_queue_has_waiting(cpu);
+    spinlock_release(&cpu->run_queue_lock);
+    if (waiting) {
+        lapic_send_ipi(cpu->lapic_id, sched_vector);
+    }
     interrupt_toggle(true);
     for (;;) {
         halt();
@@ -206,75 +712,402 @@ noreturn void sched_await(void) {
     __builtin_unreachable();
 }
 
+// Make another CPU go through the scheduler
+void sched_kick(struct cpu_local *cpu) {
+    lapic_send_ipi(cpu->lapic_id, sched_vector);
+}
+
 void sched_yield(bool save_ctx) {
     interrupt_toggle(false);
 
     lapic_timer_stop();
 
-    struct thread *thread = sched_current_thread();
-
     struct cpu_local *cpu = this_cpu();
 
-    if (save_ctx) {
-        spinlock_acquire(&thread->yield_await);
-    } else {
+    if (!save_ctx) {
         set_gs_base(cpu->idle_thread);
         set_kernel_gs_base(cpu->idle_thread);
     }
 
-    lapic_send_ipi(cpu->lapic_id, sched_vector);
+    // Switch away directly instead of going through a self IPI
+    sched_switch((void *)cpu->tss.ist1, sched_yield_entry);
 
     interrupt_toggle(true);
+}
 
-    if (save_ctx) {
-        spinlock_acquire(&thread->yield_await);
-        spinlock_release(&thread->yield_await);
-    } else {
-        for (;;) {
-            halt();
+// Called from the syscall entry and exit paths with interrupts off, to split
+// the time a thread ran between user and kernel mode. Time spent in other
+// interrupts is charged to whatever mode they interrupted.
+void sched_account_user(void) {
+    struct thread *thread = sched_current_thread();
+    uint64_t now = rdtsc();
+    thread->user_time += now - thread->time_stamp;
+    thread->time_stamp = now;
+}
+
+void sched_account_kernel(void) {
+    struct thread *thread = sched_current_thread();
+    uint64_t now = rdtsc();
+    thread->kernel_time += now - thread->time_stamp;
+    thread->time_stamp = now;
+}
+
+// Called on the way out of every syscall, with interrupts off
+void sched_check_exiting(void) {
+    struct thread *thread = sched_current_thread();
+
+    if (__atomic_load_n(&thread->process->exiting, __ATOMIC_ACQUIRE)) {
+        sched_dequeue_and_die();
+    }
+}
+
+void sched_thread_times(struct thread *thread, uint64_t *user, uint64_t *kernel) {
+    *user = thread->user_time;
+    *kernel = thread->kernel_time;
+
+    // Whoever asks about the running thread does so from a syscall, so
+    // the part not accounted yet is kernel time
+    if (thread == sched_current_thread()) {
+        *kernel += rdtsc() - thread->time_stamp;
+    }
+}
+
+void sched_process_times(struct process *proc, uint64_t *user, uint64_t *kernel) {
+    *user = proc->user_time;
+    *kernel = proc->kernel_time;
+
+    VECTOR_FOR_EACH(&proc->threads, it,
+        uint64_t thread_user, thread_kernel;
+        sched_thread_times(*it, &thread_user, &thread_kernel);
+        *user += thread_user;
+        *kernel += thread_kernel;
+    );
+}
+
+// A CPU running at most one thread is still a good place to wake up on,
+// the thread likely still has its working set in that CPU's caches.
+#define WAKE_AFFINE_MAX_LOAD 1
+
+// Whether `thread` waking up on `cpu` should preempt what runs there
+static bool wakeup_preempts(struct cpu_local *cpu, struct thread *thread) {
+    return thread->rt_priority > cpu->rt_running_priority;
+}
+
+static struct cpu_local *select_target_cpu(struct thread *thread) {
+    struct cpu_local *prev = thread->this_cpu;
+
+    if (prev != NULL && cpu_allowed(thread, prev)
+     && (prev->active == false || prev->run_queue_length <= WAKE_AFFINE_MAX_LOAD
+      || wakeup_preempts(prev, thread))) {
+        return prev;
+    }
+
+    // Otherwise go for the allowed idle CPU closest to where the thread last
+    // ran, or the least loaded allowed one if they are all busy
+    struct cpu_local *base = prev != NULL ? prev : this_cpu();
+    struct cpu_local *least_loaded = NULL;
+    for (size_t i = 0; i < cpu_count; i++) {
+        struct cpu_local *cpu = &cpus[(base->cpu_number + i) % cpu_count];
+        if (!cpu_allowed(thread, cpu)) {
+            continue;
+        }
+
+        if (cpu->active == false) {
+            return cpu;
+        }
+
+        // Real-time threads go wherever they get to run right away
+        if (thread_is_rt(thread) && wakeup_preempts(cpu, thread)) {
+            return cpu;
+        }
+
+        if (least_loaded == NULL || cpu->run_queue_length < least_loaded->run_queue_length) {
+            least_loaded = cpu;
         }
     }
+
+    return least_loaded != NULL ? least_loaded : base;
 }
 
 bool sched_enqueue_thread(struct thread *thread, bool by_signal) {
-    if (thread->enqueued == true) {
+    if (!CAS(&thread->enqueued, false, true)) {
         return true;
     }
 
-    thread->enqueued_by_signal = by_signal;
+    bool old_state = interrupt_toggle(false);
+
+    thread->enqueued_by_signal = by_signal;
+
+    struct cpu_local *target = select_target_cpu(thread);
+
+    spinlock_acquire(&target->run_queue_lock);
+    if (thread->run_queue == NULL) {
+        run_queue_push(target, thread);
+
+        // Do not let threads that slept for long build up credit, just give
+        // them a head start of half a latency period.
+        uint64_t floor = target->min_vruntime - SCHED_LATENCY / 2 * (target->tsc_freq / 1000000);
+        if (!thread_is_rt(thread) && (int64_t)(thread->vruntime - floor) < 0) {
+            rb_erase(&target->run_queue, &thread->run_queue_node);
+            thread->vruntime = floor;
+            rb_insert(&target->run_queue, &thread->run_queue_node, vruntime_less);
+        }
+    }
+    spinlock_release(&target->run_queue_lock);
+
+    // Kick the target if it is idle, if it is running a thread without a
+    // tick and so would otherwise never get around to the new one, or if the
+    // new one is to preempt the current one.
+    if (target->active == false || target->tick_armed == false || wakeup_preempts(target, thread)) {
+        lapic_send_ipi(target->lapic_id, sched_vector);
+    }
+
+    interrupt_toggle(old_state);
+    return true;
+}
+
+bool sched_set_affinity(struct thread *thread, cpu_mask_t *mask) {
+    bool any_allowed = false;
+    for (size_t i = 0; i < cpu_count; i++) {
+        if (bitmap_test(mask, i)) {
+            any_allowed = true;
+            break;
+        }
+    }
+
+    if (!any_allowed) {
+        return false;
+    }
+
+    bool old_state = interrupt_toggle(false);
+
+    thread->affinity = *mask;
+
+    // Move the thread off a run queue it may no longer be on. Hold on to the
+    // old queue so it never looks dequeued, and only trylock the new one as
+    // run_queue_steal() locks them in the opposite order.
+    for (;;) {
+        struct cpu_local *cpu = thread->run_queue;
+        if (cpu == NULL) {
+            break;
+        }
+
+        spinlock_acquire(&cpu->run_queue_lock);
+
+        if (thread->run_queue != cpu) {
+            spinlock_release(&cpu->run_queue_lock);
+            continue;
+        }
+
+        if (cpu_allowed(thread, cpu)) {
+            spinlock_release(&cpu->run_queue_lock);
+            break;
+        }
+
+        struct cpu_local *target = select_target_cpu(thread);
+        if (!spinlock_test_and_acq(&target->run_queue_lock)) {
+            spinlock_release(&cpu->run_queue_lock);
+            asm volatile ("pause");
+            continue;
+        }
+
+        run_queue_remove(cpu, thread);
+        run_queue_push(target, thread);
+
+        spinlock_release(&target->run_queue_lock);
+        spinlock_release(&cpu->run_queue_lock);
+
+        if (target->active == false || target->tick_armed == false) {
+            lapic_send_ipi(target->lapic_id, sched_vector);
+        }
+        break;
+    }
+
+    // Get it off the CPU it is running on if that is no longer allowed
+    int running_on = thread->running_on;
+    if (running_on != -1 && !bitmap_test(mask, running_on)) {
+        if (thread == sched_current_thread()) {
+            sched_yield(true);
+        } else {
+            lapic_send_ipi(cpus[running_on].lapic_id, sched_vector);
+        }
+    }
+
+    interrupt_toggle(old_state);
+    return true;
+}
+
+bool sched_set_policy(struct thread *thread, int policy, int rt_priority) {
+    switch (policy) {
+        case SCHED_OTHER:
+            if (rt_priority != 0) {
+                return false;
+            }
+            break;
+        case SCHED_FIFO:
+        case SCHED_RR:
+            if (rt_priority < 1 || rt_priority > SCHED_RT_PRIO_MAX) {
+                return false;
+            }
+            break;
+        default:
+            return false;
+    }
+
+    bool old_state = interrupt_toggle(false);
+
+    // Requeue the thread in the right place of the queue it is on
+    for (;;) {
+        struct cpu_local *cpu = thread->run_queue;
+        if (cpu == NULL) {
+            thread->policy = policy;
+            thread->rt_priority = rt_priority;
+            break;
+        }
+
+        spinlock_acquire(&cpu->run_queue_lock);
+
+        if (thread->run_queue == cpu) {
+            run_queue_remove(cpu, thread);
+            thread->policy = policy;
+            thread->rt_priority = rt_priority;
+            run_queue_push(cpu, thread);
+            spinlock_release(&cpu->run_queue_lock);
+
+            if (thread->running_on == -1 && wakeup_preempts(cpu, thread)) {
+                lapic_send_ipi(cpu->lapic_id, sched_vector);
+            }
+            break;
+        }
+
+        spinlock_release(&cpu->run_queue_lock);
+    }
+
+    interrupt_toggle(old_state);
+    return true;
+}
+
+bool sched_dequeue_thread(struct thread *thread) {
+    if (!thread->enqueued) {
+        return true;
+    }
+
+    bool old_state = interrupt_toggle(false);
+
+    // The thread can be stolen by another CPU while we wait for the lock,
+    // so make sure it is still on the queue we locked.
+    for (;;) {
+        struct cpu_local *cpu = thread->run_queue;
+        if (cpu == NULL) {
+            break;
+        }
+
+        spinlock_acquire(&cpu->run_queue_lock);
+
+        if (thread->run_queue == cpu) {
+            run_queue_remove(cpu, thread);
+            spinlock_release(&cpu->run_queue_lock);
+            break;
+        }
+
+        spinlock_release(&cpu->run_queue_lock);
+    }
+
+    thread->enqueued = false;
+
+    interrupt_toggle(old_state);
+    return true;
+}
+
+#define STACK_SIZE 0x40000
+
+// The kernel and page fault stacks and the FPU save areas of dead threads go
+// to small per-CPU caches, so thread churn does not keep hitting the PMM.
+// Neither needs to be zeroed. All of these deal in physical addresses.
+static void *thread_mem_alloc(bool fpu, size_t pages) {
+    bool old_state = interrupt_toggle(false);
+
+    struct cpu_local *cpu = this_cpu();
+    struct thread_mem_cache *cache = fpu ? &cpu->fpu_cache : &cpu->stack_cache;
+
+    void *ret = NULL;
+    if (cache->length > 0) {
+        ret = cache->blocks[--cache->length];
+    }
+
+    interrupt_toggle(old_state);
+
+    if (ret == NULL) {
+        ret = pmm_alloc_nozero(pages);
+    }
+    return ret;
+}
+
+static void thread_mem_free(bool fpu, void *block, size_t pages) {
+    bool old_state = interrupt_toggle(false);
+
+    struct cpu_local *cpu = this_cpu();
+    struct thread_mem_cache *cache = fpu ? &cpu->fpu_cache : &cpu->stack_cache;
 
-    for (size_t i = 0; i < MAX_RUNNING_THREADS; i++) {
-        if (CAS(&running_queue[i], NULL, thread)) {
-            thread->enqueued = true;
+    if (cache->length < THREAD_MEM_CACHE_SIZE) {
+        cache->blocks[cache->length++] = block;
+        block = NULL;
+    }
 
-            for (size_t j = 0; j < cpu_count; j++) {
-                if (cpus[j].active == false) {
-                    lapic_send_ipi(cpus[j].lapic_id, sched_vector);
-                    break;
-                }
-            }
+    interrupt_toggle(old_state);
 
-            return true;
-        }
+    if (block != NULL) {
+        pmm_free(block, pages);
     }
+}
 
-    return false;
+static void *stack_alloc(void) {
+    return thread_mem_alloc(false, STACK_SIZE / PAGE_SIZE);
 }
 
-bool sched_dequeue_thread(struct thread *thread) {
-    if (!thread->enqueued) {
-        return true;
+static void *fpu_storage_alloc(void) {
+    void *ret = thread_mem_alloc(true, DIV_ROUNDUP(fpu_storage_size, PAGE_SIZE));
+    return ret == NULL ? NULL : ret + VMM_HIGHER_HALF;
+}
+
+// Give back the kernel stacks and the FPU save area of `thread`
+static void thread_free_mem(struct thread *thread) {
+    VECTOR_FOR_EACH(&thread->stacks, it,
+        thread_mem_free(false, *it, STACK_SIZE / PAGE_SIZE);
+    );
+    free(thread->stacks.data);
+    thread->stacks = (typeof(thread->stacks))VECTOR_INIT;
+    thread->kernel_stack = thread->pf_stack = NULL;
+
+    if (thread->fpu_storage != NULL) {
+        thread_mem_free(true, thread->fpu_storage - VMM_HIGHER_HALF, DIV_ROUNDUP(fpu_storage_size, PAGE_SIZE));
+        thread->fpu_storage = NULL;
     }
+}
+
+// Runs on the scheduler stack, off the stacks of the dying thread
+static void sched_die_entry(struct cpu_ctx *ctx) {
+    struct thread *thread = sched_current_thread();
+    struct cpu_local *cpu = this_cpu();
 
-    for (size_t i = 0; i < MAX_RUNNING_THREADS; i++) {
-        if (CAS(&running_queue[i], thread, NULL)) {
-            thread->enqueued = false;
+    sched_account_kernel();
 
-            return true;
-        }
+#if defined (__x86_64__)
+    set_gs_base(cpu->idle_thread);
+    set_kernel_gs_base(cpu->idle_thread);
+#endif
+
+    // The thread structure itself stays around in its process, only free
+    // what it needed to run
+    if (cpu->fpu_owner == thread) {
+        cpu->fpu_owner = NULL;
     }
+    thread_free_mem(thread);
 
-    return false;
+    // Nothing below touches the thread anymore, its lock stays held for good
+    __atomic_store_n(&thread->dead, true, __ATOMIC_RELEASE);
+
+    sched_reschedule(ctx, false);
 }
 
 noreturn void sched_dequeue_and_die(void) {
@@ -282,15 +1115,42 @@ noreturn void sched_dequeue_and_die(void) {
 
     struct thread *thread = sched_current_thread();
 
-    sched_dequeue_thread(thread);
+    // This CPU only goes through the scheduler again once sched_die_entry()
+    // is done with the thread, so that ends the grace period
+    if (thread->detached) {
+        rcu_free(thread);
+    }
 
-    // TODO: Free stacks
+    // Leave the thread marked as enqueued while it is on no run queue, so
+    // nothing can wake it up anymore
+    do {
+        sched_dequeue_thread(thread);
+    } while (!CAS(&thread->enqueued, false, true));
 
-    sched_yield(false);
+    lapic_timer_stop();
+    sched_switch((void *)this_cpu()->tss.ist1, sched_die_entry);
     __builtin_unreachable();
 }
 
-static VECTOR_TYPE(struct process *) processes = VECTOR_INIT;
+// Give back the pid and memory of a process that exited and was waited for.
+// exit() only lets the parent know once all other threads are dead.
+static void sched_free_process(struct process *proc) {
+    VECTOR_FOR_EACH(&proc->threads, it,
+        struct thread *thread = *it;
+        // The thread that called exit() may still be on its way out
+        while (!__atomic_load_n(&thread->dead, __ATOMIC_ACQUIRE)) {
+            asm volatile ("pause");
+        }
+        free(thread);
+    );
+
+    free(proc->threads.data);
+    free(proc->children.data);
+    free(proc->child_events.data);
+
+    pid_free(proc->pid);
+    free(proc);
+}
 
 struct process *sched_new_process(struct process *old_proc, struct pagemap *pagemap) {
     struct process *new_proc = ALLOC(struct process);
@@ -314,6 +1174,7 @@ struct process *sched_new_process(struct process *old_proc, struct pagemap *page
         new_proc->mmap_anon_base = old_proc->mmap_anon_base;
         new_proc->cwd = old_proc->cwd;
         new_proc->umask = old_proc->umask;
+        new_proc->nice = old_proc->nice;
     } else {
         new_proc->ppid = 0;
         new_proc->pagemap = pagemap;
@@ -323,7 +1184,11 @@ struct process *sched_new_process(struct process *old_proc, struct pagemap *page
         new_proc->umask = S_IWGRP | S_IWOTH;
     }
 
-    new_proc->pid = VECTOR_PUSH_BACK(&processes, new_proc);
+    new_proc->pid = pid_alloc(new_proc);
+    if (new_proc->pid == -1) {
+        errno = EAGAIN;
+        goto cleanup;
+    }
 
     if (old_proc != NULL) {
         VECTOR_PUSH_BACK(&old_proc->children, new_proc);
@@ -334,21 +1199,28 @@ struct process *sched_new_process(struct process *old_proc, struct pagemap *page
 
 cleanup:
     if (new_proc != NULL) {
+        if (old_proc != NULL && new_proc->pagemap != NULL) {
+            vmm_destroy_pagemap(new_proc->pagemap);
+        }
         free(new_proc);
     }
     return NULL;
 }
 
-#define STACK_SIZE 0x40000
-
 struct thread *sched_new_kernel_thread(void *pc, void *arg, bool enqueue) {
-    struct thread *thread = ALLOC(struct thread);
+    struct thread *thread = kmem_cache_alloc(&thread_cache);
+    if (thread == NULL) {
+        return NULL;
+    }
 
     thread->lock = (spinlock_t)SPINLOCK_INIT;
-    thread->yield_await = (spinlock_t)SPINLOCK_INIT;
     thread->stacks = (typeof(thread->stacks))VECTOR_INIT;
 
-    void *stack_phys = pmm_alloc(STACK_SIZE / PAGE_SIZE);
+    void *stack_phys = stack_alloc();
+    if (stack_phys == NULL) {
+        free(thread);
+        return NULL;
+    }
     VECTOR_PUSH_BACK(&thread->stacks, stack_phys);
     void *stack = stack_phys + STACK_SIZE + VMM_HIGHER_HALF;
 
@@ -365,10 +1237,12 @@ struct thread *sched_new_kernel_thread(void *pc, void *arg, bool enqueue) {
 #endif
 
     thread->process = kernel_process;
-    thread->timeslice = 5000;
+    thread->detached = true;
+    thread->affinity = cpu_default_affinity;
+    thread->policy = SCHED_OTHER;
+    thread->nice = 0;
+    thread->weight = nice_to_weight[0 - NICE_MIN];
     thread->running_on = -1;
-    thread->fpu_storage = pmm_alloc(DIV_ROUNDUP(fpu_storage_size, PAGE_SIZE))
-                        + VMM_HIGHER_HALF;
     thread->self = thread;
 
     if (enqueue) {
@@ -388,7 +1262,7 @@ int syscall_new_thread(void *_, void *entry, void *stack) {
 
     struct thread *new = sched_new_user_thread(proc, entry, NULL, stack, NULL, NULL, NULL, true);
 
-    int tid = new->tid;
+    int tid = new != NULL ? new->tid : -1;
 
     DEBUG_SYSCALL_LEAVE("%d", tid);
 
@@ -405,14 +1279,13 @@ noreturn int syscall_exit_thread(void *_) {
 
 struct thread *sched_new_user_thread(struct process *proc, void *pc, void *arg, void *sp,
                                      const char **argv, const char **envp, struct auxval *auxval, bool enqueue) {
-    struct thread *thread = ALLOC(struct thread);
+    struct thread *thread = kmem_cache_alloc(&thread_cache);
     if (thread == NULL) {
         errno = ENOMEM;
         goto fail;
     }
 
     thread->lock = (spinlock_t)SPINLOCK_INIT;
-    thread->yield_await = (spinlock_t)SPINLOCK_INIT;
     thread->enqueued = false;
     thread->stacks = (typeof(thread->stacks))VECTOR_INIT;
 
@@ -438,11 +1311,19 @@ struct thread *sched_new_user_thread(struct process *proc, void *pc, void *arg,
         stack_vma = sp;
     }
 
-    void *kernel_stack_phys = pmm_alloc(STACK_SIZE / PAGE_SIZE);
+    void *kernel_stack_phys = stack_alloc();
+    if (kernel_stack_phys == NULL) {
+        errno = ENOMEM;
+        goto fail;
+    }
     VECTOR_PUSH_BACK(&thread->stacks, kernel_stack_phys);
     thread->kernel_stack = kernel_stack_phys + STACK_SIZE + VMM_HIGHER_HALF;
 
-    void *pf_stack_phys = pmm_alloc(STACK_SIZE / PAGE_SIZE);
+    void *pf_stack_phys = stack_alloc();
+    if (pf_stack_phys == NULL) {
+        errno = ENOMEM;
+        goto fail;
+    }
     VECTOR_PUSH_BACK(&thread->stacks, pf_stack_phys);
     thread->pf_stack = pf_stack_phys + STACK_SIZE + VMM_HIGHER_HALF;
 
@@ -458,18 +1339,35 @@ struct thread *sched_new_user_thread(struct process *proc, void *pc, void *arg,
 
     thread->self = thread;
     thread->process = proc;
-    thread->timeslice = 5000;
+    // Threads created by a user thread (new_thread(), exec()) inherit its
+    // mask and scheduling policy
+    struct thread *creator = sched_current_thread();
+    if (creator->process != kernel_process) {
+        thread->affinity = creator->affinity;
+        thread->policy = creator->policy;
+        thread->rt_priority = creator->rt_priority;
+    } else {
+        thread->affinity = cpu_default_affinity;
+        thread->policy = SCHED_OTHER;
+    }
+    thread->nice = proc->nice;
+    thread->weight = nice_to_weight[proc->nice - NICE_MIN];
     thread->running_on = -1;
-    thread->fpu_storage = pmm_alloc(DIV_ROUNDUP(fpu_storage_size, PAGE_SIZE))
-                          + VMM_HIGHER_HALF;
-
-    // Set up FPU control word and MXCSR as defined in the sysv ABI
-    fpu_restore(thread->fpu_storage);
-    uint16_t default_fcw = 0b1100111111;
-    asm volatile ("fldcw %0" :: "m"(default_fcw) : "memory");
-    uint32_t default_mxcsr = 0b1111110000000;
-    asm volatile ("ldmxcsr %0" :: "m"(default_mxcsr) : "memory");
-    fpu_save(thread->fpu_storage);
+    thread->fpu_storage = fpu_storage_alloc();
+    if (thread->fpu_storage == NULL) {
+        errno = ENOMEM;
+        goto fail;
+    }
+    memset(thread->fpu_storage, 0, fpu_storage_size);
+
+    // Set up FPU control word and MXCSR as defined in the sysv ABI. Build
+    // the state in memory, the FPU may hold another thread's live state.
+    *(uint16_t *)(thread->fpu_storage + 0) = 0b1100111111;
+    *(uint32_t *)(thread->fpu_storage + 24) = 0b1111110000000;
+    if (fpu_storage_size > 512) {
+        // XSTATE_BV: x87 and SSE state are not in their init configuration
+        *(uint64_t *)(thread->fpu_storage + 512) = 0b11;
+    }
 
     thread->tid = proc->threads.length;
 
@@ -536,6 +1434,7 @@ struct thread *sched_new_user_thread(struct process *proc, void *pc, void *arg,
 
 fail:
     if (thread != NULL) {
+        thread_free_mem(thread);
         free(thread);
     }
     return NULL;
@@ -575,6 +1474,267 @@ pid_t syscall_getpid(void *_) {
     return ret;
 }
 
+static struct process *priority_target(int which, id_t who) {
+    if (which != PRIO_PROCESS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (who == 0) {
+        return sched_current_thread()->process;
+    }
+
+    struct process *proc = pid_lookup(who);
+    if (proc == NULL) {
+        errno = ESRCH;
+        return NULL;
+    }
+
+    return proc;
+}
+
+int syscall_getpriority(void *_, int which, id_t who) {
+    (void)_;
+
+    DEBUG_SYSCALL_ENTER("getpriority(%d, %d)", which, who);
+
+    int ret = -1;
+
+    struct process *proc = priority_target(which, who);
+    if (proc == NULL) {
+        goto cleanup;
+    }
+
+    ret = proc->nice;
+
+cleanup:
+    DEBUG_SYSCALL_LEAVE("%d", ret);
+    return ret;
+}
+
+int syscall_setpriority(void *_, int which, id_t who, int prio) {
+    (void)_;
+
+    DEBUG_SYSCALL_ENTER("setpriority(%d, %d, %d)", which, who, prio);
+
+    int ret = -1;
+
+    struct process *proc = priority_target(which, who);
+    if (proc == NULL) {
+        goto cleanup;
+    }
+
+    proc->nice = MIN(MAX(prio, NICE_MIN), NICE_MAX);
+
+    VECTOR_FOR_EACH(&proc->threads, it,
+        sched_set_nice(*it, proc->nice);
+    );
+
+    ret = 0;
+
+cleanup:
+    DEBUG_SYSCALL_LEAVE("%d", ret);
+    return ret;
+}
+
+// pid 0 is the calling thread, any other pid stands for all threads of that
+// process. The mask is a byte array with one bit per CPU, like cpu_set_t.
+int syscall_sched_getaffinity(void *_, int pid, size_t size, uint8_t *mask) {
+    (void)_;
+
+    DEBUG_SYSCALL_ENTER("sched_getaffinity(%d, %lu, %lx)", pid, size, mask);
+
+    int ret = -1;
+
+    struct thread *thread = sched_current_thread();
+    if (pid != 0) {
+        struct process *proc = pid_lookup(pid);
+        if (proc == NULL || proc->threads.length == 0) {
+            errno = ESRCH;
+            goto cleanup;
+        }
+
+        thread = VECTOR_ITEM(&proc->threads, 0);
+    }
+
+    if (size < DIV_ROUNDUP(cpu_count, 8)) {
+        errno = EINVAL;
+        goto cleanup;
+    }
+
+    memset(mask, 0, size);
+    memcpy(mask, &thread->affinity, MIN(size, sizeof(cpu_mask_t)));
+
+    ret = 0;
+
+cleanup:
+    DEBUG_SYSCALL_LEAVE("%d", ret);
+    return ret;
+}
+
+int syscall_sched_setaffinity(void *_, int pid, size_t size, const uint8_t *mask) {
+    (void)_;
+
+    DEBUG_SYSCALL_ENTER("sched_setaffinity(%d, %lu, %lx)", pid, size, mask);
+
+    int ret = -1;
+
+    // Bits for CPUs that do not exist are dropped
+    cpu_mask_t new_mask = {0};
+    for (size_t i = 0; i < cpu_count && i / 8 < size; i++) {
+        if (bitmap_test((void *)mask, i)) {
+            bitmap_set(&new_mask, i);
+        }
+    }
+
+    if (pid == 0) {
+        if (!sched_set_affinity(sched_current_thread(), &new_mask)) {
+            errno = EINVAL;
+            goto cleanup;
+        }
+    } else {
+        struct process *proc = pid_lookup(pid);
+        if (proc == NULL) {
+            errno = ESRCH;
+            goto cleanup;
+        }
+
+        bool ok = true;
+        VECTOR_FOR_EACH(&proc->threads, it,
+            ok = sched_set_affinity(*it, &new_mask) && ok;
+        );
+
+        if (!ok) {
+            errno = EINVAL;
+            goto cleanup;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    DEBUG_SYSCALL_LEAVE("%d", ret);
+    return ret;
+}
+
+static struct timeval tsc_to_timeval(uint64_t ticks) {
+    struct timespec ts = time_from_tsc(ticks);
+    return (struct timeval){ .tv_sec = ts.tv_sec, .tv_usec = ts.tv_nsec / 1000 };
+}
+
+int syscall_getrusage(void *_, int who, struct rusage *usage) {
+    (void)_;
+
+    DEBUG_SYSCALL_ENTER("getrusage(%d, %lx)", who, usage);
+
+    int ret = -1;
+
+    struct thread *thread = sched_current_thread();
+    struct process *proc = thread->process;
+
+    uint64_t user, kernel;
+    switch (who) {
+        case RUSAGE_SELF:
+            sched_process_times(proc, &user, &kernel);
+            break;
+        case RUSAGE_CHILDREN:
+            user = proc->children_user_time;
+            kernel = proc->children_kernel_time;
+            break;
+#ifdef RUSAGE_THREAD
+        case RUSAGE_THREAD:
+            sched_thread_times(thread, &user, &kernel);
+            break;
+#endif
+        default:
+            errno = EINVAL;
+            goto cleanup;
+    }
+
+    memset(usage, 0, sizeof(struct rusage));
+    usage->ru_utime = tsc_to_timeval(user);
+    usage->ru_stime = tsc_to_timeval(kernel);
+
+    ret = 0;
+
+cleanup:
+    DEBUG_SYSCALL_LEAVE("%d", ret);
+    return ret;
+}
+
+// Same pid convention as sched_{get,set}affinity. `param` points to a
+// struct sched_param, of which only sched_priority is used.
+int syscall_sched_setscheduler(void *_, int pid, int policy, const int *param) {
+    (void)_;
+
+    DEBUG_SYSCALL_ENTER("sched_setscheduler(%d, %d, %lx)", pid, policy, param);
+
+    int ret = -1;
+
+    if (param == NULL) {
+        errno = EINVAL;
+        goto cleanup;
+    }
+
+    if (pid == 0) {
+        if (!sched_set_policy(sched_current_thread(), policy, *param)) {
+            errno = EINVAL;
+            goto cleanup;
+        }
+    } else {
+        struct process *proc = pid_lookup(pid);
+        if (proc == NULL) {
+            errno = ESRCH;
+            goto cleanup;
+        }
+
+        bool ok = true;
+        VECTOR_FOR_EACH(&proc->threads, it,
+            ok = sched_set_policy(*it, policy, *param) && ok;
+        );
+
+        if (!ok) {
+            errno = EINVAL;
+            goto cleanup;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    DEBUG_SYSCALL_LEAVE("%d", ret);
+    return ret;
+}
+
+int syscall_sched_getscheduler(void *_, int pid, int *param) {
+    (void)_;
+
+    DEBUG_SYSCALL_ENTER("sched_getscheduler(%d, %lx)", pid, param);
+
+    int ret = -1;
+
+    struct thread *thread = sched_current_thread();
+    if (pid != 0) {
+        struct process *proc = pid_lookup(pid);
+        if (proc == NULL || proc->threads.length == 0) {
+            errno = ESRCH;
+            goto cleanup;
+        }
+
+        thread = VECTOR_ITEM(&proc->threads, 0);
+    }
+
+    if (param != NULL) {
+        *param = thread->rt_priority;
+    }
+
+    ret = thread->policy;
+
+cleanup:
+    DEBUG_SYSCALL_LEAVE("%d", ret);
+    return ret;
+}
+
 int syscall_fork(struct cpu_ctx *ctx) {
     DEBUG_SYSCALL_ENTER("fork()");
 
@@ -582,7 +1742,12 @@ int syscall_fork(struct cpu_ctx *ctx) {
 
     struct thread *thread = sched_current_thread();
     struct process *proc = thread->process;
+    struct thread *new_thread = NULL;
+
     struct process *new_proc = sched_new_process(proc, NULL);
+    if (new_proc == NULL) {
+        goto cleanup;
+    }
 
     for (int i = 0; i < MAX_FDS; i++) {
         if (proc->fds[i] == NULL) {
@@ -594,24 +1759,31 @@ int syscall_fork(struct cpu_ctx *ctx) {
         }
     }
 
-    struct thread *new_thread = ALLOC(struct thread);
+    new_thread = kmem_cache_alloc(&thread_cache);
     if (new_thread == NULL) {
         errno = ENOMEM;
         goto fail;
     }
 
     new_thread->lock = (spinlock_t)SPINLOCK_INIT;
-    new_thread->yield_await = (spinlock_t)SPINLOCK_INIT;
     new_thread->enqueued = false;
     new_thread->stacks = (typeof(new_thread->stacks))VECTOR_INIT;
 
-    void *kernel_stack_phys = pmm_alloc(STACK_SIZE / PAGE_SIZE);
+    void *kernel_stack_phys = stack_alloc();
+    if (kernel_stack_phys == NULL) {
+        errno = ENOMEM;
+        goto fail;
+    }
     VECTOR_PUSH_BACK(&new_thread->stacks, kernel_stack_phys);
     new_thread->kernel_stack = kernel_stack_phys + STACK_SIZE + VMM_HIGHER_HALF;
 
-    void *pf_stack_phys = pmm_alloc(STACK_SIZE / PAGE_SIZE);
+    void *pf_stack_phys = stack_alloc();
+    if (pf_stack_phys == NULL) {
+        errno = ENOMEM;
+        goto fail;
+    }
     VECTOR_PUSH_BACK(&new_thread->stacks, pf_stack_phys);
-    new_thread->pf_stack = kernel_stack_phys + STACK_SIZE + VMM_HIGHER_HALF;
+    new_thread->pf_stack = pf_stack_phys + STACK_SIZE + VMM_HIGHER_HALF;
 
     new_thread->ctx = *ctx;
 
@@ -621,12 +1793,23 @@ int syscall_fork(struct cpu_ctx *ctx) {
 
     new_thread->self = new_thread;
     new_thread->process = new_proc;
-    new_thread->timeslice = thread->timeslice;
+    new_thread->affinity = thread->affinity;
+    new_thread->policy = thread->policy;
+    new_thread->rt_priority = thread->rt_priority;
+    new_thread->nice = thread->nice;
+    new_thread->weight = thread->weight;
     new_thread->gs_base = get_kernel_gs_base();
     new_thread->fs_base = get_fs_base();
     new_thread->running_on = -1;
-    new_thread->fpu_storage = pmm_alloc(DIV_ROUNDUP(fpu_storage_size, PAGE_SIZE))
-                              + VMM_HIGHER_HALF;
+    new_thread->fpu_storage = fpu_storage_alloc();
+    if (new_thread->fpu_storage == NULL) {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    bool old_state = interrupt_toggle(false);
+    fpu_save_live(this_cpu(), thread);
+    interrupt_toggle(old_state);
 
     memcpy(new_thread->fpu_storage, thread->fpu_storage, fpu_storage_size);
 
@@ -641,7 +1824,21 @@ int syscall_fork(struct cpu_ctx *ctx) {
     goto cleanup;
 
 fail:
-    // TODO: Properly clean up
+    if (new_thread != NULL) {
+        thread_free_mem(new_thread);
+        free(new_thread);
+    }
+
+    for (int i = 0; i < MAX_FDS; i++) {
+        if (new_proc->fds[i] != NULL) {
+            fdnum_close(new_proc, i, true);
+        }
+    }
+
+    VECTOR_REMOVE_BY_VALUE(&proc->children, new_proc);
+    VECTOR_REMOVE_BY_VALUE(&proc->child_events, &new_proc->event);
+    pid_free(new_proc->pid);
+    vmm_destroy_pagemap(new_proc->pagemap);
     free(new_proc);
 
 cleanup:
@@ -649,6 +1846,26 @@ cleanup:
     return ret;
 }
 
+// Wake up the other threads of `proc` and get them out of userspace until
+// they are all dead. The caller has set proc->exiting.
+static void kill_other_threads(struct process *proc, struct thread *thread) {
+    VECTOR_FOR_EACH(&proc->threads, it,
+        struct thread *other = *it;
+        if (other == thread) {
+            continue;
+        }
+
+        while (!__atomic_load_n(&other->dead, __ATOMIC_ACQUIRE)) {
+            sched_enqueue_thread(other, true);
+            int running_on = other->running_on;
+            if (running_on != -1) {
+                sched_kick(&cpus[running_on]);
+            }
+            sched_yield(true);
+        }
+    );
+}
+
 int syscall_exec(void *_, const char *path, const char **argv, const char **envp) {
     (void)_;
 
@@ -671,14 +1888,33 @@ int syscall_exec(void *_, const char *path, const char **argv, const char **envp
         goto fail;
     }
 
+    // Past this point there is no going back. Threads are killed the same
+    // way exit() does it, and a concurrent exit() or exec() wins.
+    if (__atomic_exchange_n(&proc->exiting, true, __ATOMIC_ACQ_REL)) {
+        vmm_destroy_pagemap(new_pagemap);
+        sched_dequeue_and_die();
+    }
+    kill_other_threads(proc, thread);
+    __atomic_store_n(&proc->exiting, false, __ATOMIC_RELEASE);
+
     struct pagemap *old_pagemap = proc->pagemap;
 
     proc->pagemap = new_pagemap;
     proc->thread_stack_top = 0x70000000000;
     proc->mmap_anon_base = 0x80000000000;
 
-    // TODO: Kill old threads
+    // The old threads are all dead but this one, which leaves the process
+    VECTOR_FOR_EACH(&proc->threads, it,
+        struct thread *old = *it;
+        proc->user_time += old->user_time;
+        proc->kernel_time += old->kernel_time;
+        if (old != thread) {
+            free(old);
+        }
+    );
+    free(proc->threads.data);
     proc->threads = (typeof(proc->threads))VECTOR_INIT;
+    thread->detached = true;
 
     uint64_t entry = ld_path == NULL ? auxv.at_entry : ld_auxv.at_entry;
 
@@ -709,6 +1945,14 @@ int syscall_exit(void *_, int status) {
     struct thread *thread = sched_current_thread();
     struct process *proc = thread->process;
 
+    // Another thread is already taking the process down
+    if (__atomic_exchange_n(&proc->exiting, true, __ATOMIC_ACQ_REL)) {
+        sched_dequeue_and_die();
+    }
+
+    // They may still use the pagemap and the fds
+    kill_other_threads(proc, thread);
+
     struct pagemap *old_pagemap = proc->pagemap;
 
     vmm_switch_to(vmm_kernel_pagemap);
@@ -719,9 +1963,10 @@ int syscall_exit(void *_, int status) {
     }
 
     if (proc->pid != -1) {
-        struct process *pid1 = VECTOR_ITEM(&processes, 1);
+        struct process *pid1 = pid_lookup(1);
 
         VECTOR_FOR_EACH(&proc->children, it,
+            (*it)->ppid = 1;
             VECTOR_PUSH_BACK(&pid1->children, *it);
             VECTOR_PUSH_BACK(&pid1->child_events, &(*it)->event);
         );
@@ -733,8 +1978,6 @@ int syscall_exit(void *_, int status) {
 
     event_trigger(&proc->event, false);
     sched_dequeue_and_die();
-
-    // TODO: Kill all threads too
 }
 
 pid_t syscall_waitpid(void *_, int pid, int *status, int flags) {
@@ -769,9 +2012,9 @@ pid_t syscall_waitpid(void *_, int pid, int *status, int flags) {
             goto cleanup;
         }
 
-        child = VECTOR_ITEM(&processes, pid);
+        child = pid_lookup(pid);
 
-        if ((ssize_t)child == VECTOR_INVALID_INDEX || child->ppid != proc->pid) {
+        if (child == NULL || child->ppid != proc->pid) {
             errno = ECHILD;
             goto cleanup;
         }
@@ -799,13 +2042,19 @@ pid_t syscall_waitpid(void *_, int pid, int *status, int flags) {
 
     *status = child->status;
 
+    // Hand the child's CPU time down to us, for RUSAGE_CHILDREN
+    uint64_t child_user, child_kernel;
+    sched_process_times(child, &child_user, &child_kernel);
+    proc->children_user_time += child_user + child->children_user_time;
+    proc->children_kernel_time += child_kernel + child->children_kernel_time;
+
     VECTOR_REMOVE_BY_VALUE(&proc->child_events, &child->event);
     VECTOR_REMOVE_BY_VALUE(&proc->children, child);
 
-    VECTOR_REMOVE_BY_VALUE(&processes, child);
-
     ret = child->pid;
 
+    sched_free_process(child);
+
 cleanup:
     DEBUG_SYSCALL_LEAVE("%d", ret);
     return ret;
@@ -5,8 +5,20 @@
 #include <stdnoreturn.h>
 #include <sched/proc.k.h>
 #include <lib/elf.k.h>
+#include <mm/slab.k.h>
 
-#define MAX_RUNNING_THREADS 65536
+extern struct kmem_cache thread_cache;
+
+#define NICE_MIN (-20)
+#define NICE_MAX 19
+
+// Scheduling policies, same values as in <sched.h>
+#define SCHED_OTHER 0
+#define SCHED_FIFO 1
+#define SCHED_RR 2
+
+// Real-time priority kernel threads on the network and storage paths get
+#define SCHED_RT_PRIO_IO 50
 
 extern struct process *kernel_process;
 
@@ -16,6 +28,15 @@ void sched_yield(bool save_ctx);
 bool sched_enqueue_thread(struct thread *thread, bool by_signal);
 bool sched_dequeue_thread(struct thread *thread);
 noreturn void sched_dequeue_and_die(void);
+void sched_kick(struct cpu_local *cpu);
+void sched_set_nice(struct thread *thread, int nice);
+bool sched_set_affinity(struct thread *thread, cpu_mask_t *mask);
+bool sched_set_policy(struct thread *thread, int policy, int rt_priority);
+void sched_account_user(void);
+void sched_account_kernel(void);
+void sched_check_exiting(void);
+void sched_thread_times(struct thread *thread, uint64_t *user, uint64_t *kernel);
+void sched_process_times(struct process *proc, uint64_t *user, uint64_t *kernel);
 struct process *sched_new_process(struct process *old_proc, struct pagemap *pagemap);
 struct thread *sched_new_kernel_thread(void *pc, void *arg, bool enqueue);
 struct thread *sched_new_user_thread(struct process *proc, void *pc, void *arg, void *sp,
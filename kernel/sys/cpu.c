@@ -12,6 +12,8 @@
 #include <lib/panic.k.h>
 #include <lib/misc.k.h>
 #include <lib/lock.k.h>
+#include <lib/bitmap.k.h>
+#include <lib/libc.k.h>
 #include <sched/sched.k.h>
 #include <limine.h>
 
@@ -32,6 +34,80 @@ static volatile struct limine_smp_request smp_request = {
     .revision = 0
 };
 
+static volatile struct limine_kernel_file_request kernel_file_request = {
+    .id = LIMINE_KERNEL_FILE_REQUEST,
+    .revision = 0
+};
+
+cpu_mask_t cpu_default_affinity;
+
+// isolcpus=<list> on the kernel command line (e.g. "isolcpus=2,4-7") keeps
+// the listed CPUs out of the default affinity, so only threads explicitly
+// pinned to them ever run there.
+static void parse_isolcpus(cpu_mask_t *isolated) {
+    struct limine_kernel_file_response *kernel_file_resp = kernel_file_request.response;
+    if (kernel_file_resp == NULL || kernel_file_resp->kernel_file->cmdline == NULL) {
+        return;
+    }
+
+    const char *cmdline = kernel_file_resp->kernel_file->cmdline;
+    const char *list = NULL;
+    for (const char *p = cmdline; *p != '\0'; p++) {
+        if ((p == cmdline || p[-1] == ' ') && strncmp(p, "isolcpus=", 9) == 0) {
+            list = p + 9;
+            break;
+        }
+    }
+
+    if (list == NULL) {
+        return;
+    }
+
+    while (*list >= '0' && *list <= '9') {
+        size_t first = 0;
+        while (*list >= '0' && *list <= '9') {
+            first = first * 10 + (*list++ - '0');
+        }
+
+        size_t last = first;
+        if (*list == '-') {
+            list++;
+            last = 0;
+            while (*list >= '0' && *list <= '9') {
+                last = last * 10 + (*list++ - '0');
+            }
+        }
+
+        for (size_t i = first; i <= last && i < MAX_CPUS; i++) {
+            bitmap_set(isolated, i);
+        }
+
+        if (*list != ',') {
+            break;
+        }
+        list++;
+    }
+}
+
+// User threads start out with CR0.TS set, their FPU state only gets loaded
+// once they actually touch the FPU. Kernel threads have no FPU state at all.
+static void fpu_nm_handler(uint8_t vector, struct cpu_ctx *ctx) {
+    (void)vector;
+
+    struct thread *thread = sched_current_thread();
+    if (thread->fpu_storage == NULL) {
+        panic(ctx, true, "FPU used by a kernel thread");
+    }
+
+    struct cpu_local *cpu = this_cpu();
+
+    clts();
+    fpu_restore(thread->fpu_storage);
+
+    cpu->fpu_owner = thread;
+    thread->fpu_cpu = cpu;
+}
+
 static void single_cpu_init(struct limine_smp_info *smp_info) {
     struct cpu_local *cpu_local = (void *)smp_info->extra_argument;
     int cpu_number = cpu_local->cpu_number;
@@ -45,7 +121,7 @@ static void single_cpu_init(struct limine_smp_info *smp_info) {
 
     vmm_switch_to(vmm_kernel_pagemap);
 
-    struct thread *idle_thread = ALLOC(struct thread);
+    struct thread *idle_thread = kmem_cache_alloc(&thread_cache);
 
     idle_thread->self = idle_thread;
     idle_thread->this_cpu = cpu_local;
@@ -105,6 +181,10 @@ static void single_cpu_init(struct limine_smp_info *smp_info) {
         }
     }
 
+    if (cpu_local->bsp) {
+        isr[0x07] = fpu_nm_handler;
+    }
+
     if (cpuid(1, 0, &eax, &ebx, &ecx, &edx) && (ecx & CPUID_XSAVE)) {
         if (cpu_local->bsp) {
             kernel_print("fpu: xsave supported\n");
@@ -150,6 +230,15 @@ static void single_cpu_init(struct limine_smp_info *smp_info) {
         fpu_storage_size = ecx;
         fpu_save = xsave;
         fpu_restore = xrstor;
+
+        // xsaveopt skips components that are in their initial state or
+        // were not modified since they were last restored
+        if (cpuid(0xd, 1, &eax, &ebx, &ecx, &edx) && (eax & CPUID_XSAVEOPT)) {
+            if (cpu_local->bsp) {
+                kernel_print("fpu: Using xsaveopt\n");
+            }
+            fpu_save = xsaveopt;
+        }
     } else {
         if (cpu_local->bsp) {
             kernel_print("fpu: Using legacy fxsave\n");
@@ -231,6 +320,30 @@ void cpu_init(void) {
     kernel_print("cpu: %u processors detected\n", smp_resp->cpu_count);
 
     cpu_count = smp_resp->cpu_count;
+    if (cpu_count > MAX_CPUS) {
+        kernel_print("cpu: Only using the first %u processors\n", MAX_CPUS);
+        cpu_count = MAX_CPUS;
+    }
+
+    cpu_mask_t isolated = {0};
+    parse_isolcpus(&isolated);
+
+    bool have_housekeeping = false;
+    for (size_t i = 0; i < cpu_count; i++) {
+        if (bitmap_test(&isolated, i)) {
+            kernel_print("cpu: Processor #%lu is isolated\n", i);
+        } else {
+            bitmap_set(&cpu_default_affinity, i);
+            have_housekeeping = true;
+        }
+    }
+
+    if (!have_housekeeping) {
+        kernel_print("cpu: isolcpus= leaves no processor for general use, ignoring it\n");
+        for (size_t i = 0; i < cpu_count; i++) {
+            bitmap_set(&cpu_default_affinity, i);
+        }
+    }
 
     cpus = alloc(cpu_count * sizeof(struct cpu_local));
 
@@ -251,7 +364,7 @@ void cpu_init(void) {
         }
     }
 
-    while (cpus_started_i != smp_resp->cpu_count) {
+    while (cpus_started_i != cpu_count) {
         asm ("pause");
     }
 
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <lib/rbtree.k.h>
 
 extern bool sysenter;
 extern uint32_t bsp_lapic_id;
@@ -56,28 +57,86 @@ struct tss {
 
 #ifndef HAVE_SPINLOCK_T
 typedef struct {
-    int lock;
+    uint32_t next;
+    uint32_t owner;
     void *last_acquirer;
+#if LOCKSTAT
+    uint64_t acquired_at;
+#endif
 } spinlock_t;
 #define HAVE_SPINLOCK_T
 #endif
 
+// Memory of dead threads kept around for new ones, see sched.c
+#define THREAD_MEM_CACHE_SIZE 8
+
+struct thread_mem_cache {
+    size_t length;
+    void *blocks[THREAD_MEM_CACHE_SIZE];
+};
+
+// Single free pages kept by each CPU, and single pages zeroed ahead of time
+// for it, see pmm.c
+#define PMM_CPU_CACHE_SIZE 128
+#define PMM_CPU_CACHE_BATCH 32
+#define PMM_CPU_ZEROED_SIZE 256
+
+struct pmm_cpu_cache {
+    size_t length;
+    void *pages[PMM_CPU_CACHE_SIZE];
+    size_t zeroed_length;
+    void *zeroed[PMM_CPU_ZEROED_SIZE];
+    bool refilling;
+    // Set by another CPU that ran out of memory, see pmm.c
+    bool drain;
+};
+
+// Real-time priorities go from 1 to SCHED_RT_PRIO_MAX, higher runs first
+#define SCHED_RT_PRIO_MAX 99
+
 struct cpu_local {
     int cpu_number;
     bool bsp;
     bool active;
-    int last_run_queue_index;
+    bool tick_armed;
     uint32_t lapic_id;
     uint64_t lapic_freq;
+    uint64_t tsc_freq;
     struct tss tss;
     struct thread *idle_thread;
+    struct thread *fpu_owner;
     spinlock_t tlb_shootdown_lock;
-    spinlock_t tlb_shootdown_done;
     volatile uintptr_t tlb_shootdown_cr3;
+    bool tlb_shootdown_pending;
+    spinlock_t run_queue_lock;
+    struct rb_tree run_queue;
+    size_t run_queue_length;
+    uint64_t run_queue_weight;
+    uint64_t min_vruntime;
+    struct thread *rt_queue_head[SCHED_RT_PRIO_MAX + 1];
+    struct thread *rt_queue_tail[SCHED_RT_PRIO_MAX + 1];
+    uint64_t rt_queue_bitmap[(SCHED_RT_PRIO_MAX + 64) / 64];
+    int rt_running_priority;
+    uint64_t rt_period_start;
+    uint64_t rt_time;
+    bool rt_throttled;
+    uint64_t rcu_qs_gp;
+    struct thread_mem_cache stack_cache;
+    struct thread_mem_cache fpu_cache;
+    struct pmm_cpu_cache pmm_cache;
 };
 
 extern struct cpu_local *cpus;
 
+#define MAX_CPUS 256
+
+typedef struct {
+    uint8_t bits[MAX_CPUS / 8];
+} cpu_mask_t;
+
+// CPUs threads may run on unless pinned elsewhere, see isolcpus= in cpu.c
+extern cpu_mask_t cpu_default_affinity;
+
 void cpu_init(void);
 
 extern size_t fpu_storage_size;
@@ -114,6 +173,10 @@ static inline void write_cr0(uint64_t value) {
     asm volatile ("mov %0, %%cr0" :: "r"(value) : "memory");
 }
 
+static inline void clts(void) {
+    asm volatile ("clts" ::: "memory");
+}
+
 static inline void write_cr2(uint64_t value) {
     asm volatile ("mov %0, %%cr2" :: "r"(value) : "memory");
 }
@@ -140,6 +203,14 @@ static inline void xsave(void *ctx) {
         : "memory");
 }
 
+static inline void xsaveopt(void *ctx) {
+    asm volatile (
+        "xsaveopt (%0)"
+        :
+        : "r"(ctx), "a"(0xffffffff), "d"(0xffffffff)
+        : "memory");
+}
+
 static inline void xrstor(void *ctx) {
     asm volatile (
         "xrstor (%0)"
@@ -167,7 +238,7 @@ static inline void fxrstor(void *ctx) {
 static inline uint64_t rdtsc(void) {
     uint32_t edx, eax;
     asm volatile ("rdtsc" : "=d"(edx), "=a"(eax));
-    return ((uint64_t)edx << 32) | edx;
+    return ((uint64_t)edx << 32) | eax;
 }
 
 static inline uint64_t rdrand(void) {
@@ -233,6 +304,11 @@ static inline void *get_fs_base(void) {
 #define CPUID_AVX ((uint32_t)1 << 28)
 #define CPUID_AVX512 ((uint32_t)1 << 16)
 #define CPUID_SEP ((uint32_t)1 << 11)
+#define CPUID_XSAVEOPT ((uint32_t)1 << 0)
+#define CPUID_PDPE1GB ((uint32_t)1 << 26)
+#define CPUID_MTRR ((uint32_t)1 << 12)
+
+#define CR0_TS ((uint64_t)1 << 3)
 
 static inline bool cpuid(uint32_t leaf, uint32_t subleaf,
                          uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
@@ -7,6 +7,7 @@
 #include <lib/misc.k.h>
 #include <lib/panic.k.h>
 #include <lib/print.k.h>
+#include <lib/seqcount.k.h>
 #include <lib/vector.k.h>
 #include <lib/debug.k.h>
 #include <time/time.k.h>
@@ -18,8 +19,11 @@ static volatile struct limine_boot_time_request boot_time_request = {
     .revision = 0
 };
 
-struct timespec time_monotonic = {0, 0};
-struct timespec time_realtime = {0, 0};
+// Only timer_handler() writes the clocks, readers go through the seqcount so
+// they never see one half of a tick's update
+static struct seqcount time_seq = SEQCOUNT_INIT;
+static struct timespec time_monotonic = {0, 0};
+static struct timespec time_realtime = {0, 0};
 
 static spinlock_t timers_lock = SPINLOCK_INIT;
 static VECTOR_TYPE(struct timer *) armed_timers = VECTOR_INIT;
@@ -65,10 +69,32 @@ cleanup:
     spinlock_release(&timers_lock);
 }
 
+struct timespec time_get_monotonic(void) {
+    struct timespec ret;
+    uint32_t seq;
+    do {
+        seq = seqcount_read_begin(&time_seq);
+        ret = time_monotonic;
+    } while (seqcount_read_retry(&time_seq, seq));
+    return ret;
+}
+
+struct timespec time_get_realtime(void) {
+    struct timespec ret;
+    uint32_t seq;
+    do {
+        seq = seqcount_read_begin(&time_seq);
+        ret = time_realtime;
+    } while (seqcount_read_retry(&time_seq, seq));
+    return ret;
+}
+
 void time_init(void) {
     struct limine_boot_time_response *boot_time_resp = boot_time_request.response;
 
+    seqcount_write_begin(&time_seq);
     time_realtime.tv_sec = boot_time_resp->boot_time;
+    seqcount_write_end(&time_seq);
 
     pit_init();
 }
@@ -79,8 +105,10 @@ void timer_handler(void) {
         .tv_nsec = 1000000000 / TIMER_FREQ
     };
 
+    seqcount_write_begin(&time_seq);
     time_monotonic = timespec_add(time_monotonic, interval);
     time_realtime = timespec_add(time_realtime, interval);
+    seqcount_write_end(&time_seq);
 
     if (spinlock_test_and_acq(&timers_lock)) {
         for (size_t i = 0; i < armed_timers.length; i++) {
@@ -100,6 +128,17 @@ void timer_handler(void) {
     }
 }
 
+struct timespec time_from_tsc(uint64_t ticks) {
+    // The TSC is assumed to be invariant and synchronised across CPUs
+    uint64_t freq = cpus[0].tsc_freq;
+
+    // Split it up so `ticks * 1000000000` does not overflow
+    return (struct timespec){
+        .tv_sec = ticks / freq,
+        .tv_nsec = (ticks % freq) * 1000000000 / freq
+    };
+}
+
 void time_nsleep(uint64_t ns) {
     struct timespec duration = { .tv_sec = ns / 1000000000, .tv_nsec = ns };
     struct timer *timer = NULL;
@@ -175,21 +214,29 @@ int syscall_getclock(void *_, int which, struct timespec *out) {
     switch (which) {
         case CLOCK_REALTIME:
         case CLOCK_REALTIME_COARSE:
-            *out = time_realtime;
+            *out = time_get_realtime();
             ret = 0;
             goto cleanup;
         case CLOCK_BOOTTIME:
         case CLOCK_MONOTONIC:
         case CLOCK_MONOTONIC_RAW:
         case CLOCK_MONOTONIC_COARSE:
-            *out = time_monotonic;
+            *out = time_get_monotonic();
             ret = 0;
             goto cleanup;
         case CLOCK_PROCESS_CPUTIME_ID:
-        case CLOCK_THREAD_CPUTIME_ID:
-            *out = (struct timespec){.tv_sec = 0, .tv_nsec = 0};
+        case CLOCK_THREAD_CPUTIME_ID: {
+            uint64_t user, kernel;
+            struct thread *thread = sched_current_thread();
+            if (which == CLOCK_THREAD_CPUTIME_ID) {
+                sched_thread_times(thread, &user, &kernel);
+            } else {
+                sched_process_times(thread->process, &user, &kernel);
+            }
+            *out = time_from_tsc(user + kernel);
             ret = 0;
             goto cleanup;
+        }
     }
 
     errno = EINVAL;
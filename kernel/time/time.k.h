@@ -16,8 +16,8 @@ struct timer {
     struct event event;
 };
 
-extern struct timespec time_monotonic;
-extern struct timespec time_realtime;
+struct timespec time_get_monotonic(void);
+struct timespec time_get_realtime(void);
 
 static inline struct timespec timespec_add(struct timespec a, struct timespec b) {
     if (a.tv_nsec + b.tv_nsec > 999999999) {
@@ -55,6 +55,7 @@ struct timer *timer_new(struct timespec when);
 void timer_arm(struct timer *timer);
 void timer_disarm(struct timer *timer);
 
+struct timespec time_from_tsc(uint64_t ticks);
 void time_nsleep(uint64_t ns);
 void time_init(void);
 
@@ -0,0 +1,193 @@
+// Measures the physical page allocator from userspace. Faulting in anonymous
+// memory allocates single pages, or whole 2 MiB blocks where a mapping covers
+// them, and unmapping it frees them again. The second half fragments memory
+// by unmapping every other page of a large mapping, and reads the free blocks
+// of every order from /dev/meminfo to see them merge once the rest goes too.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define PAGE_SIZE 4096
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define MAPPING_SIZE (64 * 1024 * 1024)
+#define ITERATIONS 10
+
+// As in the kernel's buddy allocator
+#define MAX_ORDER 18
+#define HUGE_PAGE_ORDER 9
+
+// As in the kernel, mlibc does not have them
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+#ifndef MADV_NOHUGEPAGE
+#define MADV_NOHUGEPAGE 15
+#endif
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the mapping, size bytes from *aligned on are usable
+static char *map(size_t size, bool huge, char **aligned) {
+    // Room to align the start for large pages
+    char *base = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("alloc-bench: mmap");
+        return NULL;
+    }
+
+    *aligned = (char *)(((uintptr_t)base + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (madvise(base, size + HUGE_PAGE_SIZE, huge ? MADV_HUGEPAGE : MADV_NOHUGEPAGE) == -1) {
+        perror("alloc-bench: madvise");
+        return NULL;
+    }
+    return base;
+}
+
+// Allocations and frees per second, faulting in one page or block per step
+static double throughput(bool huge) {
+    size_t step = huge ? HUGE_PAGE_SIZE : PAGE_SIZE;
+    size_t count = MAPPING_SIZE / step;
+
+    double elapsed = 0;
+    for (int i = 0; i < ITERATIONS; i++) {
+        char *pages;
+        char *base = map(MAPPING_SIZE, huge, &pages);
+        if (base == NULL) {
+            return -1;
+        }
+
+        double start = now();
+        for (size_t j = 0; j < count; j++) {
+            pages[j * step] = 1;
+        }
+        if (munmap(base, MAPPING_SIZE + HUGE_PAGE_SIZE) == -1) {
+            perror("alloc-bench: munmap");
+            return -1;
+        }
+        elapsed += now() - start;
+    }
+
+    return count * ITERATIONS / elapsed;
+}
+
+static int read_free_blocks(long blocks[MAX_ORDER + 1]) {
+    FILE *f = fopen("/dev/meminfo", "r");
+    if (f == NULL) {
+        perror("alloc-bench: /dev/meminfo");
+        return -1;
+    }
+
+    char line[512];
+    int ret = -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "free_blocks", 11) != 0) {
+            continue;
+        }
+
+        char *p = line + 11;
+        for (int order = 0; order <= MAX_ORDER; order++) {
+            blocks[order] = strtol(p, &p, 10);
+        }
+        ret = 0;
+        break;
+    }
+
+    fclose(f);
+    return ret;
+}
+
+static void print_free_blocks(const char *when, long blocks[MAX_ORDER + 1]) {
+    long small = 0, large = 0;
+    int highest = -1;
+    for (int order = 0; order <= MAX_ORDER; order++) {
+        if (order < HUGE_PAGE_ORDER) {
+            small += blocks[order];
+        } else {
+            large += blocks[order];
+        }
+        if (blocks[order] > 0) {
+            highest = order;
+        }
+    }
+    printf("%-12s %14ld %14ld %14d\n", when, small, large, highest);
+}
+
+static int fragmentation(void) {
+    long blocks[3][MAX_ORDER + 1];
+    size_t count = MAPPING_SIZE / PAGE_SIZE;
+
+    if (read_free_blocks(blocks[0]) == -1) {
+        return -1;
+    }
+
+    char *pages;
+    char *base = map(MAPPING_SIZE, false, &pages);
+    if (base == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        pages[i * PAGE_SIZE] = 1;
+    }
+
+    for (size_t i = 0; i < count; i += 2) {
+        if (munmap(pages + i * PAGE_SIZE, PAGE_SIZE) == -1) {
+            perror("alloc-bench: munmap");
+            return -1;
+        }
+    }
+    if (read_free_blocks(blocks[1]) == -1) {
+        return -1;
+    }
+
+    for (size_t i = 1; i < count; i += 2) {
+        if (munmap(pages + i * PAGE_SIZE, PAGE_SIZE) == -1) {
+            perror("alloc-bench: munmap");
+            return -1;
+        }
+    }
+    // The alignment slack around them, none of it was paged in
+    if (munmap(base, MAPPING_SIZE + HUGE_PAGE_SIZE) == -1) {
+        perror("alloc-bench: munmap");
+        return -1;
+    }
+    if (read_free_blocks(blocks[2]) == -1) {
+        return -1;
+    }
+
+    printf("%-12s %14s %14s %14s\n", "free blocks", "below 2MiB", "2MiB or more", "highest order");
+    print_free_blocks("before", blocks[0]);
+    print_free_blocks("fragmented", blocks[1]);
+    print_free_blocks("after", blocks[2]);
+    return 0;
+}
+
+int main(void) {
+    double small = throughput(false);
+    if (small < 0) {
+        return EXIT_FAILURE;
+    }
+    printf("4KiB pages: %.0f allocations and frees per second\n", small);
+
+    double huge = throughput(true);
+    if (huge < 0) {
+        return EXIT_FAILURE;
+    }
+    printf("2MiB pages: %.0f allocations and frees per second\n", huge);
+
+    if (fragmentation() == -1) {
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
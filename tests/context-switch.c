@@ -0,0 +1,121 @@
+// Measures the cost of a context switch between two processes sharing a CPU
+// and yielding to each other. Runs once with processes that leave the FPU
+// alone between yields, and once with processes that dirty the AVX registers
+// between every yield, so that each switch saves and restores them.
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define YIELDS 200000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void yield_loop(void) {
+    for (int i = 0; i < YIELDS; i++) {
+        sched_yield();
+    }
+}
+
+__attribute__((target("avx")))
+static void yield_loop_avx(void) {
+    asm volatile ("vxorps %%ymm0, %%ymm0, %%ymm0" ::: "xmm0");
+    for (int i = 0; i < YIELDS; i++) {
+        asm volatile ("vaddps %%ymm0, %%ymm0, %%ymm0" ::: "xmm0");
+        sched_yield();
+    }
+}
+
+// Seconds per context switch, or a negative value on failure
+static double run(bool avx) {
+    int start[2];
+    if (pipe(start) == -1) {
+        perror("context-switch: pipe");
+        return -1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("context-switch: fork");
+            return -1;
+        }
+
+        if (pid == 0) {
+            close(start[1]);
+
+            char c;
+            if (read(start[0], &c, 1) != 0) {
+                _exit(EXIT_FAILURE);
+            }
+
+            if (avx) {
+                yield_loop_avx();
+            } else {
+                yield_loop();
+            }
+            _exit(EXIT_SUCCESS);
+        }
+    }
+
+    close(start[0]);
+
+    // Timed from out here, so the children do no floating point of their own
+    double begin = now();
+    close(start[1]);
+
+    bool failed = false;
+    int status;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            failed = true;
+        }
+    }
+    double elapsed = now() - begin;
+
+    if (failed) {
+        fprintf(stderr, "context-switch: a child failed\n");
+        return -1;
+    }
+
+    return elapsed / (2.0 * YIELDS);
+}
+
+int main(void) {
+    // The children inherit this, so they take turns on the same CPU
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(0, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        perror("context-switch: sched_setaffinity");
+        return EXIT_FAILURE;
+    }
+
+    double plain = run(false);
+    if (plain < 0) {
+        return EXIT_FAILURE;
+    }
+    printf("integer only: %.3fus per switch\n", plain * 1e6);
+
+    if (!__builtin_cpu_supports("avx")) {
+        printf("avx: not supported by this CPU, skipped\n");
+        return EXIT_SUCCESS;
+    }
+
+    double avx = run(true);
+    if (avx < 0) {
+        return EXIT_FAILURE;
+    }
+    printf("avx:          %.3fus per switch\n", avx * 1e6);
+
+    return EXIT_SUCCESS;
+}
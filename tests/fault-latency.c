@@ -0,0 +1,77 @@
+// Measures the cost of anonymous page faults, first while the pre-zeroed pool
+// of this CPU is full, then once a large mapping has used it up and faults
+// mostly zero their page themselves. The two figures stand for the fault
+// latency with and without the pool.
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define PAGE_SIZE 4096
+#define ITERATIONS 5
+
+// Below PMM_CPU_ZEROED_SIZE, and far above it
+#define WARM_PAGES 128
+#define TOTAL_PAGES 16384
+
+// Time for the zeroing thread to fill the pool back up
+#define REFILL_SECONDS 1
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double touch(volatile char *base, size_t first, size_t last) {
+    double start = now();
+    for (size_t i = first; i < last; i++) {
+        base[i * PAGE_SIZE] = 1;
+    }
+    return (now() - start) / (last - first);
+}
+
+int main(void) {
+    // The pools are per CPU, stay on one
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(0, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        perror("fault-latency: sched_setaffinity");
+        return EXIT_FAILURE;
+    }
+
+    double warm = 0, cold = 0;
+    for (int i = 0; i < ITERATIONS; i++) {
+        sleep(REFILL_SECONDS);
+
+        char *base = mmap(NULL, TOTAL_PAGES * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            perror("fault-latency: mmap");
+            return EXIT_FAILURE;
+        }
+
+        warm += touch(base, 0, WARM_PAGES);
+        // Skip what is left of the pool, and what the zeroing thread adds in
+        // the meantime
+        touch(base, WARM_PAGES, TOTAL_PAGES / 4);
+        cold += touch(base, TOTAL_PAGES / 4, TOTAL_PAGES);
+
+        if (munmap(base, TOTAL_PAGES * PAGE_SIZE) == -1) {
+            perror("fault-latency: munmap");
+            return EXIT_FAILURE;
+        }
+    }
+
+    warm /= ITERATIONS;
+    cold /= ITERATIONS;
+    printf("fault with a full pool:   %.2fus\n", warm * 1e6);
+    printf("fault with an empty pool: %.2fus\n", cold * 1e6);
+    printf("saved per fault: %.2fus (%.0f%%)\n", (cold - warm) * 1e6, (cold - warm) / cold * 100);
+    return EXIT_SUCCESS;
+}
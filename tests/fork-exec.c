@@ -0,0 +1,98 @@
+// Measures fork()+exec() and fork()+_exit() latency against the amount of
+// anonymous memory the parent has paged in. With copy-on-write fork the
+// latency should stay nearly flat as the parent grows.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define PAGE_SIZE 4096
+#define ITERATIONS 20
+#define EXEC_PATH "/usr/bin/true"
+
+static const size_t sizes_mib[] = {0, 16, 64, 256};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Seconds from fork() until the child has been reaped
+static double spawn(bool exec) {
+    double start = now();
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork-exec: fork");
+        return -1;
+    }
+
+    if (pid == 0) {
+        if (exec) {
+            execl(EXEC_PATH, EXEC_PATH, (char *)NULL);
+            _exit(127);
+        }
+        _exit(EXIT_SUCCESS);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("fork-exec: waitpid");
+        return -1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "fork-exec: the child failed, is " EXEC_PATH " there?\n");
+        return -1;
+    }
+
+    return now() - start;
+}
+
+static double average(bool exec) {
+    double total = 0;
+    for (int i = 0; i < ITERATIONS; i++) {
+        double t = spawn(exec);
+        if (t < 0) {
+            return -1;
+        }
+        total += t;
+    }
+    return total / ITERATIONS;
+}
+
+int main(void) {
+    printf("%10s %14s %14s\n", "size", "fork+exit", "fork+exec");
+
+    for (size_t i = 0; i < sizeof(sizes_mib) / sizeof(sizes_mib[0]); i++) {
+        size_t size = sizes_mib[i] * 1024 * 1024;
+
+        char *mem = NULL;
+        if (size != 0) {
+            mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) {
+                perror("fork-exec: mmap");
+                return EXIT_FAILURE;
+            }
+            memset(mem, 1, size);
+        }
+
+        double fork_exit = average(false);
+        double fork_exec = average(true);
+        if (fork_exit < 0 || fork_exec < 0) {
+            return EXIT_FAILURE;
+        }
+        printf("%7zuMiB %12.1fus %12.1fus\n", sizes_mib[i], fork_exit * 1e6, fork_exec * 1e6);
+
+        if (mem != NULL) {
+            munmap(mem, size);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,151 @@
+// Forks and reaps short lived children over and over, and checks that the
+// memory in use and the PIDs handed out stay flat once the first round has
+// warmed up the caches.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define ROUNDS 50
+#define CHILDREN_PER_ROUND 200
+#define CHILD_TOUCH_PAGES 16
+
+// Slack for pages and objects parked in slabs and per-CPU caches
+#define PAGE_TOLERANCE 512
+#define OBJECT_TOLERANCE 256
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Pages used by the buddy allocator, minus the ones idling in per-CPU caches
+static long pages_in_use(void) {
+    FILE *f = fopen("/dev/meminfo", "r");
+    if (f == NULL) {
+        perror("fork-exit: /dev/meminfo");
+        return -1;
+    }
+
+    long used = -1, cached = -1;
+    char key[32];
+    long value;
+    while (fscanf(f, "%31s %ld", key, &value) == 2) {
+        if (strcmp(key, "used") == 0) {
+            used = value;
+        } else if (strcmp(key, "cached") == 0) {
+            cached = value;
+        }
+    }
+
+    fclose(f);
+    return used < 0 || cached < 0 ? -1 : used - cached;
+}
+
+// Live objects over all slab caches
+static long slab_objects(void) {
+    FILE *f = fopen("/dev/slabinfo", "r");
+    if (f == NULL) {
+        perror("fork-exit: /dev/slabinfo");
+        return -1;
+    }
+
+    char line[256];
+    long total = 0;
+    // Header
+    if (fgets(line, sizeof(line), f) == NULL) {
+        fclose(f);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char name[64];
+        long objsize, active;
+        if (sscanf(line, "%63s %ld %ld", name, &objsize, &active) == 3) {
+            total += active;
+        }
+    }
+
+    fclose(f);
+    return total;
+}
+
+static pid_t run_round(void) {
+    pid_t max_pid = 0;
+
+    for (int i = 0; i < CHILDREN_PER_ROUND; i++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork-exit: fork");
+            return -1;
+        }
+        if (pid == 0) {
+            volatile char pages[CHILD_TOUCH_PAGES * 4096];
+            for (size_t j = 0; j < sizeof(pages); j += 4096) {
+                pages[j] = 1;
+            }
+            _exit(EXIT_SUCCESS);
+        }
+        if (pid > max_pid) {
+            max_pid = pid;
+        }
+    }
+
+    for (int i = 0; i < CHILDREN_PER_ROUND; i++) {
+        int status;
+        if (wait(&status) == -1) {
+            perror("fork-exit: wait");
+            return -1;
+        }
+    }
+
+    return max_pid;
+}
+
+int main(void) {
+    if (run_round() == -1) {
+        return EXIT_FAILURE;
+    }
+
+    long pages_before = pages_in_use();
+    long objects_before = slab_objects();
+    if (pages_before < 0 || objects_before < 0) {
+        return EXIT_FAILURE;
+    }
+
+    pid_t max_pid = 0;
+    double start = now();
+    for (int round = 0; round < ROUNDS; round++) {
+        pid_t round_max = run_round();
+        if (round_max == -1) {
+            return EXIT_FAILURE;
+        }
+        if (round_max > max_pid) {
+            max_pid = round_max;
+        }
+    }
+    double elapsed = now() - start;
+
+    long pages_after = pages_in_use();
+    long objects_after = slab_objects();
+    if (pages_after < 0 || objects_after < 0) {
+        return EXIT_FAILURE;
+    }
+
+    int forks = ROUNDS * CHILDREN_PER_ROUND;
+    printf("%d forks in %.2fs, %.1fus per fork and reap\n", forks, elapsed, elapsed * 1e6 / forks);
+    printf("pages in use: %ld before, %ld after\n", pages_before, pages_after);
+    printf("slab objects: %ld before, %ld after\n", objects_before, objects_after);
+    printf("highest pid: %d\n", max_pid);
+
+    // With PIDs reused, they stay well below the number of forks
+    bool pass = pages_after - pages_before <= PAGE_TOLERANCE
+             && objects_after - objects_before <= OBJECT_TOLERANCE
+             && max_pid < forks / 2;
+    printf("fork-exit: %s\n", pass ? "PASS" : "FAIL");
+    return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,141 @@
+// Hammers one kernel spinlock from 1, 2, 4, ... processes, one per CPU. They
+// all write and read single bytes on the same non-blocking pipe, so every
+// call takes the pipe's lock. Reports the total rate, and how evenly the
+// lock was shared: the slowest process's count over the fastest one's.
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define RUN_SECONDS 2
+#define MAX_WORKERS 64
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void worker(int cpu, int pipe_fds[2], int start_fd, int out_fd) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        perror("lock-contention: sched_setaffinity");
+        exit(EXIT_FAILURE);
+    }
+
+    char c;
+    if (read(start_fd, &c, 1) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // A full or empty pipe only means that the others got there first
+    long ops = 0;
+    double deadline = now() + RUN_SECONDS;
+    while (now() < deadline) {
+        for (int i = 0; i < 100; i++) {
+            c = 0;
+            (void)!write(pipe_fds[1], &c, 1);
+            (void)!read(pipe_fds[0], &c, 1);
+        }
+        ops += 200;
+    }
+
+    if (write(out_fd, &ops, sizeof(ops)) != sizeof(ops)) {
+        exit(EXIT_FAILURE);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+static int run(int workers, int cpu_ids[]) {
+    int shared[2], start[2], out[2];
+    if (pipe(shared) == -1 || pipe(start) == -1 || pipe(out) == -1) {
+        perror("lock-contention: pipe");
+        return -1;
+    }
+    if (fcntl(shared[0], F_SETFL, O_NONBLOCK) == -1 || fcntl(shared[1], F_SETFL, O_NONBLOCK) == -1) {
+        perror("lock-contention: fcntl");
+        return -1;
+    }
+
+    for (int i = 0; i < workers; i++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("lock-contention: fork");
+            return -1;
+        }
+        if (pid == 0) {
+            close(start[1]);
+            close(out[0]);
+            worker(cpu_ids[i], shared, start[0], out[1]);
+        }
+    }
+
+    close(shared[0]);
+    close(shared[1]);
+    close(start[0]);
+    close(out[1]);
+    close(start[1]);
+
+    long total = 0, min = -1, max = 0;
+    int reported = 0;
+    for (; reported < workers; reported++) {
+        long ops;
+        if (read(out[0], &ops, sizeof(ops)) != sizeof(ops)) {
+            break;
+        }
+        total += ops;
+        if (min == -1 || ops < min) {
+            min = ops;
+        }
+        if (ops > max) {
+            max = ops;
+        }
+    }
+
+    close(out[0]);
+    while (wait(NULL) > 0);
+
+    if (reported != workers) {
+        fprintf(stderr, "lock-contention: a worker failed\n");
+        return -1;
+    }
+
+    printf("%8d %16.0f %10.2f\n", workers, (double)total / RUN_SECONDS, (double)min / max);
+    return 0;
+}
+
+int main(void) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+        perror("lock-contention: sched_getaffinity");
+        return EXIT_FAILURE;
+    }
+
+    int cpu_ids[MAX_WORKERS];
+    int cpus = 0;
+    for (int i = 0; i < CPU_SETSIZE && cpus < MAX_WORKERS; i++) {
+        if (CPU_ISSET(i, &set)) {
+            cpu_ids[cpus++] = i;
+        }
+    }
+
+    printf("%8s %16s %10s\n", "cpus", "ops/s", "fairness");
+    for (int workers = 1; workers <= cpus; workers *= 2) {
+        if (run(workers, cpu_ids) == -1) {
+            return EXIT_FAILURE;
+        }
+        // Always finish with every CPU
+        if (workers < cpus && workers * 2 > cpus && run(cpus, cpu_ids) == -1) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,124 @@
+// Runs two CPU-bound processes at different nice levels on the same CPU, and
+// checks that the CPU time they get is proportional to their weights.
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define RUN_SECONDS 5
+#define TOLERANCE 0.2
+
+// Weights of nice 0 and nice 5, as in the kernel's nice_to_weight table
+#define LOW_NICE 0
+#define HIGH_NICE 5
+#define EXPECTED_RATIO (1024.0 / 335.0)
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void spin(int nice_level, int start_fd, int out_fd) {
+    if (setpriority(PRIO_PROCESS, 0, nice_level) == -1) {
+        perror("nice-share: setpriority");
+        exit(EXIT_FAILURE);
+    }
+
+    // Wait for the parent to close its end once both children exist, so
+    // neither gets a head start
+    char c;
+    if (read(start_fd, &c, 1) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    double deadline = now() + RUN_SECONDS;
+    while (now() < deadline) {
+        asm volatile ("" ::: "memory");
+    }
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == -1) {
+        perror("nice-share: getrusage");
+        exit(EXIT_FAILURE);
+    }
+
+    double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+               + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    if (write(out_fd, &cpu, sizeof(cpu)) != sizeof(cpu)) {
+        exit(EXIT_FAILURE);
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+int main(void) {
+    // Both children inherit this, so they compete for the same CPU
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(0, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        perror("nice-share: sched_setaffinity");
+        return EXIT_FAILURE;
+    }
+
+    int start[2];
+    if (pipe(start) == -1) {
+        perror("nice-share: pipe");
+        return EXIT_FAILURE;
+    }
+
+    int fds[2][2];
+    int nice_levels[2] = {LOW_NICE, HIGH_NICE};
+
+    for (int i = 0; i < 2; i++) {
+        if (pipe(fds[i]) == -1) {
+            perror("nice-share: pipe");
+            return EXIT_FAILURE;
+        }
+
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("nice-share: fork");
+            return EXIT_FAILURE;
+        }
+
+        if (pid == 0) {
+            close(start[1]);
+            close(fds[i][0]);
+            spin(nice_levels[i], start[0], fds[i][1]);
+        }
+
+        close(fds[i][1]);
+    }
+
+    close(start[0]);
+    close(start[1]);
+
+    double cpu[2];
+    for (int i = 0; i < 2; i++) {
+        if (read(fds[i][0], &cpu[i], sizeof(cpu[i])) != sizeof(cpu[i])) {
+            fprintf(stderr, "nice-share: child %d did not report its CPU time\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    while (wait(NULL) > 0);
+
+    double ratio = cpu[0] / cpu[1];
+    printf("nice %d: %.3fs, nice %d: %.3fs, ratio %.2f (expected %.2f)\n",
+           LOW_NICE, cpu[0], HIGH_NICE, cpu[1], ratio, EXPECTED_RATIO);
+
+    if (ratio < EXPECTED_RATIO * (1 - TOLERANCE) || ratio > EXPECTED_RATIO * (1 + TOLERANCE)) {
+        printf("nice-share: FAIL\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("nice-share: PASS\n");
+    return EXIT_SUCCESS;
+}
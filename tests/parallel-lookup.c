@@ -0,0 +1,200 @@
+// Measures how path lookups and UDP socket demux scale with the number of
+// processes doing them at the same time. Each process runs on its own CPU
+// when there are enough of them.
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RUN_SECONDS 2
+#define MAX_WORKERS 64
+#define UDP_BASE_PORT 40000
+
+#define LOOKUP_DIR "/tmp/parallel-lookup"
+#define LOOKUP_PATH LOOKUP_DIR "/a/b/c/d/e/file"
+
+enum bench {
+    BENCH_STAT,
+    BENCH_UDP,
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cpu_count(void) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+        return 1;
+    }
+    return CPU_COUNT(&set);
+}
+
+static int make_tree(void) {
+    const char *dirs[] = {
+        LOOKUP_DIR, LOOKUP_DIR "/a", LOOKUP_DIR "/a/b", LOOKUP_DIR "/a/b/c",
+        LOOKUP_DIR "/a/b/c/d", LOOKUP_DIR "/a/b/c/d/e",
+    };
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        if (mkdir(dirs[i], 0755) == -1 && errno != EEXIST) {
+            perror("parallel-lookup: mkdir");
+            return -1;
+        }
+    }
+
+    FILE *f = fopen(LOOKUP_PATH, "w");
+    if (f == NULL) {
+        perror("parallel-lookup: " LOOKUP_PATH);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+static long run_stat(double deadline) {
+    long ops = 0;
+    struct stat st;
+    while (now() < deadline) {
+        for (int i = 0; i < 100; i++) {
+            if (stat(LOOKUP_PATH, &st) == -1) {
+                perror("parallel-lookup: stat");
+                return -1;
+            }
+        }
+        ops += 100;
+    }
+    return ops;
+}
+
+// Round trips to a socket of our own over loopback, so every packet goes
+// through the demux on the way in
+static long run_udp(int worker, double deadline) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        perror("parallel-lookup: socket");
+        return -1;
+    }
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(UDP_BASE_PORT + worker),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("parallel-lookup: bind");
+        return -1;
+    }
+
+    long ops = 0;
+    char buf[64] = {0};
+    while (now() < deadline) {
+        if (sendto(fd, buf, sizeof(buf), 0, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            perror("parallel-lookup: sendto");
+            return -1;
+        }
+        if (recv(fd, buf, sizeof(buf), 0) == -1) {
+            perror("parallel-lookup: recv");
+            return -1;
+        }
+        ops++;
+    }
+
+    close(fd);
+    return ops;
+}
+
+static void worker(enum bench bench, int index, int cpus, int start_fd, int out_fd) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % cpus, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+
+    char c;
+    if (read(start_fd, &c, 1) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    double deadline = now() + RUN_SECONDS;
+    long ops = bench == BENCH_STAT ? run_stat(deadline) : run_udp(index, deadline);
+    if (write(out_fd, &ops, sizeof(ops)) != sizeof(ops)) {
+        exit(EXIT_FAILURE);
+    }
+
+    exit(ops < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+// Operations per second over all workers
+static double run(enum bench bench, int workers, int cpus) {
+    int start[2], out[2];
+    if (pipe(start) == -1 || pipe(out) == -1) {
+        perror("parallel-lookup: pipe");
+        return -1;
+    }
+
+    for (int i = 0; i < workers; i++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("parallel-lookup: fork");
+            return -1;
+        }
+        if (pid == 0) {
+            close(start[1]);
+            close(out[0]);
+            worker(bench, i, cpus, start[0], out[1]);
+        }
+    }
+
+    close(start[0]);
+    close(out[1]);
+    close(start[1]);
+
+    long total = 0;
+    bool failed = false;
+    for (int i = 0; i < workers; i++) {
+        long ops;
+        if (read(out[0], &ops, sizeof(ops)) != sizeof(ops) || ops < 0) {
+            failed = true;
+            break;
+        }
+        total += ops;
+    }
+
+    close(out[0]);
+    while (wait(NULL) > 0);
+
+    return failed ? -1 : (double)total / RUN_SECONDS;
+}
+
+int main(void) {
+    if (make_tree() == -1) {
+        return EXIT_FAILURE;
+    }
+
+    int cpus = cpu_count();
+    int max_workers = cpus * 2 < MAX_WORKERS ? cpus * 2 : MAX_WORKERS;
+
+    printf("%8s %16s %16s\n", "workers", "stat/s", "udp rtt/s");
+    for (int workers = 1; workers <= max_workers; workers *= 2) {
+        double stat_rate = run(BENCH_STAT, workers, cpus);
+        double udp_rate = run(BENCH_UDP, workers, cpus);
+        if (stat_rate < 0 || udp_rate < 0) {
+            fprintf(stderr, "parallel-lookup: a worker failed\n");
+            return EXIT_FAILURE;
+        }
+        printf("%8d %16.0f %16.0f\n", workers, stat_rate, udp_rate);
+    }
+
+    return EXIT_SUCCESS;
+}
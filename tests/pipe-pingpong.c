@@ -0,0 +1,116 @@
+// Measures the round trip time of a byte bounced between two processes over
+// a pair of pipes. Every read blocks, so each round trip is two sleeps and two
+// wake ups. Runs once with both processes on the same CPU, where each round
+// trip is two context switches, and once with them on different CPUs.
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define ROUND_TRIPS 100000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+// Round trip time in seconds, or a negative value on failure
+static double run(int parent_cpu, int child_cpu) {
+    int ping[2], pong[2];
+    if (pipe(ping) == -1 || pipe(pong) == -1) {
+        perror("pipe-pingpong: pipe");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("pipe-pingpong: fork");
+        return -1;
+    }
+
+    if (pid == 0) {
+        close(ping[1]);
+        close(pong[0]);
+        if (pin(child_cpu) == -1) {
+            perror("pipe-pingpong: sched_setaffinity");
+            _exit(EXIT_FAILURE);
+        }
+
+        char c;
+        while (read(ping[0], &c, 1) == 1) {
+            if (write(pong[1], &c, 1) != 1) {
+                _exit(EXIT_FAILURE);
+            }
+        }
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(ping[0]);
+    close(pong[1]);
+    if (pin(parent_cpu) == -1) {
+        perror("pipe-pingpong: sched_setaffinity");
+        return -1;
+    }
+
+    double ret = -1;
+    char c = 0;
+
+    // Warm up, and make sure the child has settled on its CPU
+    for (int i = 0; i < 1000; i++) {
+        if (write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1) {
+            fprintf(stderr, "pipe-pingpong: the child went away\n");
+            goto cleanup;
+        }
+    }
+
+    double start = now();
+    for (int i = 0; i < ROUND_TRIPS; i++) {
+        if (write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1) {
+            fprintf(stderr, "pipe-pingpong: the child went away\n");
+            goto cleanup;
+        }
+    }
+    ret = (now() - start) / ROUND_TRIPS;
+
+cleanup:
+    close(ping[1]);
+    close(pong[0]);
+    waitpid(pid, NULL, 0);
+    return ret;
+}
+
+int main(void) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+        perror("pipe-pingpong: sched_getaffinity");
+        return EXIT_FAILURE;
+    }
+
+    double same = run(0, 0);
+    if (same < 0) {
+        return EXIT_FAILURE;
+    }
+    printf("same CPU:       %.2fus per round trip\n", same * 1e6);
+
+    if (CPU_COUNT(&set) > 1) {
+        double cross = run(0, 1);
+        if (cross < 0) {
+            return EXIT_FAILURE;
+        }
+        printf("different CPUs: %.2fus per round trip\n", cross * 1e6);
+    }
+
+    return EXIT_SUCCESS;
+}